@@ -7,17 +7,22 @@ DEBUG_CODE(thread_local bool ts::AccessSynchronizer::is_any_asset_locked_ = fals
 
 namespace ts
 {
-	Pool<AccessSynchronizer::CollectionNode, kSynchronizerNodePoolSize
-#if THREAD_SMART_POOL
-			, kWorkeThreadsNum, InitPoolSizePerThread(kSynchronizerNodePoolSize), MaxPoolSizePerThread(kSynchronizerNodePoolSize)
-#endif
-		>g_synchronizer_nodes_pool;
+	Pool<AccessSynchronizer::CollectionNode, kSynchronizerNodePoolSize, kSynchronizerNodePoolMaxSize> g_synchronizer_nodes_pool;
+	static_assert((decltype(g_synchronizer_nodes_pool)::kMaxSegments << kPoolOffsetBits) <= (std::size_t{ 1 } << AccessSynchronizer::kCollectionIndexBits),
+		"A collection index does not fit AccessSynchronizer::State, decrease kSynchronizerNodePoolMaxSize");
 
-	std::span<AccessSynchronizer::CollectionNode> AccessSynchronizer::CollectionNode::GetPoolSpan()
+	const PoolSegmentTable& AccessSynchronizer::CollectionNode::GetPoolSegments()
 	{
-		return g_synchronizer_nodes_pool.GetPoolSpan();
+		return g_synchronizer_nodes_pool.GetSegments();
 	}
 
+#if THREAD_SMART_POOL
+	void AccessSynchronizer::CollectionNode::ResizeThreadCaches(uint16 num_threads)
+	{
+		g_synchronizer_nodes_pool.ResizeThreadCaches(num_threads);
+	}
+#endif
+
 	AccessSynchronizer::CollectionIndex AccessSynchronizer::CollectionNode::Acquire()
 	{
 		auto& node = g_synchronizer_nodes_pool.Acquire();
@@ -52,6 +57,16 @@ namespace ts
 			len);
 	}
 
+	uint32 AccessSynchronizer::CollectionNode::GetChainLength(AccessSynchronizer::CollectionIndex head)
+	{
+		uint32 len = 0;
+		for (CollectionIndex current = head; current.IsValid(); current = FromPoolIndex(current).NextRef())
+		{
+			len++;
+		}
+		return len;
+	}
+
 	void AccessSynchronizer::SyncMultiResult::HandleOnTask(const AccessSynchronizer::SyncMultiResult result, BaseTask& task)
 	{
 		if (!result.len_)
@@ -20,8 +20,12 @@ namespace ts
 		{
 			static CollectionIndex Acquire();
 			static void Release(CollectionIndex index);
-			static std::span<CollectionNode> GetPoolSpan();
+			static const PoolSegmentTable& GetPoolSegments();
 			static void ReleaseChain(CollectionIndex head);
+			static uint32 GetChainLength(CollectionIndex head);
+#if THREAD_SMART_POOL
+			static void ResizeThreadCaches(uint16 num_threads);
+#endif
 
 			TRefCountPoolPtr<BaseTask> task_;
 			CollectionIndex next_;
@@ -39,21 +43,73 @@ namespace ts
 			}
 		};
 
+		static constexpr uint32 kTaskIndexBits = 24;
+		static constexpr uint32 kCollectionIndexBits = 16;
+		static_assert((kMaxPoolSegments << kPoolOffsetBits) <= (std::size_t{ 1 } << kTaskIndexBits), "A task index does not fit State");
+
+		// 64 bits, so the atomic is lock-free. Indices are truncated, all ones is invalid (a pool never uses it, see kPoolOffsetBits).
 		struct State
 		{
-			TaskIndex last_task_;
-			CollectionIndex shared_collection_head_;
-			uint16 shared_collection_size_ = 0;//TODO uint8
-			uint16 released_shared_tasks_ = 0;
-			//CollectionTag shared_collection_tag_; // Not neeeded, shared_collection_size_ and tag_ should be unique enough
-			GateTag last_task_tag_;
-			SynchroniserTag tag_; //bumped when shared collection is reset
+			static constexpr uint64 kInvalidTask = (uint64{ 1 } << kTaskIndexBits) - 1;
+			static constexpr uint64 kInvalidCollection = (uint64{ 1 } << kCollectionIndexBits) - 1;
+			static constexpr uint32 kMaxSharedTasks = 255; // when exceeded, a shared task syncs as exclusive
+
+			uint64 last_task_ : kTaskIndexBits = kInvalidTask;
+			uint64 shared_collection_head_ : kCollectionIndexBits = kInvalidCollection;
+			uint64 shared_tasks_ : 8 = 0; // not released tasks in the shared collection, it is reset when the last one is released
+			uint64 last_task_tag_ : 8 = 0; // GateTag
+			uint64 tag_ : 8 = 0; // SynchroniserTag, bumped when shared collection is reset
+
+			TaskIndex GetLastTask() const
+			{
+				return TaskIndex{ (last_task_ == kInvalidTask) ? kInvalidIndex : static_cast<Index>(last_task_) };
+			}
+
+			void SetLastTask(const TaskIndex task, const GateTag task_tag)
+			{
+				assert(!task.IsValid() || (task.RawValue() < kInvalidTask));
+				last_task_ = task.RawValue() & kInvalidTask;
+				last_task_tag_ = task_tag.RawValue();
+			}
+
+			GateTag GetLastTaskTag() const
+			{
+				return GateTag::FromRawValue(static_cast<uint8>(last_task_tag_));
+			}
+
+			CollectionIndex GetSharedCollectionHead() const
+			{
+				return CollectionIndex{ (shared_collection_head_ == kInvalidCollection) ? kInvalidIndex : static_cast<Index>(shared_collection_head_) };
+			}
+
+			void AddShared(const CollectionIndex node)
+			{
+				assert(node.RawValue() < kInvalidCollection);
+				assert(shared_tasks_ < kMaxSharedTasks);
+				shared_collection_head_ = node.RawValue();
+				shared_tasks_++;
+			}
+
+			void ResetSharedCollection()
+			{
+				shared_collection_head_ = kInvalidCollection;
+				shared_tasks_ = 0;
+				tag_++; // wraps
+			}
+
+			SynchroniserTag GetTag() const
+			{
+				return SynchroniserTag::FromRawValue(static_cast<uint8>(tag_));
+			}
 
 			void Validate()
 			{
-				assert(!last_task_.IsValid() || FromPoolIndex(last_task_).GetRefCount() > 0);
+				assert(!GetLastTask().IsValid() || FromPoolIndex(GetLastTask()).GetRefCount() > 0);
+				assert(GetSharedCollectionHead().IsValid() == (shared_tasks_ > 0));
 			}
 		};
+		static_assert(sizeof(State) == sizeof(uint64));
+		static_assert(std::atomic<State>::is_always_lock_free);
 
 		struct SyncMultiResult
 		{
@@ -67,6 +123,7 @@ namespace ts
 			//Common
 			uint32 len_ = 0; // num of elements in chain
 			SynchroniserTag synchroniser_tag_;
+			bool exclusive_ = false; // SyncShared over State::kMaxSharedTasks, see SyncShared
 
 			void ResetNoRelease()
 			{
@@ -75,6 +132,7 @@ namespace ts
 				head_.Reset();
 				len_ = 0;
 				synchroniser_tag_.Reset();
+				exclusive_ = false;
 			}
 
 			void SetSingle(TRefCountPoolPtr<BaseTask> in_task, GateTag in_task_tag)
@@ -125,38 +183,38 @@ namespace ts
 				result.ResetNoRelease();
 
 				new_state = prev_state;
-				new_state.last_task_ = task_index;
-				new_state.last_task_tag_ = task_tag;
+				new_state.SetLastTask(task_index, task_tag);
 
-				if (prev_state.shared_collection_size_) // return shared collection, then clear it
+				if (prev_state.shared_tasks_) // return shared collection, then clear it
 				{
-					assert(prev_state.shared_collection_head_.IsValid());
-					result.SetMulti(prev_state.shared_collection_head_, prev_state.shared_collection_size_);
-
-					new_state.shared_collection_size_ = 0;
-					new_state.shared_collection_head_.Reset();
-					new_state.released_shared_tasks_ = 0;
-					new_state.tag_ = prev_state.tag_.Next();
+					new_state.ResetSharedCollection();
 				}
-				else if (prev_state.last_task_.IsValid()) // return previous exclusive_task
+				else if (prev_state.GetLastTask().IsValid()) // return previous exclusive_task
 				{
 					result.SetSingle(
-						TRefCountPoolPtr<BaseTask>(prev_state.last_task_, false),
-						prev_state.last_task_tag_);
+						TRefCountPoolPtr<BaseTask>(prev_state.GetLastTask(), false),
+						prev_state.GetLastTaskTag());
 				}
 			} while (!state_.compare_exchange_weak(prev_state, new_state,
 				std::memory_order_release,
 				std::memory_order_relaxed));
 
-			// release previous (replaced) exclusive task, that was not returned
-			if (prev_state.shared_collection_size_ && prev_state.last_task_.IsValid())
+			if (prev_state.shared_tasks_)
 			{
-				assert(prev_state.last_task_ != new_state.last_task_);
-				FromPoolIndex(prev_state.last_task_).Release();
+				// The collection is detached now, so it can be walked. Its length is not in the state.
+				const CollectionIndex head = prev_state.GetSharedCollectionHead();
+				result.SetMulti(head, CollectionNode::GetChainLength(head));
+
+				// release previous (replaced) exclusive task, that was not returned
+				if (prev_state.GetLastTask().IsValid())
+				{
+					assert(prev_state.GetLastTask() != new_state.GetLastTask());
+					FromPoolIndex(prev_state.GetLastTask()).Release();
+				}
 			}
 
 			new_state.Validate();
-			result.SetSynchroniserTag(new_state.tag_);
+			result.SetSynchroniserTag(new_state.GetTag());
 			return result;
 		}
 
@@ -171,15 +229,14 @@ namespace ts
 			State new_state;
 			do
 			{
-				if (prev_state.shared_collection_size_ || prev_state.last_task_.IsValid())
+				if (prev_state.shared_tasks_ || prev_state.GetLastTask().IsValid())
 				{
 					task.Release();
 					prev_state.Validate();
 					return false;
 				}
 				new_state = prev_state;
-				new_state.last_task_ = task_index;
-				new_state.last_task_tag_ = task_tag;
+				new_state.SetLastTask(task_index, task_tag);
 			} while (!state_.compare_exchange_weak(prev_state, new_state,
 				std::memory_order_release,
 				std::memory_order_relaxed));
@@ -189,6 +246,8 @@ namespace ts
 			return true;
 		}
 
+		// When the collection already has State::kMaxSharedTasks not released tasks, the task is synced as exclusive
+		// (result.exclusive_), it must be released with ReleaseExclusive.
 		SyncMultiResult SyncShared(BaseTask& task, const GateTag task_tag)
 		{
 			assert(task.GetRefCount() > 0);
@@ -203,13 +262,18 @@ namespace ts
 
 			do
 			{
+				if (prev_state.shared_tasks_ == State::kMaxSharedTasks)
+				{
+					CollectionNode::Release(allocated_node);
+					SyncMultiResult result = SyncExclusive(task, task_tag);
+					result.exclusive_ = true;
+					return result;
+				}
+
 				new_state = prev_state;
-				new_state.shared_collection_head_ = allocated_node;
-				new_state.shared_collection_size_ = prev_state.shared_collection_size_ + 1;
-				assert(new_state.shared_collection_size_);
-				assert(new_state.released_shared_tasks_ < new_state.shared_collection_size_);
+				new_state.AddShared(allocated_node);
 
-				node.NextRef() = prev_state.shared_collection_head_;
+				node.NextRef() = prev_state.GetSharedCollectionHead();
 
 			} while (!state_.compare_exchange_weak(prev_state, new_state,
 				std::memory_order_release,
@@ -218,8 +282,8 @@ namespace ts
 			new_state.Validate();
 
 			SyncMultiResult result;
-			result.SetSingle(TRefCountPoolPtr<BaseTask>(prev_state.last_task_), prev_state.last_task_tag_);
-			result.SetSynchroniserTag(new_state.tag_);
+			result.SetSingle(TRefCountPoolPtr<BaseTask>(prev_state.GetLastTask()), prev_state.GetLastTaskTag());
+			result.SetSynchroniserTag(new_state.GetTag());
 			return result;
 		}
 
@@ -234,7 +298,7 @@ namespace ts
 
 			do
 			{
-				if (prev_state.last_task_.IsValid())
+				if (prev_state.GetLastTask().IsValid() || (prev_state.shared_tasks_ == State::kMaxSharedTasks))
 				{
 					if (allocated_node.IsValid())
 					{
@@ -253,19 +317,16 @@ namespace ts
 				}
 
 				new_state = prev_state;
-				new_state.shared_collection_head_ = allocated_node;
-				new_state.shared_collection_size_ = prev_state.shared_collection_size_ + 1;
-				assert(new_state.shared_collection_size_);
-				assert(new_state.released_shared_tasks_ < new_state.shared_collection_size_);
+				new_state.AddShared(allocated_node);
 
-				FromPoolIndex(allocated_node).NextRef() = prev_state.shared_collection_head_;
+				FromPoolIndex(allocated_node).NextRef() = prev_state.GetSharedCollectionHead();
 
 			} while (!state_.compare_exchange_weak(prev_state, new_state,
 				std::memory_order_release,
 				std::memory_order_relaxed));
 
 			new_state.Validate();
-			return new_state.tag_;
+			return new_state.GetTag();
 		}
 
 		void ReleaseExclusive(BaseTask& task)
@@ -276,14 +337,13 @@ namespace ts
 			State new_state;
 			do
 			{
-				if (prev_state.last_task_ != expexted)
+				if (prev_state.GetLastTask() != expexted)
 				{
 					prev_state.Validate();
 					return;
 				}
 				new_state = prev_state;
-				new_state.last_task_.Reset();
-				new_state.last_task_tag_.Reset();
+				new_state.SetLastTask(TaskIndex{}, GateTag{});
 			} while (!state_.compare_exchange_weak(prev_state, new_state,
 				std::memory_order_release,
 				std::memory_order_relaxed));
@@ -303,23 +363,19 @@ namespace ts
 			CollectionIndex node_chain_to_release;
 			do
 			{
-				if (prev_state.tag_ != sync_tag)
+				if (prev_state.GetTag() != sync_tag)
 				{
 					prev_state.Validate();
 					return; //already released
 				}
 				new_state = prev_state;
-				assert(new_state.released_shared_tasks_ < new_state.shared_collection_size_);
-				new_state.released_shared_tasks_ = prev_state.released_shared_tasks_ + 1;
+				assert(new_state.shared_tasks_);
+				new_state.shared_tasks_--;
 
-				if (new_state.released_shared_tasks_ == new_state.shared_collection_size_)
+				if (!new_state.shared_tasks_)
 				{
-					node_chain_to_release = prev_state.shared_collection_head_;
-
-					new_state.shared_collection_size_ = 0;
-					new_state.shared_collection_head_.Reset();
-					new_state.released_shared_tasks_ = 0;
-					new_state.tag_ = prev_state.tag_.Next();
+					node_chain_to_release = prev_state.GetSharedCollectionHead();
+					new_state.ResetSharedCollection();
 				}
 				else
 				{
@@ -521,7 +577,7 @@ namespace ts
 			TRefCountPtr<BaseTask> task;
 #if TASK_RETRIGGER
 			BaseTask* local_current_task = BaseTask::GetCurrentTask();
-			if (local_current_task && (kInvalidIndex != t_worker_thread_idx) 
+			if (local_current_task && (kInvalidThreadIndex != t_worker_thread_idx) 
 				&& (local_current_task->GetRefCount() == 1)) // So noone can insert dependency during this scope
 			{
 				local_current_task->SetRetrigger();
@@ -533,7 +589,7 @@ namespace ts
 #endif
 			{
 				assert(handle);
-				task = TaskSystem::CreateTask([handle](BaseTask&){ handle.resume(); });
+				task = TaskSystem::CreateTask([handle](BaseTask&){ handle.resume(); }, InheritPriority(ETaskFlags::NotCancellable));
 			}
 
 			assert(resource_);
@@ -551,8 +607,8 @@ namespace ts
 	template<SyncT TValue>
 	struct SharedAccessScopeCo
 	{
-		SharedAccessScopeCo(TValue* resource, AccessSynchronizer::SynchroniserTag synchroniser_tag)
-			: resource_(std::move(resource)), synchroniser_tag_(synchroniser_tag)
+		SharedAccessScopeCo(TValue* resource, AccessSynchronizer::SynchroniserTag synchroniser_tag, bool exclusive = false)
+			: resource_(std::move(resource)), synchroniser_tag_(synchroniser_tag), exclusive_(exclusive)
 		{
 			assert(resource_);
 		}
@@ -569,7 +625,14 @@ namespace ts
 			assert(local_current_task);
 			Gate& gate = local_current_task->GetGate();
 			assert(gate.GetState() == ETaskState::PendingOrExecuting);
-			resource_->synchronizer_.ReleaseShared(*local_current_task, synchroniser_tag_);
+			if (exclusive_)
+			{
+				resource_->synchronizer_.ReleaseExclusive(*local_current_task);
+			}
+			else
+			{
+				resource_->synchronizer_.ReleaseShared(*local_current_task, synchroniser_tag_);
+			}
 			constexpr bool bump_tag = true;
 			const uint32 unblocked = gate.Unblock(ETaskState::PendingOrExecuting, nullptr, bump_tag);
 			assert(unblocked <= 1);
@@ -579,6 +642,7 @@ namespace ts
 	private:
 		TValue* resource_;
 		AccessSynchronizer::SynchroniserTag synchroniser_tag_;
+		bool exclusive_ = false; // synced as exclusive, see AccessSynchronizer::SyncShared
 	};
 
 	template<SyncT TValue>
@@ -606,7 +670,7 @@ namespace ts
 			TRefCountPtr<BaseTask> task;
 #if TASK_RETRIGGER
 			BaseTask* local_current_task = BaseTask::GetCurrentTask();
-			if (local_current_task && (kInvalidIndex != t_worker_thread_idx) 
+			if (local_current_task && (kInvalidThreadIndex != t_worker_thread_idx) 
 				&& (local_current_task->GetRefCount() == 1)) // So noone can insert dependency during this scope
 			{
 				local_current_task->SetRetrigger();
@@ -618,23 +682,25 @@ namespace ts
 #endif
 			{
 				assert(handle);
-				task = TaskSystem::CreateTask([handle](BaseTask&){ handle.resume(); });
+				task = TaskSystem::CreateTask([handle](BaseTask&){ handle.resume(); }, InheritPriority(ETaskFlags::NotCancellable));
 			}
 
 			assert(resource_);
 			AccessSynchronizer::SyncMultiResult result = resource_->synchronizer_.SyncShared(*task, task->GetTag());
 			assert(!synrchoniser_tag_);
 			synrchoniser_tag_ = result.synchroniser_tag_;
+			exclusive_ = result.exclusive_;
 
 			AccessSynchronizer::SyncMultiResult::HandleOnTask(std::move(result), *task);
 		}
 		auto await_resume()
 		{
 			assert(synrchoniser_tag_);
-			return SharedAccessScopeCo<TValue>{std::move(resource_), *synrchoniser_tag_};
+			return SharedAccessScopeCo<TValue>{std::move(resource_), *synrchoniser_tag_, exclusive_};
 		}
 	private:
 		TValue* resource_;
 		std::optional<AccessSynchronizer::SynchroniserTag> synrchoniser_tag_;
+		bool exclusive_ = false;
 	};
 }
\ No newline at end of file
@@ -158,10 +158,13 @@ int main()
     TaskSystem::AsyncResume(render(guarded_graphic_container, tick_sync));
 
     //SyncHolder<GraphicContainer*> graphic_holder(&graphic_container);
+    std::vector<DetachHandle> ants;
+    ants.reserve(number_ants);
     for (uint32 idx = 0; idx < number_ants; idx++)
     {
-        TaskSystem::AsyncResume(ant(guarded_graphic_container, idx, tick_sync));
+        ants.emplace_back(ant(guarded_graphic_container, idx, tick_sync));
     }
+    TaskSystem::AsyncResumeMany(ants);
 
     TaskSystem::WaitForWorkerThreadsToJoin();
     detail::ensure_allocator_free();
@@ -1,34 +1,69 @@
 #pragma once
 
 #include "Future.h"
-#include <functional>
+#include "Cancellation.h"
+#include "InplaceFunction.h"
 
 namespace ts
 {
-	class BaseTask : public GenericFuture
+	struct ReadyTaskChains;
+	class RecurringTask;
+	class BaseTask;
+
+	using TaskFunction = InplaceFunction<void(BaseTask&), kTaskFunctorInlineSize>;
+
+	// Cold part of a pooled task, in a separate array of the same pool segment (the pool companion), see BaseTask::Payload.
+	// Used only by the thread creating and the thread executing the task, so it is not padded.
+	struct TaskPayload
+	{
+		TaskFunction function_;
+		CancellationToken cancellation_;
+		RecurringTask* recurring_ = nullptr; // the task is re-armed after execution, see RecurringTask
+		uint64 timer_tick_ = 0; // when a delayed task gets ready, see TaskSystem::InitializeTaskAt
+#if TASK_RETRIGGER
+		bool retrigger_ = false;
+#endif
+		DEBUG_CODE(std::source_location source;)
+	};
+
+	// A pool slot is a single cache line with the fields touched by other threads (refcount, gate, prerequisite counter),
+	// so workers using neighbouring tasks do not false-share. Everything else is in TaskPayload.
+	class alignas(kCacheLineSize) BaseTask : public GenericFuture
 	{
 	public:
 		using IndexType = BaseIndex<BaseTask>;
-		static std::span<BaseTask> GetPoolSpan();
+		static const PoolSegmentTable& GetPoolSegments();
 		static BaseTask* GetCurrentTask();
 
-		static void OnUnblocked(TRefCountPtr<BaseTask> task, TRefCountPtr<BaseTask>* out_first_ready_dependency);
+		// With out_chains, a ready task is only linked into them. The caller pushes the chains.
+		// With prerequisite_cancelled, the task will be cancelled instead of executed.
+		static void OnUnblocked(TRefCountPtr<BaseTask> task, TRefCountPtr<BaseTask>* out_first_ready_dependency,
+			ReadyTaskChains* out_chains, bool prerequisite_cancelled = false);
 		void Execute(TRefCountPtr<BaseTask>* out_first_ready_dependency = nullptr);
 
 		ETaskFlags GetFlags() const { return flag_; }
 
+		const CancellationToken& GetCancellationToken() const { return Payload().cancellation_; }
+
 		IndexType& NextRef() 
 		{ 
 			static_assert(sizeof(IndexType) == sizeof(Index), "IndexType must be same size as Index");
 			return *reinterpret_cast<IndexType*>(&next_);
 		}
+
+		// Valid only for a chain not yet submitted, see TaskSystem::CreateTaskChain
+		BaseTask* NextInChain()
+		{
+			const IndexType next = NextRef();
+			return next.IsValid() ? &FromPoolIndex<BaseTask>(next) : nullptr;
+		}
 #if TASK_RETRIGGER
 		void SetRetrigger()
 		{
 			assert(!result_.HasValue());
 			assert(flag_ == ETaskFlags::None);
-			assert(!retrigger_);
-			retrigger_ = true;
+			assert(!Payload().retrigger_);
+			Payload().retrigger_ = true;
 		}
 #endif
 #pragma region protected
@@ -36,14 +71,12 @@ namespace ts
 		friend class TaskSystem;
 		friend class GenericFuture;
 		friend struct AccessSynchronizer;
+		friend class TaskGraph;
+		friend class RecurringTask;
+		friend struct TimerWheel;
 
-		std::atomic<uint16> prerequires_ = 0;
-		ETaskFlags flag_ = ETaskFlags::None;
-#if TASK_RETRIGGER
-		bool retrigger_ = false;
-#endif
-		std::move_only_function<void(BaseTask&)> function_;
-		DEBUG_CODE(std::source_location source;)
+		TaskPayload& Payload();
+		const TaskPayload& Payload() const;
 #pragma endregion
 	};
 }
\ No newline at end of file
@@ -0,0 +1,83 @@
+#pragma once
+
+#include "RefCount.h"
+
+namespace ts
+{
+	struct CancellationState : public TRefCounted<CancellationState>
+	{
+		std::atomic<bool> cancelled_ = false;
+	};
+
+	// Cheap to copy. A default constructed token is never cancelled.
+	class CancellationToken
+	{
+	public:
+		CancellationToken() = default;
+
+		bool IsCancellationRequested() const
+		{
+			return state_ && state_->cancelled_.load(std::memory_order_acquire);
+		}
+
+		bool CanBeCancelled() const
+		{
+			return state_.IsValid();
+		}
+
+		// The token of the innermost CancellationScope on this thread, otherwise the token of the executed task
+		static CancellationToken GetCurrent();
+
+	private:
+		friend class CancellationSource;
+
+		explicit CancellationToken(TRefCountPtr<CancellationState> state)
+			: state_(std::move(state))
+		{}
+
+		TRefCountPtr<CancellationState> state_;
+	};
+
+	// Cancellation is cooperative: a task with a cancelled token is not executed, when it was not started yet.
+	// Its gate is completed with ETaskState::Cancelled, so dependent tasks are cancelled as well.
+	class CancellationSource
+	{
+	public:
+		CancellationSource()
+			: state_(new CancellationState)
+		{}
+
+		void Cancel()
+		{
+			state_->cancelled_.store(true, std::memory_order_release);
+		}
+
+		bool IsCancellationRequested() const
+		{
+			return state_->cancelled_.load(std::memory_order_acquire);
+		}
+
+		CancellationToken GetToken() const
+		{
+			return CancellationToken(state_);
+		}
+
+	private:
+		TRefCountPtr<CancellationState> state_;
+	};
+
+	// Tasks created on this thread while the scope exists get the token (Then, ThenRead, InitializeTaskOn, etc.).
+	// Without a scope, a task created by an executed task inherits its token (like the priority).
+	class CancellationScope
+	{
+	public:
+		explicit CancellationScope(CancellationToken token);
+		~CancellationScope();
+
+		CancellationScope(const CancellationScope&) = delete;
+		CancellationScope& operator=(const CancellationScope&) = delete;
+
+	private:
+		CancellationToken previous_;
+	};
+}
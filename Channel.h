@@ -34,7 +34,10 @@ namespace ts
 			uint16_t start_ = 0;
 			uint16_t end_ = 0;
 			bool open_ = true;
+			uint8 padding0_ = 0;
+			uint16 padding1_ = 0; // explicit, 64 bits keep the atomic lock-free
 		};
+		static_assert(std::atomic<State>::is_always_lock_free);
 		std::atomic<State> state_;
 
 		std::array<SpinMutex, Size> locks_;
@@ -5,8 +5,17 @@
 #include <span>
 #include <limits>
 #include <cassert>
+#include <atomic>
+#include <array>
+#include <cstdint>
 #include "Config.h"
 
+#if defined(_MSC_VER)
+#include <intrin.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
 #ifdef NDEBUG
 #define DEBUG_CODE(x)
 #define USE_DEBUG_CODE 0
@@ -28,8 +37,10 @@ using uint32 = unsigned __int32;
 using int64 = __int64;
 using uint64 = unsigned __int64;
 
-using Index = uint16;
+// Index of a pooled node: the segment number in the high bits, the offset in the segment in the low bits. See Pool.
+using Index = uint32;
 constexpr Index kInvalidIndex = std::numeric_limits<Index>::max();
+constexpr uint16 kInvalidThreadIndex = std::numeric_limits<uint16>::max();
 
 template<class EnumType>
 constexpr bool enum_has_any(EnumType value, EnumType looking_for)
@@ -58,6 +69,14 @@ constexpr EnumType enum_or(EnumType a, EnumType b)
 
 namespace ts
 {
+	// Hint for the cpu, that the thread is spinning
+	inline void CpuPause()
+	{
+#if defined(_MSC_VER) || defined(__x86_64__) || defined(__i386__)
+		_mm_pause();
+#endif
+	}
+
 	template<class Type>
 	class BaseIndex
 	{
@@ -94,24 +113,71 @@ namespace ts
 		}
 	};
 
+	// 12 bits (and kMaxPoolSegments 4096) keep any pool index within 24 bits, see AccessSynchronizer::State.
+	// The all-ones offset is never used, so a truncated kInvalidIndex is still invalid.
+	constexpr uint32 kPoolOffsetBits = 12;
+	constexpr Index kPoolOffsetMask = (Index{ 1 } << kPoolOffsetBits) - 1;
+	static_assert(kPoolSegmentSize && !(kPoolSegmentSize & (kPoolSegmentSize - 1)), "kPoolSegmentSize must be power of 2");
+	static_assert(kMaxPoolSegments <= (kInvalidIndex >> kPoolOffsetBits), "Segment number does not fit the index");
+
+	// At the start of each pool segment. Segments are aligned to kPoolSegmentSize, 
+	// so the header of a node is found by masking its address.
+	struct PoolSegmentHeader
+	{
+		const void* pool_ = nullptr;
+		Index first_index_ = 0; // segment number << kPoolOffsetBits
+	};
+
+	// Segment addresses of a pool, indexed by the segment number. Segments are only added, existing nodes never move.
+	struct PoolSegmentTable
+	{
+		std::array<std::atomic<uint8*>, kMaxPoolSegments> segments_{};
+	};
+
+	template<typename Node>
+	struct PoolSegmentLayout
+	{
+		static constexpr std::size_t kNodesOffset = ((sizeof(PoolSegmentHeader) + alignof(Node) - 1) / alignof(Node)) * alignof(Node);
+
+		static const PoolSegmentHeader& GetHeader(const Node& node)
+		{
+			const std::uintptr_t segment = reinterpret_cast<std::uintptr_t>(&node) & ~std::uintptr_t{ kPoolSegmentSize - 1 };
+			return *reinterpret_cast<const PoolSegmentHeader*>(segment);
+		}
+
+		static Node* GetNodes(uint8* segment)
+		{
+			return reinterpret_cast<Node*>(segment + kNodesOffset);
+		}
+
+		static Index GetOffset(const Node& node)
+		{
+			const uint8* segment = reinterpret_cast<const uint8*>(&GetHeader(node));
+			const std::size_t offset = (reinterpret_cast<const uint8*>(&node) - segment - kNodesOffset) / sizeof(Node);
+			assert(offset <= kPoolOffsetMask);
+			return static_cast<Index>(offset);
+		}
+	};
+
+	// No lookup, the index is computed from the node address and its segment header
 	template<typename Node>
 	auto GetPoolIndex(const Node& node)
 	{
-		const std::span<Node> nodes = Node::GetPoolSpan();
-		const Node* first = nodes.data();
-		const Index idx = static_cast<Index>(std::distance(first, &node));
-		assert(idx < nodes.size());
+		using Layout = PoolSegmentLayout<Node>;
 		using IndexType = std::remove_cvref_t<decltype(Node{}.NextRef())>;
-		return IndexType{idx};
+		return IndexType{ Layout::GetHeader(node).first_index_ | Layout::GetOffset(node) };
 	}
 
 	template<typename Node>
 	Node& FromPoolIndex(const BaseIndex<Node> index)
 	{
 		assert(index.IsValid());
-		std::span<Node> nodes = Node::GetPoolSpan();
-		assert(index.RawValue() < nodes.size());
-		return nodes[index.RawValue()];
+		const PoolSegmentTable& table = Node::GetPoolSegments();
+		const Index segment_idx = index.RawValue() >> kPoolOffsetBits;
+		assert(segment_idx < kMaxPoolSegments);
+		uint8* segment = table.segments_[segment_idx].load(std::memory_order_acquire);
+		assert(segment);
+		return PoolSegmentLayout<Node>::GetNodes(segment)[index.RawValue() & kPoolOffsetMask];
 	}
 
 	template<class Type, typename DataType>
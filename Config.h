@@ -6,7 +6,11 @@
 
 #define THREAD_SMART_POOL 1
 
-#define TASK_RETRIGGER 0
+#define TASK_RETRIGGER 0 // coroutine awaiters reuse the current task. For recurring tasks see RecurringTask
+
+#define TASK_FUNCTOR_SPILL_REPORT 0 // 1: deprecation warning at each call site of a task functor bigger than kTaskFunctorInlineSize, 2: static_assert
+
+#define FIFO_SCHEDULING 0 // default scheduling policy, see SchedulerSettings
 
 #define TEST_MAIN 1
 #define ANT_HILL 0
@@ -20,19 +24,45 @@
 
 namespace ts
 {
-	constexpr std::size_t kWorkeThreadsNum = 32;
+	constexpr std::size_t kMaxWorkerThreadsNum = 256; // The actual number is set at runtime, see TaskSystem::StartWorkerThreads
+	constexpr std::size_t kMaxExternalThreadsNum = 16; // non-worker threads with their own pool caches, see TaskSystem::RegisterExternalThread
+	// Pools start with the initial size and grow on demand by segments, up to the max size. Nodes are never moved.
+	constexpr std::size_t kPoolSegmentSize = 64 * 1024; // bytes, power of 2. Segments are aligned to their size
+	constexpr std::size_t kMaxPoolSegments = 4096; // per pool
+	constexpr std::size_t kPoolGrowSegments = 1; // segments added at once, when a pool runs dry
+	constexpr std::size_t kPoolMagazineSize = 256; // max nodes moved at once between a thread cache and the global free stack. 1 disables batching
+	constexpr std::size_t kPoolReturnWaitMicroseconds = 1000; // a thread blocked on an exhausted pool rechecks it at least this often
 	constexpr std::size_t kTaskPoolSize = 1024 * 8;
+	constexpr std::size_t kTaskPoolMaxSize = 1024 * 128; // power of 2, the ready queues are as big
 	constexpr std::size_t kDepNodePoolSize = 1024 * 8;
+	constexpr std::size_t kDepNodePoolMaxSize = 1024 * 1024;
 	constexpr std::size_t kFuturePoolSize = 2048;
+	constexpr std::size_t kFuturePoolMaxSize = 1024 * 1024;
 	constexpr std::size_t kSynchronizerNodePoolSize = 1024 * 4;
+	constexpr std::size_t kSynchronizerNodePoolMaxSize = 1024 * 60; // max 16 segments, the collection index is 16 bits in AccessSynchronizer::State
+	constexpr std::size_t kWorkerDequeSize = 1024; // per worker thread, power of 2. Overflow goes to the global ready stack.
+	constexpr std::size_t kCacheLineSize = 64;
+	constexpr std::size_t kTimerWheelSize = 4096; // buckets, power of 2. Timers further than one turn stay in their bucket for more turns.
+	constexpr std::size_t kTimerTickMicroseconds = 1000; // resolution of delayed tasks
+	constexpr std::size_t kTimerPollInterval = 64; // a busy worker checks the timers every n-th task
+	constexpr std::size_t kMaxTaskChainLength = 1024; // InitializeTasks and AsyncResumeMany submit at most this many tasks with a single push
+	constexpr std::size_t kTaskFunctorInlineSize = 56; // BaseTask::function_ storage, with the ops pointer a cache line. Bigger functors spill to the functor slab
+	constexpr std::size_t kFunctorSlabSize = 16 * 1024; // carved into blocks of one size class, when a thread and the shared free list have no block
+	constexpr std::size_t kFunctorSlabBatch = 16; // spilled functor blocks moved at once between a thread's free list and the shared one
+	constexpr std::size_t kFunctorRegionSize = 256ull * 1024 * 1024; // address space reserved for functor slabs, committed on demand
+	constexpr std::size_t kCoroutineRegionSize = 1024ull * 1024 * 1024; // address space reserved for coroutine frames (SimpleAllocator)
+	constexpr std::size_t kFrameBatchSize = 32; // max coroutine frame blocks moved at once between a thread cache and the global free list
+	constexpr std::size_t kFrameBatchBytes = 16 * 1024; // and at most this many bytes, so big size classes move fewer blocks
+	constexpr std::size_t kRegionCommitSize = 1024 * 1024; // bytes, a MemoryRegion commits by this much
+	constexpr std::size_t kMaxWaitHelpDepth = 8; // nested GenericFuture::Wait calls executing other tasks, deeper ones only wait
 
-	constexpr std::size_t InitPoolSizePerThread(std::size_t pool_size)
+	constexpr std::size_t InitPoolSizePerThread(std::size_t pool_size, std::size_t threads_num)
 	{
-		return (pool_size / kWorkeThreadsNum) / 4;
+		return (pool_size / threads_num) / 4;
 	}
 
-	constexpr std::size_t MaxPoolSizePerThread(std::size_t pool_size)
+	constexpr std::size_t MaxPoolSizePerThread(std::size_t pool_size, std::size_t threads_num)
 	{
-		return 3 * (pool_size / kWorkeThreadsNum) / 8;
+		return 3 * (pool_size / threads_num) / 8;
 	}
 }
\ No newline at end of file
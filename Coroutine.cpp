@@ -1,27 +1,166 @@
 #include "Coroutine.h"
-#include "SimpleAllocator.h"
 
-namespace ts::detail
+namespace ts
 {
-	SimpleAllocator simple_allocator;
+	uint8* SimpleAllocator::AllocateSlow(const std::size_t size, const uint8 size_class, const uint16 cache_idx)
+	{
+		if (size_class != FrameSizeClasses::kExternal)
+		{
+			if (cache_idx != kInvalidThreadIndex)
+			{
+				if (Refill(caches_[cache_idx], size_class))
+				{
+					return allocate(size);
+				}
+			}
+			else
+			{
+				FrameBlock* block = free_[size_class].Pop();
+				block = block ? block : CarveBatch(size_class);
+				if (block)
+				{
+					if (block->batch_size_ > 1) // the rest of the batch goes back
+					{
+						FrameBlock* rest = block->next_in_batch_;
+						rest->batch_size_ = block->batch_size_ - 1;
+						free_[size_class].Push(*rest);
+					}
+					return reinterpret_cast<uint8*>(block);
+				}
+			}
+		}
+
+		// Too big, or the region is full. deallocate tells these apart by the address.
+		if (cache_idx != kInvalidThreadIndex)
+		{
+			FrameAllocatorStats& stats = caches_[cache_idx].stats_;
+			stats.allocations++;
+			stats.external_allocations++;
+			stats.requested_bytes += size;
+			stats.block_bytes += size;
+		}
+		uint8* memory = static_cast<uint8*>(std::malloc(size));
+		assert(memory);
+		return memory;
+	}
 
-	void* do_allocate(std::size_t size)
+	bool SimpleAllocator::Refill(ThreadCache& cache, const uint8 size_class)
 	{
-		return simple_allocator.allocate(size);
+		assert(!cache.head_[size_class] && !cache.size_[size_class]);
+		FrameBlock* batch = free_[size_class].Pop();
+		batch = batch ? batch : CarveBatch(size_class);
+		if (!batch)
+		{
+			return false;
+		}
+		cache.head_[size_class] = batch;
+		cache.size_[size_class] = batch->batch_size_;
+		cache.stats_.refills++;
+		return true;
+	}
+
+	void SimpleAllocator::Spill(ThreadCache& cache, const uint8 size_class)
+	{
+		const uint32 batch_size = FrameSizeClasses::GetBatchSize(size_class);
+		assert(cache.size_[size_class] >= batch_size);
+		FrameBlock* head = cache.head_[size_class];
+		FrameBlock* tail = head;
+		for (uint32 idx = 1; idx < batch_size; idx++)
+		{
+			tail = tail->next_in_batch_;
+		}
+		cache.head_[size_class] = tail->next_in_batch_;
+		cache.size_[size_class] -= batch_size;
+		tail->next_in_batch_ = nullptr;
+		head->batch_size_ = batch_size;
+		free_[size_class].Push(*head);
+		cache.stats_.spills++;
+	}
+
+	void SimpleAllocator::FlushThreadCache(const uint16 cache_idx)
+	{
+		ThreadCache& cache = caches_[cache_idx];
+		for (uint8 size_class = 0; size_class < FrameSizeClasses::kClassesNum; size_class++)
+		{
+			if (FrameBlock* head = cache.head_[size_class]) // the whole list as a single batch
+			{
+				head->batch_size_ = cache.size_[size_class];
+				free_[size_class].Push(*head);
+				cache.head_[size_class] = nullptr;
+				cache.size_[size_class] = 0;
+			}
+		}
 	}
 
-	void do_deallocate(void* ptr)
+	FrameBlock* SimpleAllocator::CarveBatch(const uint8 size_class)
 	{
-		if (!ptr)
+		const std::size_t block_size = FrameSizeClasses::GetSize(size_class);
+		const uint32 batch_size = FrameSizeClasses::GetBatchSize(size_class);
+		uint8* memory = region_.Carve(batch_size * block_size);
+		if (!memory)
+		{
+			return nullptr;
+		}
+		FrameBlock* next = nullptr;
+		for (uint32 idx = batch_size; idx > 0; idx--)
+		{
+			next = new (memory + (idx - 1) * block_size) FrameBlock{ .next_in_batch_ = next };
+		}
+		next->batch_size_ = batch_size;
+		DEBUG_CODE(carved_blocks_[size_class].fetch_add(batch_size, std::memory_order_relaxed);)
+		return next;
+	}
+
+	void SimpleAllocator::ensure_all_free()
+	{
+		for (uint8 size_class = 0; size_class < FrameSizeClasses::kClassesNum; size_class++)
+		{
+			uint32 free_blocks = 0;
+			for (const ThreadCache& cache : caches_)
+			{
+				free_blocks += cache.size_[size_class];
+			}
+			lock_free::PointerBasedStack<FrameBlock> temp(region_.GetBase());
+			while (FrameBlock* batch = free_[size_class].Pop())
+			{
+				free_blocks += batch->batch_size_;
+				temp.Push(*batch);
+			}
+			while (FrameBlock* batch = temp.Pop())
+			{
+				free_[size_class].Push(*batch);
+			}
+			assert(free_blocks == carved_blocks_[size_class].load(std::memory_order_relaxed));
+		}
+	}
+
+	FrameAllocatorStats SimpleAllocator::GetStats(bool reset)
+	{
+		FrameAllocatorStats result;
+		for (ThreadCache& cache : caches_)
+		{
+			result.Add(cache.stats_);
+			if (reset)
+			{
+				cache.stats_ = FrameAllocatorStats{};
+			}
+		}
+		result.committed_bytes = region_.GetCommittedSize();
+		return result;
+	}
+
+	namespace detail
+	{
+		SimpleAllocator simple_allocator;
+
+		void ensure_allocator_free()
 		{
-			assert(false);
-			return;
+			simple_allocator.ensure_all_free();
 		}
-		simple_allocator.deallocate(reinterpret_cast<uint8*>(ptr));
 	}
 
-	void ensure_allocator_free()
+	FrameAllocatorStats GetFrameAllocatorStats(bool reset)
 	{
-		simple_allocator.ensure_all_free();
+		return detail::simple_allocator.GetStats(reset);
 	}
-}
\ No newline at end of file
+}
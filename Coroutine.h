@@ -5,17 +5,21 @@
 #include "Future.h"
 #include "AccessSynchronizer.h"
 #include "Channel.h"
+#include "TaskGroup.h"
+#include "SimpleAllocator.h"
 
 namespace ts
 {
 	namespace detail
 	{
-		void* do_allocate(std::size_t bytes);
-		void do_deallocate(void* p);
+		extern SimpleAllocator simple_allocator;
 		void ensure_allocator_free();
 		enum class EInnerState : uint8 { Unfinished, Done };
 	}
 
+	// Of the coroutine frame allocator, summed over all threads
+	FrameAllocatorStats GetFrameAllocatorStats(bool reset = false);
+
 	template <typename Return>
 	class TPromiseReturn
 	{
@@ -96,14 +100,15 @@ namespace ts
 	{
 	public:
 #if COROUTINE_CUSTOM_ALLOC
+		// The frame size is a constant in each coroutine, the size class is resolved at compile time
 		void* operator new(std::size_t size)
 		{
-			return detail::do_allocate(size);
+			return detail::simple_allocator.allocate(size);
 		}
 
-		void operator delete (void* ptr)
+		void operator delete (void* ptr, std::size_t size)
 		{
-			detail::do_deallocate(ptr);
+			detail::simple_allocator.deallocate(static_cast<uint8*>(ptr), size);
 		}
 #endif //COROUTINE_CUSTOM_ALLOC
 
@@ -119,6 +124,17 @@ namespace ts
 			return GenericFutureAwaiter<SpecializedType>{ InTask };
 		}
 
+		auto await_transform(TaskGroup& group)
+		{
+			return GenericFutureAwaiter<Future<>>{ group.GetFuture() };
+		}
+
+		template <std::derived_from<GenericFuture> SpecializedType>
+		auto await_transform(CancellableFuture<SpecializedType> cancellable)
+		{
+			return CancellableFutureAwaiter<SpecializedType>{ { std::move(cancellable.future_) } };
+		}
+
 		template <typename OtherPromise>
 		auto await_transform(TUniqueHandle<OtherPromise>&& in_coroutine)
 		{
@@ -138,7 +154,7 @@ namespace ts
 					assert(handle);
 					OtherPromise* promise = awaited_.GetPromise();
 					assert(promise);
-					const bool passed = promise->continuation_.TrySet(detail::EInnerState::Unfinished, handle);
+					const bool passed = promise->continuation_.TrySet(detail::EInnerState::Unfinished, handle.address());
 					if (!passed)
 					{
 						handle.resume();
@@ -169,6 +185,11 @@ namespace ts
 			return AccessSynchronizerSharedTaskAwaiter<TValue>( std::forward<SharedSyncHolder<TValue>>(resource) );
 		}
 
+		auto await_transform(Delay delay)
+		{
+			return DelayAwaiter{ TimerClock::now() + delay.duration };
+		}
+
 		template<typename T>
 		auto await_transform(ChannelReadResult<T> result)
 		{
@@ -198,8 +219,8 @@ namespace ts
 
 				void await_suspend(HandleType handle) noexcept
 				{
-					std::coroutine_handle<> continuation = handle.promise().continuation_.
-						Close(detail::EInnerState::Done, std::coroutine_handle<>{}).value_;
+					std::coroutine_handle<> continuation = std::coroutine_handle<>::from_address(handle.promise().continuation_.
+						Close(detail::EInnerState::Done, nullptr).value_);
 					if (continuation)
 					{
 						continuation.resume();
@@ -216,8 +237,8 @@ namespace ts
 			return TaskType(HandleType::from_promise(*this));
 		}
 
-		lock_free::GatedValue<std::coroutine_handle<>, detail::EInnerState> continuation_ =
-			{ std::coroutine_handle<>{}, detail::EInnerState::Unfinished };
+		lock_free::GatedValue<void*, detail::EInnerState> continuation_ = // address of the continuation coroutine_handle
+			{ nullptr, detail::EInnerState::Unfinished };
 	};
 
 	class TDetachPromise : public TPromise<void, void>
@@ -6,17 +6,19 @@
 #include "AnyValue.h"
 #include <functional>
 #include <coroutine>
+#include <exception>
+#include <optional>
 
 namespace ts
 {
 	class TaskSystem;
 	template<typename T> class Future;
 
-	enum class ETaskFlags : uint8
+	enum class ETaskFlags : uint16
 	{
 		None = 0,
 		TryExecuteImmediate = 1,
-		//DontExecute = 2,
+		Fifo = 2, // Executed in submission order (global FIFO queue), regardless of the scheduling policy
 		//RedirectExecutrionForGuardedResource = 4,
 
 		NamedThread5 = 8,
@@ -25,7 +27,46 @@ namespace ts
 		NamedThread2 = 64,
 		NamedThread1 = 128,
 
-		NameThreadMask = NamedThread1 | NamedThread2 | NamedThread3 | NamedThread4 | NamedThread5
+		NameThreadMask = NamedThread1 | NamedThread2 | NamedThread3 | NamedThread4 | NamedThread5,
+
+		// Priority classes, each has its own ready queues. No priority flag means normal priority.
+		// Workers drain critical tasks first, background tasks run only when there is nothing else to do.
+		// Ignored for named threads.
+		Critical = 256,
+		Background = 512,
+
+		PriorityMask = Critical | Background,
+
+		// Executed even when its token or a prerequisite was cancelled. Used for coroutine resumptions,
+		// a coroutine frame would leak otherwise.
+		NotCancellable = 1024,
+	};
+
+	enum class ETaskPriority : uint8
+	{
+		Critical,
+		Normal,
+		Background,
+	};
+
+	constexpr ETaskPriority GetPriority(ETaskFlags flags)
+	{
+		if (enum_has_any(flags, ETaskFlags::Critical))
+		{
+			return ETaskPriority::Critical;
+		}
+		return enum_has_any(flags, ETaskFlags::Background) ? ETaskPriority::Background : ETaskPriority::Normal;
+	}
+
+	// When flags have no priority, the priority of the currently executed task is added. 
+	// Used for coroutine resumptions, so a coroutine keeps its priority.
+	ETaskFlags InheritPriority(ETaskFlags flags);
+
+	// How a thread, that is not a worker, waits in GenericFuture::Wait. Worker threads always help.
+	enum class EWaitMode : uint8
+	{
+		Help, // executes ready tasks, parks when there are none
+		Park, // parks until the gate is done
 	};
 
 	class GenericFuture : public TRefCounted<GenericFuture>
@@ -38,6 +79,15 @@ namespace ts
 			return state == ETaskState::PendingOrExecuting;
 		}
 
+		bool IsCancelled() const
+		{
+			return gate_.GetState() == ETaskState::Cancelled;
+		}
+
+		// Blocks until the future is not pending. A worker thread executes other ready tasks meanwhile,
+		// up to kMaxWaitHelpDepth nested waits. Prefer co_await in coroutines.
+		void Wait(EWaitMode mode = EWaitMode::Help);
+
 		template<typename F>
 		auto Then(F function, ETaskFlags flags = ETaskFlags::None LOCATION_PARAM) -> TRefCountPtr<Future<decltype(function())>>
 		{
@@ -68,11 +118,17 @@ namespace ts
 		}
 #endif
 	protected:
-		AnyValue<5 * sizeof(uint8*)> result_;
+		// Fields written by other threads come first, so in a pooled task they share the first cache line
+		// with the refcount. The cold part of a task is in TaskPayload.
+		Index next_ = kInvalidIndex; // next to the 32-bit refcount
 		Gate gate_;
-		Index next_ = kInvalidIndex;
+		std::atomic<uint16> prerequires_ = 0; // BaseTask only, it fits the padding
+		ETaskFlags flag_ = ETaskFlags::None; // BaseTask only
+		std::atomic<bool> prerequisite_cancelled_ = false; // BaseTask only, set before prerequires_ is decremented
+		AnyValue<4 * sizeof(uint8*)> result_; // the slot must stay a single cache line with the 64-bit gate
 
 		friend class TaskSystem;
+		friend class RecurringTask;
 		template<typename T, typename DerivedType> friend class CommonSpecialization;
 	};
 
@@ -107,6 +163,14 @@ namespace ts
 			return common->result_.Get<T>();
 		}
 
+		// Wait, then ShareResultByValue. Empty, when the future was cancelled.
+		std::optional<T> GetBlocking(EWaitMode mode = EWaitMode::Help)
+		{
+			DerivedType* common = static_cast<DerivedType*>(this);
+			common->Wait(mode);
+			return common->IsCancelled() ? std::optional<T>{} : std::optional<T>{ ShareResultByValue() };
+		}
+
 		template<typename F>
 		auto ThenRead(F&& function, ETaskFlags flags = ETaskFlags::None LOCATION_PARAM)
 		{
@@ -161,7 +225,7 @@ namespace ts
 			static_assert(sizeof(IndexType) == sizeof(Index), "IndexType must be same size as Index");
 			return *reinterpret_cast<IndexType*>(&next_);
 		}
-		static std::span<BaseFuture> GetPoolSpan();
+		static const PoolSegmentTable& GetPoolSegments();
 	};
 
 	template<typename T = void>
@@ -175,6 +239,13 @@ namespace ts
 			result_.Store(std::forward<T>(val));
 			gate_.Unblock(ETaskState::DoneUnconsumedResult);
 		}
+
+		// Dependent tasks are cancelled, instead of executed
+		void Cancel()
+		{
+			assert(gate_.GetState() == ETaskState::PendingOrExecuting);
+			gate_.Unblock(ETaskState::Cancelled);
+		}
 	};
 
 	template<>
@@ -183,12 +254,26 @@ namespace ts
 	public:
 		using ReturnType = void;
 
+		// Returns false, when the future was cancelled
+		bool GetBlocking(EWaitMode mode = EWaitMode::Help)
+		{
+			Wait(mode);
+			return !IsCancelled();
+		}
+
 		void Done()
 		{
 			assert(gate_.GetState() == ETaskState::PendingOrExecuting);
 			assert(!result_.HasValue());
 			gate_.Unblock(ETaskState::Done);
 		}
+
+		// Dependent tasks are cancelled, instead of executed
+		void Cancel()
+		{
+			assert(gate_.GetState() == ETaskState::PendingOrExecuting);
+			gate_.Unblock(ETaskState::Cancelled);
+		}
 	};
 
 	template <std::derived_from<GenericFuture> SpecializedType, typename ReturnType = SpecializedType::ReturnType>
@@ -207,7 +292,8 @@ namespace ts
 				{
 					handle.resume();
 				};
-			inner_task_->Then(resume_coroutine);
+			// The coroutine is resumed also when the future was cancelled
+			inner_task_->Then(resume_coroutine, InheritPriority(ETaskFlags::NotCancellable));
 		}
 		auto await_resume()
 		{
@@ -222,8 +308,50 @@ namespace ts
 			inner_task_ = nullptr;
 			if constexpr (!std::is_void_v<ReturnType>)
 			{
+				if (moved_task->IsCancelled()) [[unlikely]]
+				{
+					assert(false); // there is no result, use co_await AwaitCancellable(future)
+					std::terminate();
+				}
 				return moved_task->ShareResultByValue();
 			}
 		}
 	};
+
+	template <std::derived_from<GenericFuture> SpecializedType>
+	struct CancellableFuture
+	{
+		TRefCountPtr<SpecializedType> future_;
+	};
+
+	// co_await AwaitCancellable(future) returns std::optional with the result, empty when the future was cancelled.
+	// For a future without a result, it returns false when cancelled.
+	// A plain co_await of a cancelled future with a result terminates, there is no result to return.
+	template <std::derived_from<GenericFuture> SpecializedType>
+	CancellableFuture<SpecializedType> AwaitCancellable(TRefCountPtr<SpecializedType> future)
+	{
+		return CancellableFuture<SpecializedType>{ std::move(future) };
+	}
+
+	template <std::derived_from<GenericFuture> SpecializedType, typename ReturnType = SpecializedType::ReturnType>
+	struct CancellableFutureAwaiter : public GenericFutureAwaiter<SpecializedType, ReturnType>
+	{
+		auto await_resume()
+		{
+			TRefCountPtr<SpecializedType> moved_task = std::move(this->inner_task_);
+			assert(!moved_task || !moved_task->IsPendingOrExecuting());
+			const bool cancelled = moved_task && moved_task->IsCancelled();
+			if constexpr (std::is_void_v<ReturnType>)
+			{
+				return !cancelled;
+			}
+			else
+			{
+				assert(moved_task);
+				return cancelled 
+					? std::optional<ReturnType>{} 
+					: std::optional<ReturnType>{ moved_task->ShareResultByValue() };
+			}
+		}
+	};
 }
\ No newline at end of file
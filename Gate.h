@@ -16,6 +16,7 @@ namespace ts
 		PendingOrExecuting,
 		Done,
 		DoneUnconsumedResult,
+		Cancelled, // Not executed, see CancellationSource. Propagated to dependent tasks.
 	};
 
 	struct DependencyNode;
@@ -24,7 +25,7 @@ namespace ts
 
 	struct DependencyNode
 	{
-		static std::span<DependencyNode> GetPoolSpan();
+		static const PoolSegmentTable& GetPoolSegments();
 #if !defined(NDEBUG)
 		void OnReturnToPool()
 		{
@@ -34,6 +35,7 @@ namespace ts
 		TRefCountPoolPtr<BaseTask, BaseIndex<BaseTask>> task_;
 
 		DependencyNodeIndex next_;
+		bool propagate_cancellation_ = true; // false for an access order dependency (AccessSynchronizer)
 		DependencyNodeIndex& NextRef() { return next_; }
 	};
 
@@ -85,6 +87,9 @@ namespace ts
 
 		bool UnblockSingle();
 
+		// Parks the thread until the gate is not pending. Unblock notifies only, when some thread is parked on this gate.
+		void WaitWhilePending();
+
 		bool AddDependencyInner(DependencyNode& node, const ETaskState required_state, const uint8 required_tag)
 		{
 			return depending_.Add(node, required_state, required_tag);
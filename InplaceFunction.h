@@ -0,0 +1,219 @@
+#pragma once
+
+#include "Common.h"
+#include <cstddef>
+#include <type_traits>
+#include <utility>
+#include <functional>
+#include <cstring>
+#include <new>
+#include <assert.h>
+
+namespace ts
+{
+	namespace detail
+	{
+		// Per worker thread slab for functors too big for the inline storage, see Task.cpp
+		void* AllocateSpilledFunctor(std::size_t size);
+		void FreeSpilledFunctor(void* ptr);
+
+#if TASK_FUNCTOR_SPILL_REPORT == 1
+		template<typename F>
+		[[deprecated("Functor does not fit kTaskFunctorInlineSize, it spills to the functor slab. See the instantiation context for the call site.")]]
+		constexpr void ReportSpilledFunctor() {}
+#endif
+	}
+
+	// Move-only callable with a fixed inline storage, a replacement for std::move_only_function in pooled tasks.
+	// A functor bigger than Capacity (or over-aligned) is stored in a block from the per worker thread slab, never with operator new.
+	// See TASK_FUNCTOR_SPILL_REPORT to find such functors at compile time.
+	template<typename Signature, std::size_t Capacity>
+	class InplaceFunction;
+
+	template<typename R, typename... Args, std::size_t Capacity>
+	class InplaceFunction<R(Args...), Capacity>
+	{
+	public:
+		template<typename F> static constexpr bool IsStoredInline()
+		{
+			return (sizeof(F) <= Capacity) && (alignof(F) <= alignof(void*));
+		}
+
+		InplaceFunction() = default;
+		InplaceFunction(std::nullptr_t) {}
+
+		template<typename F>
+			requires (!std::is_same_v<std::remove_cvref_t<F>, InplaceFunction> && !std::is_same_v<std::remove_cvref_t<F>, std::nullptr_t>
+				&& std::is_invocable_r_v<R, std::decay_t<F>&, Args...>)
+		InplaceFunction(F&& functor)
+		{
+			Emplace(std::forward<F>(functor));
+		}
+
+		InplaceFunction(InplaceFunction&& moved) noexcept
+		{
+			MoveFrom(moved);
+		}
+
+		InplaceFunction(const InplaceFunction&) = delete;
+		InplaceFunction& operator=(const InplaceFunction&) = delete;
+
+		InplaceFunction& operator=(InplaceFunction&& moved) noexcept
+		{
+			if (this != &moved)
+			{
+				Reset();
+				MoveFrom(moved);
+			}
+			return *this;
+		}
+
+		InplaceFunction& operator=(std::nullptr_t)
+		{
+			Reset();
+			return *this;
+		}
+
+		// Constructs the functor directly in the storage
+		template<typename F>
+			requires (!std::is_same_v<std::remove_cvref_t<F>, InplaceFunction> && !std::is_same_v<std::remove_cvref_t<F>, std::nullptr_t>
+				&& std::is_invocable_r_v<R, std::decay_t<F>&, Args...>)
+		InplaceFunction& operator=(F&& functor)
+		{
+			Reset();
+			Emplace(std::forward<F>(functor));
+			return *this;
+		}
+
+		~InplaceFunction()
+		{
+			Reset();
+		}
+
+		explicit operator bool() const
+		{
+			return !!ops_;
+		}
+
+		R operator()(Args... args)
+		{
+			assert(ops_);
+			return ops_->invoke(&data_, std::forward<Args>(args)...);
+		}
+
+		void Reset()
+		{
+			if (ops_)
+			{
+				if (ops_->destroy)
+				{
+					ops_->destroy(&data_);
+				}
+				ops_ = nullptr;
+			}
+		}
+
+	private:
+		struct Ops
+		{
+			R (*invoke)(void* storage, Args&&... args);
+			void (*move)(void* to, void* from); // nullptr: memcpy of the storage
+			void (*destroy)(void* storage); // nullptr: nothing to destroy
+		};
+
+		template<typename F>
+		struct InlineOps
+		{
+			static R Invoke(void* storage, Args&&... args)
+			{
+				return std::invoke(*std::launder(reinterpret_cast<F*>(storage)), std::forward<Args>(args)...);
+			}
+
+			static void Move(void* to, void* from)
+			{
+				F& source = *std::launder(reinterpret_cast<F*>(from));
+				new (to) F(std::move(source));
+				source.~F();
+			}
+
+			static void Destroy(void* storage)
+			{
+				std::launder(reinterpret_cast<F*>(storage))->~F();
+			}
+
+			static constexpr Ops kOps = {
+				&Invoke,
+				std::is_trivially_copyable_v<F> ? nullptr : &Move,
+				std::is_trivially_destructible_v<F> ? nullptr : &Destroy };
+		};
+
+		// The storage keeps only the pointer, so moving is a memcpy
+		template<typename F>
+		struct SpilledOps
+		{
+			static F& Get(void* storage)
+			{
+				return **reinterpret_cast<F**>(storage);
+			}
+
+			static R Invoke(void* storage, Args&&... args)
+			{
+				return std::invoke(Get(storage), std::forward<Args>(args)...);
+			}
+
+			static void Destroy(void* storage)
+			{
+				F* functor = &Get(storage);
+				functor->~F();
+				detail::FreeSpilledFunctor(functor);
+			}
+
+			static constexpr Ops kOps = { &Invoke, nullptr, &Destroy };
+		};
+
+		template<typename G>
+		void Emplace(G&& functor)
+		{
+			using F = std::decay_t<G>;
+			if constexpr (IsStoredInline<F>())
+			{
+				new (&data_) F(std::forward<G>(functor));
+				ops_ = &InlineOps<F>::kOps;
+			}
+			else
+			{
+#if TASK_FUNCTOR_SPILL_REPORT == 1
+				detail::ReportSpilledFunctor<F>();
+#elif TASK_FUNCTOR_SPILL_REPORT == 2
+				static_assert(sizeof(F) == 0, "Functor does not fit kTaskFunctorInlineSize. See the instantiation context for the call site.");
+#endif
+				static_assert(alignof(F) <= alignof(std::max_align_t), "Over-aligned functors are not supported");
+				void* memory = detail::AllocateSpilledFunctor(sizeof(F));
+				F* spilled = new (memory) F(std::forward<G>(functor));
+				std::memcpy(&data_, &spilled, sizeof(spilled));
+				ops_ = &SpilledOps<F>::kOps;
+			}
+		}
+
+		void MoveFrom(InplaceFunction& moved)
+		{
+			ops_ = moved.ops_;
+			if (ops_)
+			{
+				if (ops_->move)
+				{
+					ops_->move(&data_, &moved.data_);
+				}
+				else
+				{
+					std::memcpy(&data_, &moved.data_, Capacity);
+				}
+				moved.ops_ = nullptr;
+			}
+		}
+
+		static_assert(Capacity >= sizeof(void*));
+		alignas(void*) std::byte data_[Capacity];
+		const Ops* ops_ = nullptr;
+	};
+}
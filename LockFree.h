@@ -5,14 +5,120 @@
 #include <optional>
 #include <assert.h>
 #include <array>
+#include <cstdint>
+#include <algorithm>
+#include <type_traits>
+#include <limits>
 #include "Common.h"
 
 namespace ts::lock_free
 {
-	using Tag = uint16;
+	using Tag = uint32; // ABA counter, with a 32-bit index the state of a stack is a single 64-bit atomic
 
-	template<typename Node>
-	struct Stack
+	// Contention management of Stack and PointerBasedStack, selected per instantiation.
+	// Backoff is called after each failed CAS of an operation. With kElimination, a failed Push or Pop
+	// first tries to meet its counterpart in the elimination array.
+
+	// A failed CAS is retried immediately
+	struct NoContention
+	{
+		static constexpr bool kElimination = false;
+		struct Backoff
+		{
+			void operator()() {}
+		};
+	};
+
+	// Bounded exponential backoff, in CpuPause iterations
+	template<uint32 MinSpins = 4, uint32 MaxSpins = 1024>
+	struct ExponentialBackoff
+	{
+		static_assert(MinSpins && (MinSpins <= MaxSpins));
+		static constexpr bool kElimination = false;
+		struct Backoff
+		{
+			void operator()()
+			{
+				for (uint32 counter = 0; counter < spins_; counter++)
+				{
+					CpuPause();
+				}
+				spins_ = std::min(spins_ * 2, MaxSpins);
+			}
+
+			uint32 spins_ = MinSpins;
+		};
+	};
+
+	// Elimination backoff (Hendler, Shavit, Yerushalmi - "A Scalable Lock-free Stack Algorithm").
+	// A push offers its node in a random slot and waits WaitSpins for a pop, that takes it - neither touches the head.
+	// When nobody takes it, the push withdraws the node and backs off exponentially. The stack stays LIFO only approximately.
+	template<uint32 SlotsNum = 8, uint32 WaitSpins = 64, uint32 MinSpins = 4, uint32 MaxSpins = 1024>
+	struct EliminationBackoff
+	{
+		static_assert(SlotsNum && !(SlotsNum & (SlotsNum - 1)), "SlotsNum must be power of 2");
+		static constexpr bool kElimination = true;
+		using Backoff = typename ExponentialBackoff<MinSpins, MaxSpins>::Backoff;
+
+		// Returns true, when a pop took the node
+		bool TryPush(void* node)
+		{
+			std::atomic<void*>& slot = slots_[RandomSlot()].node_;
+			void* expected = nullptr;
+			if (!slot.compare_exchange_strong(expected, node, std::memory_order_release, std::memory_order_relaxed))
+			{
+				return false;
+			}
+			for (uint32 counter = 0; counter < WaitSpins; counter++)
+			{
+				if (slot.load(std::memory_order_relaxed) != node)
+				{
+					return true;
+				}
+				CpuPause();
+			}
+			// Failing to withdraw means it was taken. When the same node was taken, pushed and offered again meanwhile,
+			// withdrawing the second offer is still correct - the node is pushed once.
+			expected = node;
+			return !slot.compare_exchange_strong(expected, nullptr, std::memory_order_relaxed, std::memory_order_relaxed);
+		}
+
+		// Returns a node offered by a concurrent push, or nullptr
+		void* TryPop()
+		{
+			std::atomic<void*>& slot = slots_[RandomSlot()].node_;
+			for (uint32 counter = 0; counter < WaitSpins; counter++)
+			{
+				void* node = slot.load(std::memory_order_relaxed);
+				if (node && slot.compare_exchange_strong(node, nullptr, std::memory_order_acquire, std::memory_order_relaxed))
+				{
+					return node;
+				}
+				CpuPause();
+			}
+			return nullptr;
+		}
+
+	private:
+		static uint32 RandomSlot()
+		{
+			thread_local uint32 seed = 2654435761u * static_cast<uint32>(reinterpret_cast<uintptr_t>(&seed) >> 4);
+			seed ^= seed << 13;
+			seed ^= seed >> 17;
+			seed ^= seed << 5;
+			return seed & (SlotsNum - 1);
+		}
+
+		struct alignas(kCacheLineSize) Slot
+		{
+			std::atomic<void*> node_ = nullptr;
+		};
+		std::array<Slot, SlotsNum> slots_;
+	};
+
+	// Contention is a policy above: NoContention, ExponentialBackoff or EliminationBackoff
+	template<typename Node, typename Contention = NoContention>
+	struct Stack : private Contention
 	{
 		using IndexType = std::remove_cvref_t<decltype(Node{}.NextRef())>;
 
@@ -21,13 +127,27 @@ namespace ts::lock_free
 			const IndexType idx{ GetPoolIndex(node) };
 			State new_state{ .head = idx };
 			State state = state_.load(std::memory_order_relaxed);
-			do
+			typename Contention::Backoff backoff;
+			while (true)
 			{
 				new_state.tag = state.tag + 1;
 				node.NextRef() = state.head;
-			} while (!state_.compare_exchange_weak(state, new_state,
-				std::memory_order_release,
-				std::memory_order_relaxed));
+				if (state_.compare_exchange_weak(state, new_state,
+					std::memory_order_release,
+					std::memory_order_relaxed))
+				{
+					return;
+				}
+				if constexpr (Contention::kElimination)
+				{
+					if (Contention::TryPush(&node))
+					{
+						return;
+					}
+					state = state_.load(std::memory_order_relaxed);
+				}
+				backoff();
+			}
 		}
 
 		void PushChain(Node& new_head, Node& chain_tail)
@@ -36,7 +156,7 @@ namespace ts::lock_free
 				{
 					const IndexType wanted{ GetPoolIndex(chain_tail) };
 					IndexType local{ GetPoolIndex(new_head) };
-					for (int32 counter = 0; counter < (8 * 1024); counter++)
+					for (std::size_t counter = 0; counter < (kMaxPoolSegments << kPoolOffsetBits); counter++) // bounded by the max pool size
 					{
 						if (local == wanted)
 						{
@@ -53,20 +173,27 @@ namespace ts::lock_free
 			const IndexType idx{ GetPoolIndex(new_head) };
 			State new_state{ .head = idx };
 			State state = state_.load(std::memory_order_relaxed);
-			do
+			typename Contention::Backoff backoff;
+			while (true)
 			{
 				new_state.tag = state.tag + 1;
 				chain_tail.NextRef() = state.head;
-			} while (!state_.compare_exchange_weak(state, new_state,
-				std::memory_order_release,
-				std::memory_order_relaxed));
+				if (state_.compare_exchange_weak(state, new_state,
+					std::memory_order_release,
+					std::memory_order_relaxed))
+				{
+					return;
+				}
+				backoff();
+			}
 		}
 
 		Node* Pop()
 		{
 			State state = state_.load(std::memory_order_relaxed);
 			State new_state;
-			do
+			typename Contention::Backoff backoff;
+			while (true)
 			{
 				if (state.head == kInvalidIndex)
 				{
@@ -74,15 +201,73 @@ namespace ts::lock_free
 				}
 				new_state.head = FromPoolIndex<Node>(state.head).NextRef();
 				new_state.tag = state.tag + 1;
-			} while (!state_.compare_exchange_weak(state, new_state,
-				std::memory_order_release,
-				std::memory_order_relaxed));
+				if (state_.compare_exchange_weak(state, new_state,
+					std::memory_order_release,
+					std::memory_order_relaxed))
+				{
+					break;
+				}
+				if constexpr (Contention::kElimination)
+				{
+					if (Node* eliminated = static_cast<Node*>(Contention::TryPop()))
+					{
+						eliminated->NextRef() = kInvalidIndex;
+						return eliminated;
+					}
+					state = state_.load(std::memory_order_relaxed);
+				}
+				backoff();
+			}
 
 			Node& node = FromPoolIndex<Node>(state.head);
 			node.NextRef() = kInvalidIndex;
 			return &node;
 		}
 
+		// Detaches up to max_num nodes with a single CAS, returns the head of the chain (the last node has no next).
+		// The walk may read nodes popped concurrently by other threads, the tag fails the CAS then.
+		Node* PopChain(const uint32 max_num, Node*& out_tail, uint32& out_num)
+		{
+			assert(max_num);
+			State state = state_.load(std::memory_order_relaxed);
+			State new_state;
+			IndexType tail;
+			uint32 num = 0;
+			typename Contention::Backoff backoff;
+			while (true)
+			{
+				if (state.head == kInvalidIndex)
+				{
+					out_tail = nullptr;
+					out_num = 0;
+					return nullptr;
+				}
+				tail = state.head;
+				num = 1;
+				IndexType next = FromPoolIndex<Node>(tail).NextRef();
+				while ((num < max_num) && (next != kInvalidIndex))
+				{
+					tail = next;
+					next = FromPoolIndex<Node>(tail).NextRef();
+					num++;
+				}
+				new_state.head = next;
+				new_state.tag = state.tag + 1;
+				if (state_.compare_exchange_weak(state, new_state,
+					std::memory_order_acquire,
+					std::memory_order_relaxed))
+				{
+					break;
+				}
+				backoff();
+			}
+
+			out_tail = &FromPoolIndex<Node>(tail);
+			out_tail->NextRef() = kInvalidIndex;
+			out_num = num;
+			return &FromPoolIndex<Node>(state.head);
+		}
+
 		//return previous head
 		IndexType Reset(IndexType new_head = kInvalidIndex)
 		{
@@ -94,62 +279,343 @@ namespace ts::lock_free
 			return state.head;
 		}
 
+		// Detaches the whole chain, returns its head (the most recently pushed node)
+		IndexType PopAll()
+		{
+			State state = state_.load(std::memory_order_relaxed);
+			State new_state;
+			do
+			{
+				if (state.head == kInvalidIndex)
+				{
+					return state.head;
+				}
+				new_state.tag = state.tag + 1;
+			} while (!state_.compare_exchange_weak(state, new_state,
+				std::memory_order_acquire,
+				std::memory_order_relaxed));
+			return state.head;
+		}
+
+		bool IsEmpty() const
+		{
+			return state_.load(std::memory_order_relaxed).head == kInvalidIndex;
+		}
+
 	private:
 		struct State
 		{
 			IndexType head{ kInvalidIndex };
 			Tag tag = 0;
 		};
+		static_assert(sizeof(State) == sizeof(uint64));
+		static_assert(std::atomic<State>::is_always_lock_free);
 
 		std::atomic<State> state_;
 	};
 
-	template<typename Node>
-	struct PointerBasedStack
+	// Nodes are in a contiguous region (see MemoryRegion) starting at the base passed to the constructor.
+	// The head is kept as a 32-bit offset from the base (in alignof(Node) units), so with the tag the state is 64 bits.
+	template<typename Node, typename Contention = NoContention>
+	struct PointerBasedStack : private Contention
 	{
+		static constexpr uint32 kNullOffset = std::numeric_limits<uint32>::max();
+
+		explicit PointerBasedStack(const void* region_base)
+			: base_(static_cast<const uint8*>(region_base))
+		{}
+
 		void Push(Node& node)
 		{
-			State new_state{ .head = &node };
+			State new_state{ .head = ToOffset(&node) };
 			State state = state_.load(std::memory_order_relaxed);
-			do
+			typename Contention::Backoff backoff;
+			while (true)
 			{
 				new_state.tag = state.tag + 1;
-				node.next_ = state.head;
-			} while (!state_.compare_exchange_weak(state, new_state,
-				std::memory_order_release,
-				std::memory_order_relaxed));
+				node.next_ = FromOffset(state.head);
+				if (state_.compare_exchange_weak(state, new_state,
+					std::memory_order_release,
+					std::memory_order_relaxed))
+				{
+					return;
+				}
+				if constexpr (Contention::kElimination)
+				{
+					if (Contention::TryPush(&node))
+					{
+						return;
+					}
+					state = state_.load(std::memory_order_relaxed);
+				}
+				backoff();
+			}
 		}
 
 		Node* Pop()
 		{
 			State state = state_.load(std::memory_order_relaxed);
 			State new_state;
-			do
+			typename Contention::Backoff backoff;
+			while (true)
 			{
-				if (nullptr == state.head)
+				if (kNullOffset == state.head)
 				{
 					return nullptr;
 				}
-				new_state.head = state.head->next_;
+				new_state.head = ToStaleOffset(FromOffset(state.head)->next_);
 				new_state.tag = state.tag + 1;
-			} while (!state_.compare_exchange_weak(state, new_state,
-				std::memory_order_release,
-				std::memory_order_relaxed));
+				if (state_.compare_exchange_weak(state, new_state,
+					std::memory_order_release,
+					std::memory_order_relaxed))
+				{
+					break;
+				}
+				if constexpr (Contention::kElimination)
+				{
+					if (Node* eliminated = static_cast<Node*>(Contention::TryPop()))
+					{
+						eliminated->next_ = nullptr;
+						return eliminated;
+					}
+					state = state_.load(std::memory_order_relaxed);
+				}
+				backoff();
+			}
 
-			state.head->next_ = nullptr;
-			return state.head;
+			Node* head = FromOffset(state.head);
+			head->next_ = nullptr;
+			return head;
 		}
 
 	private:
+		uint32 ToOffset(const Node* node) const
+		{
+			if (!node)
+			{
+				return kNullOffset;
+			}
+			const uint8* byte_ptr = reinterpret_cast<const uint8*>(node);
+			assert(byte_ptr >= base_);
+			const std::size_t offset = static_cast<std::size_t>(byte_ptr - base_);
+			assert(!(offset % alignof(Node)));
+			assert((offset / alignof(Node)) < kNullOffset);
+			return static_cast<uint32>(offset / alignof(Node));
+		}
+
+		// For the next_ of the head, that may be popped and reused concurrently. A garbage value is never dereferenced,
+		// the tag fails the CAS then.
+		uint32 ToStaleOffset(const Node* node) const
+		{
+			const std::uintptr_t address = reinterpret_cast<std::uintptr_t>(node);
+			const std::uintptr_t base = reinterpret_cast<std::uintptr_t>(base_);
+			if (!node || (address < base) || ((address - base) / alignof(Node) >= kNullOffset))
+			{
+				return kNullOffset;
+			}
+			return static_cast<uint32>((address - base) / alignof(Node));
+		}
+
+		Node* FromOffset(const uint32 offset) const
+		{
+			return (kNullOffset == offset)
+				? nullptr
+				: reinterpret_cast<Node*>(const_cast<uint8*>(base_) + std::size_t{ offset } * alignof(Node));
+		}
+
 		struct State
 		{
-			Node* head = nullptr;
+			uint32 head = kNullOffset;
 			Tag tag = 0;
 		};
+		static_assert(sizeof(State) == sizeof(uint64));
+		static_assert(std::atomic<State>::is_always_lock_free);
 
+		const uint8* base_;
 		std::atomic<State> state_;
 	};
 
+	// Chase-Lev deque (Le, Pop, Cohen, Nardelli - "Correct and Efficient Work-Stealing for Weak Memory Models").
+	// Push and Pop can be called only by the owner thread (LIFO), Steal by any thread (FIFO).
+	// Fixed capacity, Push fails when the deque is full.
+	template<typename Node, std::size_t Capacity>
+	struct WorkStealingDeque
+	{
+		using IndexType = std::remove_cvref_t<decltype(Node{}.NextRef())>;
+		static_assert(Capacity && !(Capacity & (Capacity - 1)), "Capacity must be power of 2");
+
+		bool Push(Node& node)
+		{
+			const int64 bottom = bottom_.load(std::memory_order_relaxed);
+			const int64 top = top_.load(std::memory_order_acquire);
+			if ((bottom - top) >= static_cast<int64>(Capacity))
+			{
+				return false;
+			}
+			items_[bottom & kMask].store(IndexType{ GetPoolIndex(node) }, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_release);
+			bottom_.store(bottom + 1, std::memory_order_relaxed);
+			return true;
+		}
+
+		Node* Pop()
+		{
+			const int64 bottom = bottom_.load(std::memory_order_relaxed) - 1;
+			bottom_.store(bottom, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			int64 top = top_.load(std::memory_order_relaxed);
+			if (top > bottom) // empty
+			{
+				bottom_.store(bottom + 1, std::memory_order_relaxed);
+				return nullptr;
+			}
+
+			const IndexType idx = items_[bottom & kMask].load(std::memory_order_relaxed);
+			if (top == bottom) // last element, compete with thieves
+			{
+				const bool won = top_.compare_exchange_strong(top, top + 1,
+					std::memory_order_seq_cst,
+					std::memory_order_relaxed);
+				bottom_.store(bottom + 1, std::memory_order_relaxed);
+				if (!won)
+				{
+					return nullptr;
+				}
+			}
+			return &FromPoolIndex<Node>(idx);
+		}
+
+		// May return nullptr, when lost a race with another thief or the owner.
+		Node* Steal()
+		{
+			int64 top = top_.load(std::memory_order_acquire);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			const int64 bottom = bottom_.load(std::memory_order_acquire);
+			if (top >= bottom)
+			{
+				return nullptr;
+			}
+
+			const IndexType idx = items_[top & kMask].load(std::memory_order_relaxed);
+			if (!top_.compare_exchange_strong(top, top + 1,
+				std::memory_order_seq_cst,
+				std::memory_order_relaxed))
+			{
+				return nullptr;
+			}
+			return &FromPoolIndex<Node>(idx);
+		}
+
+		bool IsEmpty() const
+		{
+			const int64 top = top_.load(std::memory_order_relaxed);
+			const int64 bottom = bottom_.load(std::memory_order_relaxed);
+			return top >= bottom;
+		}
+
+	private:
+		static constexpr int64 kMask = static_cast<int64>(Capacity) - 1;
+
+		alignas(kCacheLineSize) std::atomic<int64> top_ = 0;
+		alignas(kCacheLineSize) std::atomic<int64> bottom_ = 0;
+		alignas(kCacheLineSize) std::array<std::atomic<IndexType>, Capacity> items_;
+	};
+
+	// Bounded multi producer multi consumer FIFO queue (Dmitry Vyukov). Stores pool indexes.
+	template<typename Node, std::size_t Capacity>
+	struct BoundedQueue
+	{
+		using IndexType = std::remove_cvref_t<decltype(Node{}.NextRef())>;
+		static_assert(Capacity && !(Capacity & (Capacity - 1)), "Capacity must be power of 2");
+
+		BoundedQueue()
+		{
+			for (std::size_t idx = 0; idx < Capacity; idx++)
+			{
+				cells_[idx].sequence_.store(idx, std::memory_order_relaxed);
+			}
+		}
+
+		// Returns false when full
+		bool Enqueue(Node& node)
+		{
+			std::size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+			Cell* cell = nullptr;
+			while (true)
+			{
+				cell = &cells_[pos & kMask];
+				const std::size_t sequence = cell->sequence_.load(std::memory_order_acquire);
+				const intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos);
+				if (!diff)
+				{
+					if (enqueue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+					{
+						break;
+					}
+				}
+				else if (diff < 0)
+				{
+					return false;
+				}
+				else
+				{
+					pos = enqueue_pos_.load(std::memory_order_relaxed);
+				}
+			}
+			cell->value_ = IndexType{ GetPoolIndex(node) };
+			cell->sequence_.store(pos + 1, std::memory_order_release);
+			return true;
+		}
+
+		Node* Dequeue()
+		{
+			std::size_t pos = dequeue_pos_.load(std::memory_order_relaxed);
+			Cell* cell = nullptr;
+			while (true)
+			{
+				cell = &cells_[pos & kMask];
+				const std::size_t sequence = cell->sequence_.load(std::memory_order_acquire);
+				const intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos + 1);
+				if (!diff)
+				{
+					if (dequeue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+					{
+						break;
+					}
+				}
+				else if (diff < 0)
+				{
+					return nullptr;
+				}
+				else
+				{
+					pos = dequeue_pos_.load(std::memory_order_relaxed);
+				}
+			}
+			const IndexType idx = cell->value_;
+			cell->sequence_.store(pos + kMask + 1, std::memory_order_release);
+			return &FromPoolIndex<Node>(idx);
+		}
+
+		bool IsEmpty() const
+		{
+			return dequeue_pos_.load(std::memory_order_relaxed) >= enqueue_pos_.load(std::memory_order_relaxed);
+		}
+
+	private:
+		static constexpr std::size_t kMask = Capacity - 1;
+
+		struct Cell
+		{
+			std::atomic<std::size_t> sequence_;
+			IndexType value_;
+		};
+
+		alignas(kCacheLineSize) std::atomic<std::size_t> enqueue_pos_ = 0;
+		alignas(kCacheLineSize) std::atomic<std::size_t> dequeue_pos_ = 0;
+		alignas(kCacheLineSize) std::array<Cell, Capacity> cells_;
+	};
+
 	enum class ETagAction
 	{
 		None, 
@@ -161,14 +627,20 @@ namespace ts::lock_free
 	struct Collection
 	{
 		using IndexType = std::remove_cvref_t<decltype(Node{}.NextRef())>;
+		// 64 bits: the index, the gate, the tag (GateTag), an ABA counter bumped by each change
+		// and a flag set by threads parked in WaitWhile
 		struct State
 		{
 			IndexType head{ kInvalidIndex };
 			Gate gate = {};
 			uint8 tag = 0;
+			uint16 aba : 15 = 0;
+			uint16 waiters : 1 = 0;
 
 			bool operator== (const State&) const = default;
 		};
+		static_assert(sizeof(State) == sizeof(uint64));
+		static_assert(std::atomic<State>::is_always_lock_free);
 
 		Collection(Gate gate)
 			: state_(State{ .gate = gate })
@@ -191,7 +663,7 @@ namespace ts::lock_free
 		bool Add(Node& node, const Gate required_open, const uint8 required_tag)
 		{
 			const IndexType idx{ GetPoolIndex(node) };
-			const State new_state{ idx, required_open, required_tag };
+			State new_state{ idx, required_open, required_tag };
 			State old_state = state_.load(std::memory_order_relaxed);
 			do
 			{
@@ -199,6 +671,8 @@ namespace ts::lock_free
 				{
 					return false;
 				}
+				new_state.aba = old_state.aba + 1;
+				new_state.waiters = old_state.waiters;
 				node.NextRef() = old_state.head;
 			} while (!state_.compare_exchange_weak(old_state, new_state,
 				std::memory_order_release,
@@ -218,6 +692,8 @@ namespace ts::lock_free
 					return false;
 				}
 				new_state.tag = old_state.tag;
+				new_state.aba = old_state.aba + 1;
+				new_state.waiters = old_state.waiters;
 				node.NextRef() = old_state.head;
 			} while (!state_.compare_exchange_weak(old_state, new_state,
 				std::memory_order_release,
@@ -225,7 +701,8 @@ namespace ts::lock_free
 			return true;
 		}
 
-		//Should be called once. Returns prev state
+		//Should be called once. Returns prev state. The new state has no waiters flag, when the old one had it
+		//the caller should NotifyAll.
 		template<typename Func>
 		State ConsumeAll(const Gate new_gate, Func& func, const ETagAction tag_action = ETagAction::None)
 		{
@@ -257,6 +734,7 @@ namespace ts::lock_free
 
 				node = &FromPoolIndex<Node>(old_state.head);
 				new_state.head = node->NextRef();
+				new_state.aba = old_state.aba + 1;
 			} while (!state_.compare_exchange_weak(old_state, new_state,
 				std::memory_order_release,
 				std::memory_order_relaxed));
@@ -272,6 +750,33 @@ namespace ts::lock_free
 				std::memory_order_relaxed
 			);
 		}
+
+		// Blocks (std::atomic::wait) while the gate is pending_gate. The waiters flag is set in the state,
+		// so the thread changing the gate knows it should NotifyAll (see ConsumeAll).
+		void WaitWhile(const Gate pending_gate)
+		{
+			State state = state_.load(std::memory_order_acquire);
+			while (state.gate == pending_gate)
+			{
+				if (!state.waiters)
+				{
+					State flagged = state;
+					flagged.waiters = 1;
+					if (!state_.compare_exchange_weak(state, flagged, std::memory_order_relaxed, std::memory_order_acquire))
+					{
+						continue;
+					}
+					state = flagged;
+				}
+				state_.wait(state, std::memory_order_acquire);
+				state = state_.load(std::memory_order_acquire);
+			}
+		}
+
+		void NotifyAll()
+		{
+			state_.notify_all();
+		}
 	private:
 		State ResetInner(const Gate new_gate, const ETagAction tag_action)
 		{
@@ -287,6 +792,7 @@ namespace ts::lock_free
 				{
 					new_state.tag = (tag_action == ETagAction::Increment)
 						? (old_state.tag + 1) : old_state.tag;
+					new_state.aba = old_state.aba + 1;
 				} while (!state_.compare_exchange_weak(old_state, new_state,
 					std::memory_order_release,
 					std::memory_order_relaxed));
@@ -297,10 +803,14 @@ namespace ts::lock_free
 		std::atomic<State> state_;
 	};
 
-	// Allows to set value, only when gate is in open state
+	// Allows to set value, only when gate is in open state.
+	// Value is a pointer, the gate is packed into its alignment bits, so the state is a single lock-free word.
 	template<typename Value, typename Gate>
 	struct GatedValue
 	{
+		static_assert(std::is_pointer_v<Value>);
+		static constexpr std::uintptr_t kGateMask = 0x3; // values must be aligned to 4
+
 		struct State
 		{
 			Value value_;
@@ -308,20 +818,20 @@ namespace ts::lock_free
 		};
 
 		GatedValue(Value val, Gate gate)
-			: state_(State{ val, gate })
+			: state_(Pack(val, gate))
 		{}
 
 		bool TrySet(const Gate required_open, Value new_value, const Value assert_empty = {})
 		{
-			const State new_state{ std::move(new_value), required_open };
-			State state = state_.load(std::memory_order_relaxed);
+			const std::uintptr_t new_state = Pack(new_value, required_open);
+			std::uintptr_t state = state_.load(std::memory_order_relaxed);
 			do
 			{
-				if (state.gate_ != required_open)
+				if (Unpack(state).gate_ != required_open)
 				{
 					return false;
 				}
-				assert(assert_empty == state.value_);
+				assert(assert_empty == Unpack(state).value_);
 			} while (!state_.compare_exchange_weak(state, new_state,
 				std::memory_order_release,
 				std::memory_order_relaxed));
@@ -330,15 +840,30 @@ namespace ts::lock_free
 
 		State Close(const Gate new_closed, Value new_empty)
 		{
-			return state_.exchange(State{ std::move(new_empty), new_closed });
+			return Unpack(state_.exchange(Pack(new_empty, new_closed)));
 		}
 
 		State Get() const
 		{
-			return state_.load(std::memory_order_relaxed);
+			return Unpack(state_.load(std::memory_order_relaxed));
 		}
 
 	private:
-		std::atomic<State> state_;
+		static std::uintptr_t Pack(Value value, const Gate gate)
+		{
+			const std::uintptr_t raw_value = reinterpret_cast<std::uintptr_t>(value);
+			const std::uintptr_t raw_gate = static_cast<std::uintptr_t>(gate);
+			assert(!(raw_value & kGateMask));
+			assert(raw_gate <= kGateMask);
+			return raw_value | raw_gate;
+		}
+
+		static State Unpack(const std::uintptr_t raw)
+		{
+			return State{ reinterpret_cast<Value>(raw & ~kGateMask), static_cast<Gate>(raw & kGateMask) };
+		}
+
+		std::atomic<std::uintptr_t> state_;
+		static_assert(std::atomic<std::uintptr_t>::is_always_lock_free);
 	};
 }
\ No newline at end of file
@@ -0,0 +1,85 @@
+#include "MemoryRegion.h"
+#include <algorithm>
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+namespace ts
+{
+	namespace
+	{
+		uint8* ReserveAddressSpace(std::size_t size)
+		{
+#if defined(_WIN32)
+			return static_cast<uint8*>(VirtualAlloc(nullptr, size, MEM_RESERVE, PAGE_NOACCESS));
+#else
+			void* ptr = mmap(nullptr, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+			return (ptr == MAP_FAILED) ? nullptr : static_cast<uint8*>(ptr);
+#endif
+		}
+
+		bool CommitAddressSpace(uint8* begin, std::size_t size)
+		{
+#if defined(_WIN32)
+			return !!VirtualAlloc(begin, size, MEM_COMMIT, PAGE_READWRITE);
+#else
+			return !mprotect(begin, size, PROT_READ | PROT_WRITE);
+#endif
+		}
+
+		void ReleaseAddressSpace(uint8* begin, [[maybe_unused]] std::size_t size)
+		{
+#if defined(_WIN32)
+			VirtualFree(begin, 0, MEM_RELEASE);
+#else
+			munmap(begin, size);
+#endif
+		}
+	}
+
+	MemoryRegion::MemoryRegion(std::size_t reserved_size)
+	{
+		assert(reserved_size && !(reserved_size % kRegionCommitSize));
+		base_ = ReserveAddressSpace(reserved_size);
+		reserved_size_ = base_ ? reserved_size : 0;
+	}
+
+	MemoryRegion::~MemoryRegion()
+	{
+		if (base_)
+		{
+			ReleaseAddressSpace(base_, reserved_size_);
+		}
+	}
+
+	uint8* MemoryRegion::Carve(std::size_t size)
+	{
+		constexpr std::size_t kAlignment = alignof(std::max_align_t);
+		size = (size + kAlignment - 1) & ~(kAlignment - 1);
+
+		std::lock_guard lock(mutex_);
+		if (size > reserved_size_ - carved_size_)
+		{
+			return nullptr;
+		}
+		const std::size_t committed = committed_size_.load(std::memory_order_relaxed);
+		if (carved_size_ + size > committed)
+		{
+			const std::size_t new_committed = std::min(reserved_size_,
+				((carved_size_ + size + kRegionCommitSize - 1) / kRegionCommitSize) * kRegionCommitSize);
+			if (!CommitAddressSpace(base_ + committed, new_committed - committed))
+			{
+				return nullptr;
+			}
+			committed_size_.store(new_committed, std::memory_order_relaxed);
+		}
+		uint8* block = base_ + carved_size_;
+		carved_size_ += size;
+		return block;
+	}
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include "Common.h"
+#include <mutex>
+
+namespace ts
+{
+	// A contiguous range of address space, reserved at construction and committed on demand (by kRegionCommitSize).
+	// Blocks are carved from it by bumping, they are never returned - the whole region is released at destruction.
+	// Blocks of a region can be referenced by 32-bit offsets from its base, see lock_free::PointerBasedStack.
+	// When the address space cannot be reserved, the region is empty and Carve always fails.
+	class MemoryRegion
+	{
+	public:
+		explicit MemoryRegion(std::size_t reserved_size);
+		~MemoryRegion();
+
+		MemoryRegion(MemoryRegion&&) = delete;
+		MemoryRegion(const MemoryRegion&) = delete;
+		MemoryRegion& operator=(MemoryRegion&&) = delete;
+		MemoryRegion& operator=(const MemoryRegion&) = delete;
+
+		// Returns nullptr, when the region is full. Blocks are aligned to alignof(std::max_align_t).
+		uint8* Carve(std::size_t size);
+
+		uint8* GetBase() const
+		{
+			return base_;
+		}
+
+		bool Contains(const void* ptr) const
+		{
+			const uint8* byte_ptr = static_cast<const uint8*>(ptr);
+			return (byte_ptr >= base_) && (byte_ptr < base_ + reserved_size_);
+		}
+
+		std::size_t GetCommittedSize() const
+		{
+			return committed_size_.load(std::memory_order_relaxed);
+		}
+
+	private:
+		uint8* base_ = nullptr;
+		std::size_t reserved_size_ = 0;
+		std::size_t carved_size_ = 0; // under mutex_
+		std::atomic<std::size_t> committed_size_ = 0; // written under mutex_
+		std::mutex mutex_;
+	};
+}
@@ -3,12 +3,20 @@
 #include <iterator>
 #include <array>
 #include <algorithm>
-#include <random>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <new>
 #include "LockFree.h"
+#include "Topology.h"
 
 namespace ts
 {
 	extern thread_local uint16 t_worker_thread_idx;
+	// Worker threads use their worker index. Registered external threads (see TaskSystem::RegisterExternalThread)
+	// use the slots from kMaxWorkerThreadsNum.
+	extern thread_local uint16 t_pool_cache_idx;
 }
 
 #if DO_POOL_STATS
@@ -54,83 +62,255 @@ namespace ts
 			return &node;
 		}
 
+		// Detaches num nodes (at most the size) as a chain, the last one has no next
+		Node& PopChain(const uint16 num, Node*& out_tail)
+		{
+			assert(num && (num <= size_));
+			Node& head = FromPoolIndex<Node>(head_);
+			Node* tail = &head;
+			for (uint16 counter = 1; counter < num; counter++)
+			{
+				tail = &FromPoolIndex<Node>(tail->NextRef());
+			}
+			head_ = tail->NextRef();
+			tail->NextRef().Reset();
+			size_ -= num;
+			out_tail = tail;
+			return head;
+		}
+
 		uint16 GetSize() const { return size_; }
 
+		template<typename F>
+		void ForEach(F&& functor) const
+		{
+			for (IndexType iter = head_; iter.IsValid(); iter = FromPoolIndex<Node>(iter).NextRef())
+			{
+				functor(FromPoolIndex<Node>(iter));
+			}
+		}
+
 	private:
 		IndexType head_;
 		uint16 size_ = 0;
 	};
 
-	template<typename Node, std::size_t Size
-#if THREAD_SMART_POOL
-		, std::size_t NumThreads, std::size_t ElementsPerThread, std::size_t MaxElementsPerThread
-#endif
-	>
+	// Counters of the per-thread caches. Written only by the owner thread, so the sum is approximate.
+	// Threads without a cache (not registered external threads) are not counted.
+	struct PoolCacheStats
+	{
+		uint64 thread_cache_acquires = 0;
+		uint64 global_acquires = 0; // single nodes popped from the global stack (a cache refill found it empty, the pool grew)
+		uint64 thread_cache_returns = 0;
+		uint64 global_returns = 0; // single nodes pushed to the global stack (a chain longer than the cache)
+		uint64 refills = 0; // magazines popped from the global stack, see kPoolMagazineSize
+		uint64 refilled_nodes = 0;
+		uint64 spills = 0; // magazines pushed to the global stack
+		uint64 spilled_nodes = 0;
+		uint64 chain_acquires = 0; // chains popped from the global stack by Pool::AcquireChain
+		uint64 chain_acquired_nodes = 0;
+
+		// CAS operations (including retries) on the global free stack are proportional to this
+		uint64 GetGlobalStackOperations() const
+		{
+			return global_acquires + global_returns + refills + spills + chain_acquires;
+		}
+	};
+
+	// No companion array, see Pool
+	struct NoCompanion {};
+
+	// Nodes are stored in segments of kPoolSegmentSize bytes, allocated on demand up to MaxSize nodes.
+	// A segment holds a header, the nodes and optionally an array of Companion (the cold part of the nodes, see BaseTask).
+	// Existing nodes never move, segments are released with the pool.
+	template<typename Node, std::size_t InitialSize, std::size_t MaxSize = InitialSize, typename Companion = NoCompanion>
 	struct Pool
 	{
 		using IndexType = std::remove_cvref_t<decltype(Node{}.NextRef())>;
+		using Layout = PoolSegmentLayout<Node>;
+		static constexpr bool kHasCompanion = !std::is_same_v<Companion, NoCompanion>;
+		static constexpr std::size_t kCompanionSize = kHasCompanion ? sizeof(Companion) : 0;
+		static constexpr std::size_t kNodesPerSegment = std::min<std::size_t>(kPoolOffsetMask,
+			(kPoolSegmentSize - Layout::kNodesOffset - alignof(Companion)) / (sizeof(Node) + kCompanionSize));
+		static constexpr std::size_t kCompanionsOffset = ((Layout::kNodesOffset + kNodesPerSegment * sizeof(Node) + alignof(Companion) - 1)
+			/ alignof(Companion)) * alignof(Companion);
+		static constexpr std::size_t kMaxSegments = (MaxSize + kNodesPerSegment - 1) / kNodesPerSegment;
+		static_assert(kNodesPerSegment > 0, "A node does not fit kPoolSegmentSize");
+		static_assert(kCompanionsOffset + kNodesPerSegment * kCompanionSize <= kPoolSegmentSize);
+		static_assert(kMaxSegments <= kMaxPoolSegments, "Increase kMaxPoolSegments or kPoolSegmentSize");
+		static_assert(InitialSize && (InitialSize <= MaxSize));
+		static constexpr std::size_t kMaxSize = MaxSize;
+		using GrowthCallback = void (*)(std::size_t capacity);
+#if THREAD_SMART_POOL
+		// Padded, so caches of different threads never share a cache line.
+		struct alignas(kCacheLineSize) ThreadCache
+		{
+			UnsafeStack<Node> free_;
+			uint16 max_size_ = 0; // returns over the size go to the global stack
+			PoolCacheStats stats_;
+		};
+#endif
 
 		Pool()
 		{
-#if 1
-            for (Index Idx = 1; Idx < Size; Idx++)
-            {
-                all_[Idx - 1].NextRef() = Idx;
-            }
-            Index first_remaining{ 0 };
-#else
-            std::vector<Index> initial_order;
-            initial_order.reserve(Size);
-            for (Index Idx = 0; Idx < Size; Idx++)
-            {
-                initial_order.push_back(Idx);
-            }
-            std::random_device rd;
-            std::mt19937 g(rd());
-            std::shuffle(initial_order.begin(), initial_order.end(), g);
-            for (Index Idx = 0; Idx < (Size - 1); Idx++)
-            {
-                all_[initial_order[Idx]].NextRef() = initial_order[Idx+1];
-            }
-
-            Index first_remaining = initial_order[0];
-#endif
-			
-			POOL_STATS(global_free_counter_= Size;)
-#if THREAD_SMART_POOL
-			for (int32 thread_idx = 0; thread_idx < NumThreads; thread_idx++)
+			while (capacity_ < InitialSize)
 			{
-				UnsafeStack<Node>& stack = free_per_thread_[thread_idx];
-				const Index last_element = first_remaining + ElementsPerThread - 1;
-				all_[last_element].NextRef() = kInvalidIndex;
-				stack.PushChain(all_[first_remaining], all_[last_element], ElementsPerThread);
-				first_remaining += ElementsPerThread;
+				AddSegment();
+			}
+		}
+
+		Pool(Pool&&) = delete;
+		Pool(const Pool&) = delete;
+		Pool& operator=(Pool&&) = delete;
+		Pool& operator=(const Pool&) = delete;
+
+		~Pool()
+		{
+			POOL_STATS(AssertEmpty();)
+			for (std::size_t segment_idx = 0; segment_idx < segments_num_; segment_idx++)
+			{
+				uint8* segment = segments_.segments_[segment_idx].load(std::memory_order_relaxed);
+				Node* nodes = Layout::GetNodes(segment);
+				for (std::size_t offset = 0; offset < kNodesPerSegment; offset++)
+				{
+					std::destroy_at(&nodes[offset]);
+					if constexpr (kHasCompanion)
+					{
+						std::destroy_at(&GetCompanions(segment)[offset]);
+					}
+				}
+				std::destroy_at(reinterpret_cast<PoolSegmentHeader*>(segment));
+				::operator delete(segment, std::align_val_t{ kPoolSegmentSize });
 			}
-			POOL_STATS(global_free_counter_ -= NumThreads * ElementsPerThread;)
-			POOL_STATS(thread_free_counter_ = NumThreads * ElementsPerThread;)
-#endif
-			free_.Reset(IndexType{first_remaining});
 		}
 
 #if THREAD_SMART_POOL
-		UnsafeStack<Node>* GetStackPerThread()
+		// Per-thread caches are filled when the worker threads are started. Their size depends on the number of threads.
+		// Must not be called, when worker threads are running.
+		// Caches of registered external threads are not touched.
+		void ResizeThreadCaches(const uint16 num_threads)
+		{
+			assert(num_threads <= kMaxWorkerThreadsNum);
+			for (uint16 thread_idx = 0; thread_idx < kMaxWorkerThreadsNum; thread_idx++)
+			{
+				FlushThreadCache(thread_idx);
+			}
+			for (uint16 thread_idx = 0; thread_idx < num_threads; thread_idx++)
+			{
+				FillThreadCache(thread_idx, num_threads);
+			}
+		}
+
+		// Called by a registered external thread. The cache is sized like a worker cache for workers_num workers.
+		void FillExternalThreadCache(const uint16 cache_idx, const uint16 workers_num)
+		{
+			assert((cache_idx >= kMaxWorkerThreadsNum) && (cache_idx < thread_caches_.size()));
+			FillThreadCache(cache_idx, std::max<uint16>(workers_num, 1));
+		}
+
+		// Moves the cached nodes to the global stack. Called by the owner thread, or when workers are not running.
+		void FlushThreadCache(const uint16 cache_idx)
+		{
+			ThreadCache& cache = thread_caches_[cache_idx];
+			cache.max_size_ = 0;
+			while (Node* node = cache.free_.Pop())
+			{
+				free_.Push(*node);
+				POOL_STATS(thread_free_counter_--;)
+				POOL_STATS(global_free_counter_++;)
+			}
+			NotifyReturnWaiters();
+		}
+
+		// Called by the (pinned) worker thread. Pages covered by a run of cached nodes are moved to the numa node
+		// of the worker, when the run is contiguous - the pages hold only nodes of this cache. That is true for a cache
+		// filled from a fresh segment, not for one refilled from the scattered global stack (after a restart).
+		void BindThreadCacheToNumaNode(const uint16 thread_idx, const uint16 numa_node)
+		{
+			const UnsafeStack<Node>& cache = thread_caches_[thread_idx].free_;
+			const PoolSegmentHeader* segment = nullptr;
+			const Node* first = nullptr;
+			const Node* last = nullptr;
+			std::size_t nodes_num = 0;
+			auto bind_range = [&]()
+				{
+					if (first && (nodes_num == static_cast<std::size_t>(last - first) + 1))
+					{
+						CpuTopology::Get().BindMemoryToNode(first, last + 1, numa_node);
+					}
+				};
+			cache.ForEach([&](const Node& node)
+				{
+					const PoolSegmentHeader* node_segment = &Layout::GetHeader(node);
+					if (node_segment != segment)
+					{
+						bind_range();
+						segment = node_segment;
+						first = last = &node;
+						nodes_num = 1;
+						return;
+					}
+					first = (&node < first) ? &node : first;
+					last = (&node > last) ? &node : last;
+					nodes_num++;
+				});
+			bind_range();
+		}
+
+		ThreadCache* GetThreadCache()
 		{
-			return (t_worker_thread_idx != kInvalidIndex)
-				? &free_per_thread_[t_worker_thread_idx]
+			return (t_pool_cache_idx != kInvalidThreadIndex)
+				? &thread_caches_[t_pool_cache_idx]
 				: nullptr;
 		}
+
+		PoolCacheStats GetCacheStats() const
+		{
+			PoolCacheStats result;
+			for (const ThreadCache& cache : thread_caches_)
+			{
+				result.thread_cache_acquires += cache.stats_.thread_cache_acquires;
+				result.global_acquires += cache.stats_.global_acquires;
+				result.thread_cache_returns += cache.stats_.thread_cache_returns;
+				result.global_returns += cache.stats_.global_returns;
+				result.refills += cache.stats_.refills;
+				result.refilled_nodes += cache.stats_.refilled_nodes;
+				result.spills += cache.stats_.spills;
+				result.spilled_nodes += cache.stats_.spilled_nodes;
+				result.chain_acquires += cache.stats_.chain_acquires;
+				result.chain_acquired_nodes += cache.stats_.chain_acquired_nodes;
+			}
+			return result;
+		}
+
+		void ResetCacheStats()
+		{
+			for (ThreadCache& cache : thread_caches_)
+			{
+				cache.stats_ = PoolCacheStats{};
+			}
+		}
 #endif
 
-		Node& Acquire()
+		// Returns nullptr, when the pool reached MaxSize and has no free node
+		Node* TryAcquire()
 		{
 #if THREAD_SMART_POOL
-			UnsafeStack<Node>* thread_stack = GetStackPerThread();
-			const bool use_thread_stack = (thread_stack && thread_stack->GetSize());
+			ThreadCache* thread_cache = GetThreadCache();
+			if (thread_cache && !thread_cache->free_.GetSize())
+			{
+				Refill(*thread_cache);
+			}
+			const bool use_thread_stack = (thread_cache && thread_cache->free_.GetSize());
 			Node* ptr = use_thread_stack
-				? thread_stack->Pop()
-				: free_.Pop();
+				? thread_cache->free_.Pop()
+				: PopOrGrow();
+			if (thread_cache)
+			{
+				(use_thread_stack ? thread_cache->stats_.thread_cache_acquires : thread_cache->stats_.global_acquires)++;
+			}
 #else
-			Node* ptr = free_.Pop();
+			Node* ptr = PopOrGrow();
 #endif
 #if DO_POOL_STATS
 			if (ptr)
@@ -151,10 +331,80 @@ namespace ts
 #endif
 			}
 #endif
-			assert(ptr);
+			return ptr;
+		}
+
+		Node& Acquire()
+		{
+			Node* ptr = TryAcquire();
+			assert(ptr); // MaxSize reached
 			return *ptr;
 		}
 
+		// Acquires num nodes linked by NextRef, the last node has no next.
+		Node& AcquireChain(const uint16 num)
+		{
+			return AcquireChain(num, [this]() -> Node& { return Acquire(); });
+		}
+
+		// The nodes come from the thread cache, then from the global stack as chains (a single CAS per chain).
+		// When the global stack is empty, the remaining nodes are acquired one by one by acquire_node,
+		// that returns a node of this pool (see TryAcquire) - it grows the pool or handles its exhaustion.
+		template<typename F>
+		Node& AcquireChain(const uint16 num, F&& acquire_node)
+		{
+			assert(num);
+			IndexType head;
+			uint16 acquired = 0;
+			auto link = [&](Node& chain_head, Node& chain_tail, const uint16 chain_len)
+				{
+					chain_tail.NextRef() = head;
+					head = IndexType{ GetPoolIndex(chain_head) };
+					acquired += chain_len;
+				};
+#if THREAD_SMART_POOL
+			ThreadCache* thread_cache = GetThreadCache();
+			if (const uint16 cached = thread_cache ? std::min(num, thread_cache->free_.GetSize()) : uint16{ 0 })
+			{
+				Node* tail = nullptr;
+				Node& chain = thread_cache->free_.PopChain(cached, tail);
+				link(chain, *tail, cached);
+				thread_cache->stats_.thread_cache_acquires += cached;
+				POOL_STATS(thread_free_counter_ -= cached;)
+			}
+#endif
+			while (acquired < num)
+			{
+				Node* tail = nullptr;
+				uint32 popped = 0;
+				Node* chain = free_.PopChain(num - acquired, tail, popped);
+				if (!chain)
+				{
+					break;
+				}
+				link(*chain, *tail, static_cast<uint16>(popped));
+#if THREAD_SMART_POOL
+				if (thread_cache)
+				{
+					thread_cache->stats_.chain_acquires++;
+					thread_cache->stats_.chain_acquired_nodes += popped;
+				}
+#endif
+				POOL_STATS(global_free_counter_ -= popped;)
+			}
+#if DO_POOL_STATS
+			const uint32 loc_counter = (used_counter_ += acquired);
+			max_used = std::max(loc_counter, max_used);
+#endif
+			for (; acquired < num; acquired++)
+			{
+				Node& node = acquire_node();
+				node.NextRef() = head;
+				head = IndexType{ GetPoolIndex(node) };
+			}
+			return FromPoolIndex<Node>(head);
+		}
+
 		void Return(Node& node)
 		{
 			if constexpr (requires { node.OnReturnToPool(); })
@@ -164,16 +414,31 @@ namespace ts
 			POOL_STATS(assert(used_counter_ > 0);)
 			POOL_STATS(used_counter_--;)
 #if THREAD_SMART_POOL
-			UnsafeStack<Node>* thread_stack = GetStackPerThread();
-			if (thread_stack && (thread_stack->GetSize() < MaxElementsPerThread))
+			ThreadCache* thread_cache = GetThreadCache();
+			const bool waiters = return_waiters_.load(std::memory_order_relaxed);
+			if (thread_cache && waiters) [[unlikely]]
+			{
+				SpillAll(*thread_cache); // the node goes to the global stack below
+			}
+			else if (thread_cache && (thread_cache->free_.GetSize() >= thread_cache->max_size_))
 			{
-				thread_stack->Push(node);
+				Spill(*thread_cache);
+			}
+			if (thread_cache && (thread_cache->free_.GetSize() < thread_cache->max_size_) && !waiters)
+			{
+				thread_cache->free_.Push(node);
+				thread_cache->stats_.thread_cache_returns++;
 				POOL_STATS(thread_free_counter_++;)
 				return;
 			}
+			if (thread_cache)
+			{
+				thread_cache->stats_.global_returns++;
+			}
 			POOL_STATS(global_free_counter_++;)
 #endif
 			free_.Push(node);
+			NotifyReturnWaiters();
 		}
 
 		void ReturnChain(Node& new_head, Node& chain_tail, [[maybe_unused]] uint16 chain_len)
@@ -190,27 +455,77 @@ namespace ts
 				}
 			}
 #if THREAD_SMART_POOL
-			UnsafeStack<Node>* thread_stack = GetStackPerThread();
-			if (thread_stack && ((thread_stack->GetSize() + chain_len) <= MaxElementsPerThread))
+			ThreadCache* thread_cache = GetThreadCache();
+			const bool waiters = return_waiters_.load(std::memory_order_relaxed);
+			if (thread_cache && waiters) [[unlikely]]
+			{
+				SpillAll(*thread_cache); // the chain goes to the global stack below
+			}
+			else if (thread_cache && (chain_len <= thread_cache->max_size_) && ((thread_cache->free_.GetSize() + chain_len) > thread_cache->max_size_))
 			{
-				thread_stack->PushChain(new_head, chain_tail, chain_len);
+				Spill(*thread_cache);
+			}
+			if (thread_cache && ((thread_cache->free_.GetSize() + chain_len) <= thread_cache->max_size_) && !waiters)
+			{
+				thread_cache->free_.PushChain(new_head, chain_tail, chain_len);
+				thread_cache->stats_.thread_cache_returns += chain_len;
 				POOL_STATS(thread_free_counter_ += chain_len;)
 				return;
 			}
+			if (thread_cache)
+			{
+				thread_cache->stats_.global_returns += chain_len;
+			}
 			POOL_STATS(global_free_counter_ += chain_len;)
 #endif
 			free_.PushChain(new_head, chain_tail);
+			NotifyReturnWaiters();
+		}
+
+		// Parks the calling thread until a node is returned to the global stack (see NotifyReturnWaiters),
+		// unless the stack is not empty already. The node may be taken by another thread first, the caller retries.
+		// While a thread waits, returns bypass the thread caches. The returning thread checks the waiters without
+		// a fence, so it may miss a waiter that just came - the timeout bounds such a missed wake-up.
+		void WaitForReturn()
+		{
+			std::unique_lock lock(return_mutex_);
+			return_waiters_.fetch_add(1, std::memory_order_relaxed);
+			if (free_.IsEmpty())
+			{
+				return_cv_.wait_for(lock, std::chrono::microseconds(kPoolReturnWaitMicroseconds));
+			}
+			return_waiters_.fetch_sub(1, std::memory_order_relaxed);
+		}
+
+		const PoolSegmentTable& GetSegments() const
+		{
+			return segments_;
+		}
+
+		bool BelonsTo(const Node& node) const
+		{
+			return Layout::GetHeader(node).pool_ == this;
 		}
 
-		std::span<Node> GetPoolSpan()
+		Companion& GetCompanion(const Node& node)
 		{
-			return all_;
+			static_assert(kHasCompanion);
+			const PoolSegmentHeader& header = Layout::GetHeader(node);
+			assert(header.pool_ == this);
+			uint8* segment = const_cast<uint8*>(reinterpret_cast<const uint8*>(&header));
+			return GetCompanions(segment)[Layout::GetOffset(node)];
 		}
 
-		bool BelonsTo(const Node& node)
+		// Allocated nodes, including free ones
+		std::size_t GetCapacity() const
 		{
-			const Node* ptr = all_.data();
-			return (&node >= ptr) && (std::distance(ptr, &node) < Size);
+			return capacity_.load(std::memory_order_relaxed);
+		}
+
+		// Called after the pool grew, on the acquiring thread (outside of the grow lock). Set it before the pool is used.
+		void SetGrowthCallback(GrowthCallback callback)
+		{
+			on_growth_ = callback;
 		}
 
 #if DO_POOL_STATS
@@ -218,17 +533,183 @@ namespace ts
 		void AssertEmpty()
 		{
 			assert(!used_counter_);
-			assert(thread_free_counter_ + global_free_counter_ == Size);
+			assert(thread_free_counter_ + global_free_counter_ == capacity_);
 		}
-		~Pool()
+#endif
+
+	private:
+#if THREAD_SMART_POOL
+		void FillThreadCache(const uint16 cache_idx, const uint16 threads_num)
+		{
+			ThreadCache& cache = thread_caches_[cache_idx];
+			assert(!cache.free_.GetSize());
+			const uint16 init_size = static_cast<uint16>(InitPoolSizePerThread(InitialSize, threads_num));
+			cache.max_size_ = static_cast<uint16>(MaxPoolSizePerThread(InitialSize, threads_num));
+			for (uint16 counter = 0; counter < init_size; counter++)
+			{
+				Node* node = PopOrGrow();
+				assert(node);
+				cache.free_.Push(*node);
+				POOL_STATS(global_free_counter_--;)
+				POOL_STATS(thread_free_counter_++;)
+			}
+		}
+
+		// Half of the cache, so a thread alternating acquires and returns does not transfer a magazine each time
+		static uint16 GetMagazineSize(const ThreadCache& cache)
+		{
+			return static_cast<uint16>(std::clamp<std::size_t>(cache.max_size_ / 2, 1, kPoolMagazineSize));
+		}
+
+		// The cache is empty. Moves a magazine from the global stack with a single CAS.
+		void Refill(ThreadCache& cache)
+		{
+			if (!cache.max_size_)
+			{
+				return;
+			}
+			Node* tail = nullptr;
+			uint32 num = 0;
+			Node* head = free_.PopChain(GetMagazineSize(cache), tail, num);
+			if (!head)
+			{
+				return; // the caller pops a single node, the pool may grow
+			}
+			cache.free_.PushChain(*head, *tail, static_cast<uint16>(num));
+			cache.stats_.refills++;
+			cache.stats_.refilled_nodes += num;
+			POOL_STATS(global_free_counter_ -= num;)
+			POOL_STATS(thread_free_counter_ += num;)
+		}
+
+		// The cache is full. Moves a magazine to the global stack with a single CAS.
+		void Spill(ThreadCache& cache)
+		{
+			const uint16 num = std::min(GetMagazineSize(cache), cache.free_.GetSize());
+			if (!num)
+			{
+				return;
+			}
+			Node* tail = nullptr;
+			Node& head = cache.free_.PopChain(num, tail);
+			free_.PushChain(head, *tail);
+			NotifyReturnWaiters();
+			cache.stats_.spills++;
+			cache.stats_.spilled_nodes += num;
+			POOL_STATS(thread_free_counter_ -= num;)
+			POOL_STATS(global_free_counter_ += num;)
+		}
+
+		// A thread waits for a return. Moves the whole cache to the global stack, it may hold the last free nodes.
+		void SpillAll(ThreadCache& cache)
 		{
-			AssertEmpty();
+			const uint16 num = cache.free_.GetSize();
+			if (!num)
+			{
+				return;
+			}
+			Node* tail = nullptr;
+			Node& head = cache.free_.PopChain(num, tail);
+			free_.PushChain(head, *tail);
+			NotifyReturnWaiters();
+			cache.stats_.spills++;
+			cache.stats_.spilled_nodes += num;
+			POOL_STATS(thread_free_counter_ -= num;)
+			POOL_STATS(global_free_counter_ += num;)
 		}
 #endif
 
-	private:
+		static Companion* GetCompanions(uint8* segment)
+		{
+			return reinterpret_cast<Companion*>(segment + kCompanionsOffset);
+		}
+
+		Node* PopOrGrow()
+		{
+			Node* node = free_.Pop();
+			while (!node && Grow())
+			{
+				node = free_.Pop();
+			}
+			return node;
+		}
+
+		// Returns false when the pool cannot grow anymore. The new nodes can be taken by other threads, before the caller pops.
+		bool Grow()
+		{
+			{
+				std::lock_guard lock(grow_mutex_);
+				if (!free_.IsEmpty())
+				{
+					return true; // grown by another thread
+				}
+				if (segments_num_ >= kMaxSegments)
+				{
+					return false;
+				}
+				for (std::size_t counter = 0; (counter < kPoolGrowSegments) && (segments_num_ < kMaxSegments); counter++)
+				{
+					AddSegment();
+				}
+			}
+			if (on_growth_)
+			{
+				on_growth_(GetCapacity());
+			}
+			return true;
+		}
+
+		// Under grow_mutex_ (or in the constructor). The segment is published before its nodes are pushed to the free stack.
+		void AddSegment()
+		{
+			assert(segments_num_ < kMaxSegments);
+			const Index segment_idx = static_cast<Index>(segments_num_);
+			uint8* segment = static_cast<uint8*>(::operator new(kPoolSegmentSize, std::align_val_t{ kPoolSegmentSize }));
+			new (segment) PoolSegmentHeader{ .pool_ = this, .first_index_ = segment_idx << kPoolOffsetBits };
+			Node* nodes = Layout::GetNodes(segment);
+			for (std::size_t offset = 0; offset < kNodesPerSegment; offset++)
+			{
+				new (&nodes[offset]) Node{};
+				if constexpr (kHasCompanion)
+				{
+					new (&GetCompanions(segment)[offset]) Companion{};
+				}
+			}
+			for (std::size_t offset = 1; offset < kNodesPerSegment; offset++)
+			{
+				nodes[offset - 1].NextRef() = IndexType{ static_cast<Index>((segment_idx << kPoolOffsetBits) | offset) };
+			}
+			segments_.segments_[segment_idx].store(segment, std::memory_order_release);
+			segments_num_++;
+			capacity_.fetch_add(kNodesPerSegment, std::memory_order_relaxed);
+			POOL_STATS(global_free_counter_ += kNodesPerSegment;)
+			free_.PushChain(nodes[0], nodes[kNodesPerSegment - 1]);
+			NotifyReturnWaiters();
+		}
+
+		// After a push to the global stack. Only pushes there can unblock WaitForReturn, nodes returned to
+		// a thread cache are not available to other threads.
+		void NotifyReturnWaiters()
+		{
+			if (return_waiters_.load(std::memory_order_relaxed)) [[unlikely]]
+			{
+				{
+					// A waiter checks the stack under the lock, the notification cannot fall between its check and wait
+					std::lock_guard lock(return_mutex_);
+				}
+				return_cv_.notify_all();
+			}
+		}
+
 		lock_free::Stack<Node> free_;
-		std::array<Node, Size> all_;
+		PoolSegmentTable segments_;
+		std::size_t segments_num_ = 0; // under grow_mutex_
+		std::atomic<std::size_t> capacity_ = 0;
+		std::mutex grow_mutex_;
+		GrowthCallback on_growth_ = nullptr;
+		std::atomic<uint32> return_waiters_ = 0; // threads parked in WaitForReturn
+		std::mutex return_mutex_;
+		std::condition_variable return_cv_;
 #if DO_POOL_STATS
 		std::atomic_uint32_t used_counter_ = 0;
 		std::atomic_uint32_t global_free_counter_ = 0;
@@ -236,7 +717,7 @@ namespace ts
 		uint32 max_used = 0;
 #endif
 #if THREAD_SMART_POOL
-		std::array<UnsafeStack<Node>, NumThreads> free_per_thread_;
+		std::array<ThreadCache, kMaxWorkerThreadsNum + kMaxExternalThreadsNum> thread_caches_;
 #endif
 	};
 
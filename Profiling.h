@@ -3,6 +3,9 @@
 #include <chrono>
 #include <iostream>
 #include <array>
+#include <vector>
+#include <atomic>
+#include <algorithm>
 #include "Common.h"
 
 namespace ts
@@ -109,5 +112,43 @@ namespace ts
 		};
 	};
 
-}
+	// Thread safe collection of durations. Displays percentiles.
+	class LatencyReporter
+	{
+		const char* name_;
+		std::vector<int64> samples_ns_;
+		std::atomic<uint32> samples_num_ = 0;
+	public:
+		LatencyReporter(const char* in_name, uint32 max_samples)
+			: name_(in_name), samples_ns_(max_samples, 0)
+		{}
+
+		void add(TimeSpan duration)
+		{
+			const uint32 idx = samples_num_.fetch_add(1, std::memory_order_relaxed);
+			if (idx < samples_ns_.size())
+			{
+				samples_ns_[idx] = duration.count();
+			}
+		}
 
+		void display()
+		{
+			const uint32 num = std::min<uint32>(samples_num_.load(), static_cast<uint32>(samples_ns_.size()));
+			if (!num)
+			{
+				return;
+			}
+			std::sort(samples_ns_.begin(), samples_ns_.begin() + num);
+			auto percentile_us = [&](double percentile) -> double
+				{
+					const uint32 idx = std::min(num - 1, static_cast<uint32>(percentile * num));
+					return samples_ns_[idx] / 1000.0;
+				};
+			std::cout << std::endl << name_ << " latency [us] (" << num << " samples) p50: " 
+				<< percentile_us(0.5) << " p90: " << percentile_us(0.9) 
+				<< " p99: " << percentile_us(0.99) << " p99.9: " << percentile_us(0.999)
+				<< " max: " << percentile_us(1.0) << std::endl;
+		}
+	};
+}
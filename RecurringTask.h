@@ -0,0 +1,201 @@
+#pragma once
+
+#include "Task.h"
+#include "TickSync.h"
+
+namespace ts
+{
+	// A task executed repeatedly: periodically, on each TickSync frame, or on Trigger.
+	// The same pooled task and the same functor are reused by all iterations - nothing is allocated per iteration
+	// (except a DependencyNode for each awaited frame).
+	// The gate stays pending, while the task recurs. It unblocks dependents after each iteration and bumps its tag,
+	// so Then(functor, GetTag()) waits for the current iteration only. After Stop, the gate is done.
+	// Iterations never overlap. A periodic task keeps the timer wheel busy, stop it before TaskSystem::WaitForAllTasks.
+	class RecurringTask
+	{
+	public:
+		template<class F>
+		explicit RecurringTask(F&& functor, ETaskFlags flags = ETaskFlags::None)
+		{
+			assert(!enum_has_any(flags, ETaskFlags::TryExecuteImmediate));
+			BaseTask& task = TaskSystem::CreateTaskChain(1, flags);
+			assert(!task.NextInChain());
+			task_ = TRefCountPtr<BaseTask>(&task, false); // CreateTaskChain added the reference
+			TaskPayload& payload = task.Payload();
+			payload.function_ = [function = std::forward<F>(functor)]([[maybe_unused]] BaseTask& task) mutable
+				{
+					std::invoke(function);
+				};
+			payload.cancellation_ = CancellationToken::GetCurrent(); // a cancelled recurring task stops
+			payload.recurring_ = this;
+		}
+
+		RecurringTask(RecurringTask&&) = delete;
+		RecurringTask(const RecurringTask&) = delete;
+		RecurringTask& operator=(RecurringTask&&) = delete;
+		RecurringTask& operator=(const RecurringTask&) = delete;
+
+		// Waits until the last iteration is done. A periodic task waits up to the period, a frame task for the next frame.
+		~RecurringTask()
+		{
+			Stop();
+			while (task_->IsPendingOrExecuting() || (task_->GetRefCount() > 1))
+			{
+				std::this_thread::yield();
+			}
+			task_ = nullptr;
+		}
+
+		// The first iteration is after the period. Missed periods are skipped.
+		void StartPeriodic(TimerClock::duration period)
+		{
+			assert(mode_ == EMode::Manual && !pending_triggers_);
+			assert(period > TimerClock::duration::zero());
+			mode_ = EMode::Periodic;
+			period_ = period;
+			next_deadline_ = TimerClock::now() + period;
+			TaskSystem::ScheduleAt(*task_, next_deadline_);
+		}
+
+		// An iteration after each frame. Frames completed during an iteration are not repeated.
+		void StartOnFrames(TickSync& tick_sync)
+		{
+			assert(mode_ == EMode::Manual && !pending_triggers_);
+			mode_ = EMode::Frame;
+			tick_sync_ = &tick_sync;
+			WaitForFrame();
+		}
+
+		// Manual mode only. Triggers during an iteration are coalesced into a single next iteration.
+		void Trigger()
+		{
+			assert(mode_ == EMode::Manual);
+			assert(!stopping_.load(std::memory_order_relaxed));
+			if (!pending_triggers_.fetch_add(1, std::memory_order_acq_rel))
+			{
+				Submit();
+			}
+		}
+
+		// The functor is not called anymore. The gate is done after the current (or the next scheduled) iteration.
+		void Stop()
+		{
+			if (stopping_.exchange(true, std::memory_order_acq_rel))
+			{
+				return;
+			}
+			if ((mode_ == EMode::Manual) && !pending_triggers_.fetch_add(1, std::memory_order_acq_rel))
+			{
+				Submit(); // the final iteration only completes the gate
+			}
+		}
+
+		bool IsStopping() const
+		{
+			return stopping_.load(std::memory_order_acquire);
+		}
+
+		Gate& GetGate() const
+		{
+			return task_->GetGate();
+		}
+
+		// Tag of the iteration not done yet
+		GateTag GetTag() const
+		{
+			return task_->GetTag();
+		}
+
+		// Executed after the iteration with the tag. When it is already done (or the task was stopped), immediately.
+		template<class F>
+		auto Then(F&& functor, GateTag iteration_tag, ETaskFlags flags = ETaskFlags::None LOCATION_PARAM)
+		{
+			using ResultType = decltype(std::invoke(functor));
+			TRefCountPtr<BaseTask> task = TaskSystem::CreateTask([function = std::forward<F>(functor)]([[maybe_unused]] BaseTask& task) mutable
+				{
+					if constexpr (std::is_void_v<ResultType>)
+					{
+						std::invoke(function);
+					}
+					else
+					{
+						task.result_.Store(std::invoke(function));
+					}
+				}, flags LOCATION_PASS);
+			Gate* pre_req[] = { &task_->GetGate() };
+			uint8 tags[] = { iteration_tag.RawValue() };
+			TaskSystem::HandlePrerequires(*task, pre_req, tags);
+			return task.Cast<GenericFuture>().Cast<Future<ResultType>>();
+		}
+
+	private:
+		friend class BaseTask;
+
+		enum class EMode : uint8
+		{
+			Manual,
+			Periodic,
+			Frame,
+		};
+
+		void Submit()
+		{
+			// The reference is released by the worker after the execution
+			TaskSystem::OnReadyToExecute(TRefCountPtr<BaseTask>(task_.Get()));
+		}
+
+		void WaitForFrame()
+		{
+			uint32 frame_id = 0;
+			frame_ = tick_sync_->GetCurrentFrame(frame_id);
+			Gate* pre_req[] = { &frame_->GetGate() };
+			TaskSystem::HandlePrerequires(*task_, pre_req);
+		}
+
+		// Called by BaseTask::Execute after an iteration, when the task is not stopping.
+		// The gate was already unblocked and its tag bumped.
+		void Rearm()
+		{
+			switch (mode_)
+			{
+			case EMode::Periodic:
+			{
+				const TimerClock::time_point now = TimerClock::now();
+				next_deadline_ += period_;
+				if (next_deadline_ <= now)
+				{
+					next_deadline_ += period_ * ((now - next_deadline_) / period_ + 1);
+				}
+				TaskSystem::ScheduleAt(*task_, next_deadline_);
+				break;
+			}
+			case EMode::Frame:
+				WaitForFrame();
+				break;
+			case EMode::Manual:
+			{
+				uint32 pending = pending_triggers_.load(std::memory_order_acquire);
+				assert(pending);
+				// Triggers received during the iteration run it once more
+				while (!pending_triggers_.compare_exchange_weak(pending, (pending > 1) ? 1 : 0,
+					std::memory_order_acq_rel, std::memory_order_acquire))
+				{}
+				if (pending > 1)
+				{
+					Submit();
+				}
+				break;
+			}
+			}
+		}
+
+		TRefCountPtr<BaseTask> task_;
+		EMode mode_ = EMode::Manual;
+		std::atomic<bool> stopping_ = false;
+		std::atomic<uint32> pending_triggers_ = 0; // manual mode, including the queued or executed iteration
+		TimerClock::duration period_{};
+		TimerClock::time_point next_deadline_{};
+		TickSync* tick_sync_ = nullptr;
+		TRefCountPtr<Future<uint32>> frame_; // awaited frame
+	};
+}
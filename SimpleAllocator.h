@@ -1,155 +1,184 @@
 #pragma once
 
 #include "LockFree.h"
+#include "MemoryRegion.h"
+#include "Pool.h"
+#include <bit>
 #include <cstdlib>
-#include <iostream>
+#include <new>
+#include <utility>
+
 namespace ts
 {
-	struct BlockHeader
+	// Block sizes of coroutine frames: powers of 2 from 64 bytes and their midpoints (64, 96, 128, 192, ... 16K).
+	// The rounding wastes less than a third of a block.
+	struct FrameSizeClasses
 	{
-		constexpr static std::size_t allocation_offset = 2 * alignof(std::max_align_t);
-
-		std::size_t size_ = 0; // including block header
-		BlockHeader* next_ = nullptr;
+		static constexpr std::size_t kMinSize = 64;
+		static constexpr std::size_t kMaxSize = 16 * 1024;
+		static constexpr uint32 kMinBits = std::bit_width(kMinSize) - 1;
+		static constexpr uint8 kClassesNum = static_cast<uint8>(2 * (std::bit_width(kMaxSize) - std::bit_width(kMinSize)) + 1);
+		static constexpr uint8 kExternal = kClassesNum; // bigger than kMaxSize, std::malloc
 
-		BlockHeader() = default;
-		BlockHeader(BlockHeader&&) = delete;
-		BlockHeader(const BlockHeader&) = delete;
-		BlockHeader& operator=(BlockHeader&&) = delete;
-		BlockHeader& operator=(const BlockHeader&) = delete;
-
-		uint8* GetMemory() const
+		static constexpr uint8 GetClass(const std::size_t size)
 		{
-			return const_cast<uint8*>(reinterpret_cast<const uint8*>(this)) + allocation_offset;
-		}
-
-		static BlockHeader* FromMemoryPointer(uint8* ptr)
-		{
-			return reinterpret_cast<BlockHeader*>(ptr - allocation_offset);
-		}
-	};
-
-	static_assert(sizeof(BlockHeader) <= BlockHeader::allocation_offset);
-
-	struct MemoryBlocksCollection
-	{
-		BlockHeader& allocate()
-		{
-			BlockHeader* block = free_.Pop();
-			if (!block)
+			if (size <= kMinSize)
+			{
+				return 0;
+			}
+			if (size > kMaxSize)
 			{
-				void* ptr = std::malloc(block_size_);
-				assert(ptr);
-				block = new (ptr) BlockHeader{};
-				DEBUG_CODE(counter_++;)
+				return kExternal;
 			}
-			return *block;
+			const uint32 bits = static_cast<uint32>(std::bit_width(size - 1)); // 2^(bits-1) < size <= 2^bits
+			const uint8 power_class = static_cast<uint8>(2 * (bits - kMinBits));
+			return (size <= (std::size_t{ 3 } << (bits - 2))) ? (power_class - 1) : power_class;
 		}
 
-		void deallocate(BlockHeader& block)
+		static constexpr std::size_t GetSize(const uint8 size_class)
 		{
-			assert(!block.next_);
-			block.size_ = 0;
-			free_.Push(block);
+			return ((size_class & 1) ? (kMinSize * 3 / 2) : kMinSize) << (size_class / 2);
 		}
 
-		MemoryBlocksCollection(std::size_t in_block_size)
-			: block_size_(in_block_size)
-		{}
-
-		~MemoryBlocksCollection()
+		// Blocks moved at once between a thread cache and the global free list
+		static constexpr uint32 GetBatchSize(const uint8 size_class)
 		{
-			uint32 local_counter = 0;
-			while (BlockHeader* block = free_.Pop())
-			{
-				std::destroy_at(block);
-				std::free(block);
-				local_counter++;
-			}
-			assert(local_counter == counter_);
-			DEBUG_CODE(std::cout << "Simple allocator " << block_size_ << " max usage: " << counter_.load() << std::endl;)
+			return static_cast<uint32>(std::clamp<std::size_t>(kFrameBatchBytes / GetSize(size_class), 1, kFrameBatchSize));
 		}
-
-		void ensure_all_free()
+	};
+	static_assert(FrameSizeClasses::kClassesNum == 17);
+	static_assert((FrameSizeClasses::GetClass(64) == 0) && (FrameSizeClasses::GetClass(65) == 1) && (FrameSizeClasses::GetClass(97) == 2));
+	static_assert(FrameSizeClasses::GetSize(FrameSizeClasses::GetClass(200)) == 256);
+	static_assert(FrameSizeClasses::GetSize(FrameSizeClasses::kClassesNum - 1) == FrameSizeClasses::kMaxSize);
+	static_assert(FrameSizeClasses::GetClass(FrameSizeClasses::kMaxSize + 1) == FrameSizeClasses::kExternal);
+
+	// Counters of the per-thread caches, like PoolCacheStats. Threads without a cache are not counted.
+	struct FrameAllocatorStats
+	{
+		uint64 allocations = 0;
+		uint64 cache_allocations = 0; // served by the thread cache, including the first block after a refill
+		uint64 external_allocations = 0; // bigger than the biggest size class (or the region is full), std::malloc
+		uint64 refills = 0; // batches taken by thread caches from the global free lists (or carved)
+		uint64 spills = 0; // batches pushed by thread caches to the global free lists
+		uint64 requested_bytes = 0; // frame sizes
+		uint64 block_bytes = 0; // sizes of the blocks given to the frames, the difference is the rounding to the size class
+		uint64 committed_bytes = 0; // of the frame region, including free blocks
+
+		void Add(const FrameAllocatorStats& other)
 		{
-			uint32 local_counter = 0;
-			lock_free::PointerBasedStack<BlockHeader> temp;
-			while (BlockHeader* block = free_.Pop())
-			{
-				temp.Push(*block);
-				local_counter++;
-			}
-			assert(local_counter == counter_);
-			while (BlockHeader* block = temp.Pop())
-			{
-				free_.Push(*block);
-			}
+			allocations += other.allocations;
+			cache_allocations += other.cache_allocations;
+			external_allocations += other.external_allocations;
+			refills += other.refills;
+			spills += other.spills;
+			requested_bytes += other.requested_bytes;
+			block_bytes += other.block_bytes;
 		}
+	};
 
-
-		const std::size_t block_size_; //including header
-
-	private:
-		lock_free::PointerBasedStack<BlockHeader> free_;
-
-		DEBUG_CODE(std::atomic<uint32> counter_ = 0;)
-
+	// A free frame block. Frames have no header: the sized operator delete of the promise passes the frame size,
+	// so the size class is known when the frame is freed.
+	struct FrameBlock
+	{
+		FrameBlock* next_ = nullptr; // next batch in the global free list
+		FrameBlock* next_in_batch_ = nullptr; // next block in the batch or in the thread cache
+		uint32 batch_size_ = 0; // of the batch headed by this block
 	};
+	static_assert(sizeof(FrameBlock) <= FrameSizeClasses::kMinSize);
 
+	// Coroutine frames (see TPromise::operator new). Blocks are carved from a MemoryRegion by batches, they are never released.
+	// Each worker (and each registered external thread, see t_pool_cache_idx) keeps a free list per size class and exchanges
+	// whole batches with the global free lists, a single CAS per batch. Other threads take and return single blocks.
+	// allocate and deallocate are inlined into the coroutine, where the frame size is a constant, so the size class
+	// of each coroutine function is resolved at compile time.
 	class SimpleAllocator
 	{
 	public:
-		uint8* allocate(const std::size_t in_size)
+		uint8* allocate(const std::size_t size)
 		{
-			const std::size_t size_with_header = in_size + BlockHeader::allocation_offset;
-			BlockHeader& block = [&]() -> BlockHeader&
-				{
-					for (MemoryBlocksCollection& collection : block_collections)
-					{
-						if (size_with_header <= collection.block_size_)
-						{
-							return collection.allocate();
-						}
-					}
-
-					uint8* external_allocation = reinterpret_cast<uint8*>(std::malloc(size_with_header));
-					assert(external_allocation);
-					BlockHeader* block = new (external_allocation) BlockHeader{};
-					return *block;
-				}();
-			block.size_ = size_with_header;
-			return block.GetMemory();
-		}
-
-		void deallocate(uint8* ptr)
-		{
-			assert(ptr);
-			BlockHeader* block = BlockHeader::FromMemoryPointer(ptr);
-			assert(block);
-			const std::size_t size_with_header = block->size_;
-
-			for (MemoryBlocksCollection& collection : block_collections)
+			const uint8 size_class = FrameSizeClasses::GetClass(size);
+			const uint16 cache_idx = t_pool_cache_idx;
+			if ((size_class != FrameSizeClasses::kExternal) && (cache_idx != kInvalidThreadIndex))
 			{
-				if (size_with_header <= collection.block_size_)
+				ThreadCache& cache = caches_[cache_idx];
+				if (FrameBlock* block = cache.head_[size_class])
 				{
-					return collection.deallocate(*block);
+					cache.head_[size_class] = block->next_in_batch_;
+					cache.size_[size_class]--;
+					cache.stats_.allocations++;
+					cache.stats_.cache_allocations++;
+					cache.stats_.requested_bytes += size;
+					cache.stats_.block_bytes += FrameSizeClasses::GetSize(size_class);
+					return reinterpret_cast<uint8*>(block);
 				}
 			}
-
-			std::destroy_at(block);
-			std::free(ptr);
+			return AllocateSlow(size, size_class, cache_idx);
 		}
 
-		void ensure_all_free()
+		void deallocate(uint8* ptr, const std::size_t size)
 		{
-			for (auto& collecion : block_collections)
+			assert(ptr);
+			const uint8 size_class = FrameSizeClasses::GetClass(size);
+			if ((size_class == FrameSizeClasses::kExternal) || !region_.Contains(ptr))
 			{
-				collecion.ensure_all_free();
+				std::free(ptr);
+				return;
+			}
+			FrameBlock* block = new (ptr) FrameBlock{};
+			const uint16 cache_idx = t_pool_cache_idx;
+			if (cache_idx == kInvalidThreadIndex)
+			{
+				block->batch_size_ = 1;
+				free_[size_class].Push(*block);
+				return;
+			}
+			ThreadCache& cache = caches_[cache_idx];
+			block->next_in_batch_ = cache.head_[size_class];
+			cache.head_[size_class] = block;
+			if (++cache.size_[size_class] >= 2 * FrameSizeClasses::GetBatchSize(size_class))
+			{
+				Spill(cache, size_class);
 			}
 		}
 
+		// Moves the cached blocks to the global free lists. Called by the thread, before its cache index is reused.
+		void FlushThreadCache(uint16 cache_idx);
+
+		// Asserts that every carved block is in a free list. Only when no frame exists.
+		void ensure_all_free();
+
+		FrameAllocatorStats GetStats(bool reset = false);
+
 	private:
-		std::array<MemoryBlocksCollection, 3> block_collections = { 1024ull, 4 * 1024ull, 16 * 1024ull };
-	};
+		struct alignas(kCacheLineSize) ThreadCache
+		{
+			std::array<FrameBlock*, FrameSizeClasses::kClassesNum> head_ = {};
+			std::array<uint32, FrameSizeClasses::kClassesNum> size_ = {};
+			FrameAllocatorStats stats_;
+		};
+
+		uint8* AllocateSlow(std::size_t size, uint8 size_class, uint16 cache_idx);
+		// The cache is empty. Returns false, when the region is full.
+		bool Refill(ThreadCache& cache, uint8 size_class);
+		void Spill(ThreadCache& cache, uint8 size_class);
+		// Returns the head of a new batch, nullptr when the region is full
+		FrameBlock* CarveBatch(uint8 size_class);
+
+		using FreeLists = std::array<lock_free::PointerBasedStack<FrameBlock>, FrameSizeClasses::kClassesNum>; // of batches
+		using ClassCounters = std::array<std::atomic<uint32>, FrameSizeClasses::kClassesNum>;
+
+		template<std::size_t... Idx>
+		static FreeLists MakeFreeLists(const void* region_base, std::index_sequence<Idx...>)
+		{
+			return FreeLists{
+				((void)Idx, lock_free::PointerBasedStack<FrameBlock>{ region_base })... };
+		}
 
-}
\ No newline at end of file
+		static_assert(kCoroutineRegionSize / alignof(FrameBlock) < lock_free::PointerBasedStack<FrameBlock>::kNullOffset,
+			"Offsets of frame blocks do not fit 32 bits");
+		MemoryRegion region_{ kCoroutineRegionSize };
+		FreeLists free_ = MakeFreeLists(region_.GetBase(), std::make_index_sequence<FrameSizeClasses::kClassesNum>{});
+		std::array<ThreadCache, kMaxWorkerThreadsNum + kMaxExternalThreadsNum> caches_; // indexed by t_pool_cache_idx
+		DEBUG_CODE(ClassCounters carved_blocks_ = {};)
+	};
+}
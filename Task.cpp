@@ -1,54 +1,892 @@
 #include "Task.h"
+#include "Coroutine.h"
 #include <iostream>
+#include <fstream>
+#include <string>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+#include <cstdlib>
+#include <bit>
 #include "CoroutineHandle.h"
+#include "Topology.h"
+#include "MemoryRegion.h"
+#include "RecurringTask.h"
 
 namespace ts
 {
+	thread_local uint16 t_worker_thread_idx = kInvalidThreadIndex;
+	thread_local uint16 t_pool_cache_idx = kInvalidThreadIndex;
+
+	// Idle workers sleep on wake_tokens_ (std::atomic::wait). Each token lets one parked worker go.
+	struct WorkerParking
+	{
+		// has_work is checked after the worker is counted as parked, so either the worker sees the new task,
+		// or the submitter sees the parked worker.
+		template<typename F>
+		void Park(F has_work)
+		{
+			parked_.fetch_add(1, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			if (!has_work())
+			{
+				park_events_.fetch_add(1, std::memory_order_relaxed);
+				uint32 tokens = wake_tokens_.load(std::memory_order_acquire);
+				while (true)
+				{
+					if (!tokens)
+					{
+						wake_tokens_.wait(0, std::memory_order_acquire);
+						tokens = wake_tokens_.load(std::memory_order_acquire);
+					}
+					else if (wake_tokens_.compare_exchange_weak(tokens, tokens - 1,
+						std::memory_order_acquire,
+						std::memory_order_relaxed))
+					{
+						break;
+					}
+				}
+			}
+			parked_.fetch_sub(1, std::memory_order_relaxed);
+		}
+
+		// Park with a timeout, used by the worker servicing the timer wheel. One worker at a time.
+		template<typename F>
+		void ParkUntil(F has_work, TimerClock::time_point deadline)
+		{
+			parked_.fetch_add(1, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			if (!has_work())
+			{
+				park_events_.fetch_add(1, std::memory_order_relaxed);
+				std::unique_lock lock(keeper_mutex_);
+				keeper_waiting_.store(true, std::memory_order_seq_cst);
+				keeper_cv_.wait_until(lock, deadline, [this]() -> bool
+					{
+						uint32 tokens = wake_tokens_.load(std::memory_order_seq_cst);
+						while (tokens)
+						{
+							if (wake_tokens_.compare_exchange_weak(tokens, tokens - 1,
+								std::memory_order_acquire,
+								std::memory_order_relaxed))
+							{
+								return true;
+							}
+						}
+						return false;
+					});
+				keeper_waiting_.store(false, std::memory_order_relaxed);
+			}
+			parked_.fetch_sub(1, std::memory_order_relaxed);
+		}
+
+		// Wakes at most num parked workers. Called after the work was published.
+		void Wake(uint32 num)
+		{
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			const uint32 parked = parked_.load(std::memory_order_relaxed);
+			if (!parked) [[likely]]
+			{
+				return;
+			}
+			uint32 tokens = wake_tokens_.load(std::memory_order_relaxed);
+			uint32 to_wake = 0;
+			do
+			{
+				if (tokens >= parked)
+				{
+					return; // enough workers are already waking up
+				}
+				to_wake = std::min(num, parked - tokens);
+			} while (!wake_tokens_.compare_exchange_weak(tokens, tokens + to_wake,
+				std::memory_order_release,
+				std::memory_order_relaxed));
+
+			wake_events_.fetch_add(to_wake, std::memory_order_relaxed);
+			for (uint32 idx = 0; idx < to_wake; idx++)
+			{
+				wake_tokens_.notify_one();
+			}
+			NotifyKeeper();
+		}
+
+		void WakeAll(uint16 num_threads)
+		{
+			const uint32 parked = parked_.load(std::memory_order_relaxed);
+			wake_events_.fetch_add(parked, std::memory_order_relaxed);
+			wake_tokens_.fetch_add(num_threads, std::memory_order_release);
+			wake_tokens_.notify_all();
+			NotifyKeeper();
+		}
+
+		void NotifyKeeper()
+		{
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			if (keeper_waiting_.load(std::memory_order_seq_cst))
+			{
+				std::lock_guard lock(keeper_mutex_);
+				keeper_cv_.notify_one();
+			}
+		}
+
+		void Reset()
+		{
+			assert(!parked_.load());
+			wake_tokens_.store(0, std::memory_order_relaxed);
+		}
+
+		std::atomic<uint32> wake_tokens_ = 0;
+		std::atomic<uint32> parked_ = 0;
+		std::atomic<uint64> park_events_ = 0;
+		std::atomic<uint64> wake_events_ = 0;
+
+		std::mutex keeper_mutex_;
+		std::condition_variable keeper_cv_;
+		std::atomic<bool> keeper_waiting_ = false;
+	};
+
+	// Hashed timer wheel. Delayed tasks are linked (by NextRef) in the bucket of their tick, insertion is a single push.
+	// A bucket is taken whole (PopAll) when its tick passes. Tasks due in later turns of the wheel are pushed back,
+	// unless they were cancelled meanwhile. Ticks are 64-bit, they do not wrap.
+	struct TimerWheel
+	{
+		static constexpr TimerClock::duration kTick = std::chrono::microseconds(kTimerTickMicroseconds);
+		static_assert((kTimerWheelSize & (kTimerWheelSize - 1)) == 0, "kTimerWheelSize must be a power of 2");
+		static_assert(std::atomic<uint64>::is_always_lock_free);
+
+		// Rounded up, so a task never runs early. Deadlines after kMaxTimerDelay are clamped.
+		uint64 ToTick(TimerClock::time_point time) const
+		{
+			if (time <= epoch_)
+			{
+				return 0;
+			}
+			const TimerClock::duration since_epoch = (time - epoch_ < kMaxTimerDelay) ? (time - epoch_) : kMaxTimerDelay;
+			return static_cast<uint64>(since_epoch / kTick) + ((since_epoch % kTick).count() ? 1 : 0);
+		}
+
+		uint64 CurrentTick() const
+		{
+			return static_cast<uint64>((TimerClock::now() - epoch_) / kTick);
+		}
+
+		TimerClock::time_point NextTickTime() const
+		{
+			return epoch_ + kTick * static_cast<TimerClock::rep>(processed_tick_.load(std::memory_order_relaxed) + 1);
+		}
+
+		bool HasPending() const
+		{
+			return pending_.load(std::memory_order_relaxed) > 0;
+		}
+
+		// Returns false, when the tick already passed. The caller should push the task as ready.
+		// on_expired is called (under the lock) for tasks from a bucket, that was processed concurrently.
+		template<typename F>
+		bool Insert(BaseTask& task, const uint64 tick, F on_expired)
+		{
+			if (tick <= processed_tick_.load(std::memory_order_acquire))
+			{
+				return false;
+			}
+			task.Payload().timer_tick_ = tick;
+			pending_.fetch_add(1, std::memory_order_relaxed);
+			const uint32 bucket = static_cast<uint32>(tick & (kTimerWheelSize - 1));
+			buckets_[bucket].Push(task);
+
+			// Advance publishes processed_tick_ before it takes the buckets. If the bucket was taken before the push, 
+			// the task would wait a whole turn.
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			if (tick <= processed_tick_.load(std::memory_order_relaxed))
+			{
+				Lock();
+				ProcessBucket(bucket, processed_tick_.load(std::memory_order_relaxed), on_expired);
+				Unlock();
+			}
+			return true;
+		}
+
+		// Processes all buckets up to the current tick. Returns the number of expired tasks. 
+		// Only one thread advances at a time, others return immediately.
+		template<typename F>
+		uint32 Advance(F on_expired)
+		{
+			if (!HasPending())
+			{
+				return 0;
+			}
+			const uint64 now_tick = CurrentTick();
+			if ((now_tick <= processed_tick_.load(std::memory_order_relaxed)) || !TryLock())
+			{
+				return 0;
+			}
+			const uint64 processed = processed_tick_.load(std::memory_order_relaxed);
+			uint32 expired = 0;
+			if (now_tick > processed)
+			{
+				processed_tick_.store(now_tick, std::memory_order_seq_cst);
+				const uint64 steps = std::min<uint64>(now_tick - processed, kTimerWheelSize);
+				for (uint64 step = 1; step <= steps; step++)
+				{
+					expired += ProcessBucket(static_cast<uint32>((processed + step) & (kTimerWheelSize - 1)), now_tick, on_expired);
+				}
+			}
+			Unlock();
+			return expired;
+		}
+
+	private:
+		template<typename F>
+		uint32 ProcessBucket(const uint32 bucket, const uint64 up_to_tick, F& on_expired)
+		{
+			uint32 expired = 0;
+			BaseTask::IndexType iter = buckets_[bucket].PopAll();
+			while (iter.IsValid())
+			{
+				BaseTask& task = FromPoolIndex<BaseTask>(iter);
+				iter = task.NextRef();
+				task.NextRef().Reset();
+				// A cancelled task is not executed, it just completes its gate (see BaseTask::Execute)
+				if ((task.Payload().timer_tick_ <= up_to_tick) || task.Payload().cancellation_.IsCancellationRequested())
+				{
+					expired++;
+					on_expired(task);
+				}
+				else
+				{
+					buckets_[bucket].Push(task); // a later turn of the wheel
+				}
+			}
+			pending_.fetch_sub(expired, std::memory_order_relaxed);
+			return expired;
+		}
+
+		bool TryLock()
+		{
+			return !advancing_.exchange(true, std::memory_order_acquire);
+		}
+
+		void Lock()
+		{
+			while (!TryLock())
+			{
+				CpuPause();
+			}
+		}
+
+		void Unlock()
+		{
+			advancing_.store(false, std::memory_order_release);
+		}
+
+		const TimerClock::time_point epoch_ = TimerClock::now();
+		std::atomic<uint64> processed_tick_ = 0;
+		std::atomic<uint32> pending_ = 0;
+		std::atomic<bool> advancing_ = false;
+		std::array<lock_free::Stack<BaseTask>, kTimerWheelSize> buckets_;
+	};
+
+	// Blocks for task functors spilled from the inline storage (see InplaceFunction). Each thread keeps its own free lists,
+	// a block freed by another thread joins the freeing thread's list. Lists exchange batches with the shared stacks,
+	// that hold linked batches - a single CAS per batch. An empty shared stack is refilled by carving a new slab
+	// from the region. The region is released at exit.
+	struct FunctorSlab
+	{
+		struct Block
+		{
+			Block* next_ = nullptr; // next batch in a shared stack
+			union
+			{
+				Block* next_in_batch_ = nullptr; // a free block: next in its batch, or in the thread's list
+				uint8 size_class_; // an allocated block
+			};
+		};
+		static constexpr std::size_t kHeaderSize = alignof(std::max_align_t);
+		static_assert(sizeof(Block) <= kHeaderSize);
+		static constexpr uint8 kSizeClassesNum = 3;
+		static constexpr uint8 kExternalSizeClass = kSizeClassesNum; // bigger than the biggest block, std::malloc
+
+		static constexpr std::size_t BlockSize(uint8 size_class) // including the header
+		{
+			return std::size_t{ 128 } << size_class;
+		}
+
+		struct LocalCache
+		{
+			std::array<Block*, kSizeClassesNum> head_ = {};
+			std::array<uint32, kSizeClassesNum> size_ = {};
+
+			~LocalCache();
+		};
+
+		void* Allocate(std::size_t size)
+		{
+			const std::size_t size_with_header = size + kHeaderSize;
+			uint8 size_class = 0;
+			while ((size_class < kSizeClassesNum) && (BlockSize(size_class) < size_with_header))
+			{
+				size_class++;
+			}
+			Block* block = nullptr;
+			if (size_class != kExternalSizeClass)
+			{
+				LocalCache& cache = t_cache_;
+				if (cache.head_[size_class] || Refill(cache, size_class))
+				{
+					block = cache.head_[size_class];
+					cache.head_[size_class] = block->next_in_batch_;
+					cache.size_[size_class]--;
+					block->next_ = nullptr;
+				}
+				else
+				{
+					size_class = kExternalSizeClass; // the region is full
+				}
+			}
+			if (size_class == kExternalSizeClass)
+			{
+				block = new (std::malloc(size_with_header)) Block{};
+				assert(block);
+			}
+			block->size_class_ = size_class;
+			return reinterpret_cast<uint8*>(block) + kHeaderSize;
+		}
+
+		void Free(void* ptr)
+		{
+			assert(ptr);
+			Block* block = reinterpret_cast<Block*>(reinterpret_cast<uint8*>(ptr) - kHeaderSize);
+			const uint8 size_class = block->size_class_;
+			if (size_class == kExternalSizeClass)
+			{
+				std::free(block);
+				return;
+			}
+			assert(size_class < kSizeClassesNum);
+			LocalCache& cache = t_cache_;
+			block->next_in_batch_ = cache.head_[size_class];
+			cache.head_[size_class] = block;
+			if (++cache.size_[size_class] >= 2 * kFunctorSlabBatch)
+			{
+				Block* batch = cache.head_[size_class];
+				Block* tail = batch;
+				for (uint32 idx = 1; idx < kFunctorSlabBatch; idx++)
+				{
+					tail = tail->next_in_batch_;
+				}
+				cache.head_[size_class] = tail->next_in_batch_;
+				cache.size_[size_class] -= kFunctorSlabBatch;
+				tail->next_in_batch_ = nullptr;
+				shared_[size_class].Push(*batch);
+			}
+		}
+
+	private:
+		// Returns false, when the region is full
+		bool Refill(LocalCache& cache, uint8 size_class)
+		{
+			static_assert(BlockSize(0) > kTaskFunctorInlineSize + kHeaderSize);
+			static_assert(kFunctorSlabSize >= BlockSize(kSizeClassesNum - 1) * (kFunctorSlabBatch + 1));
+			assert(!cache.head_[size_class] && !cache.size_[size_class]);
+			if (Block* batch = shared_[size_class].Pop())
+			{
+				cache.head_[size_class] = batch;
+				for (Block* block = batch; block; block = block->next_in_batch_)
+				{
+					cache.size_[size_class]++;
+				}
+				return true;
+			}
+
+			uint8* slab = region_.Carve(kFunctorSlabSize);
+			if (!slab)
+			{
+				return false;
+			}
+			const std::size_t block_size = BlockSize(size_class);
+			for (std::size_t offset = 0; offset + block_size <= kFunctorSlabSize; offset += block_size)
+			{
+				Block* block = new (slab + offset) Block{};
+				block->next_in_batch_ = cache.head_[size_class];
+				cache.head_[size_class] = block;
+				cache.size_[size_class]++;
+			}
+			return true;
+		}
+
+		static_assert(kFunctorRegionSize / alignof(Block) < lock_free::PointerBasedStack<Block>::kNullOffset);
+		static_assert(kSizeClassesNum == 3);
+		MemoryRegion region_{ kFunctorRegionSize };
+		std::array<lock_free::PointerBasedStack<Block>, kSizeClassesNum> shared_ = {
+			lock_free::PointerBasedStack<Block>{ region_.GetBase() },
+			lock_free::PointerBasedStack<Block>{ region_.GetBase() },
+			lock_free::PointerBasedStack<Block>{ region_.GetBase() } };
+		thread_local static LocalCache t_cache_;
+	};
+
+	static FunctorSlab functor_slab;
+	thread_local FunctorSlab::LocalCache FunctorSlab::t_cache_;
+
+	// An exiting thread returns its blocks
+	FunctorSlab::LocalCache::~LocalCache()
+	{
+		for (uint8 size_class = 0; size_class < kSizeClassesNum; size_class++)
+		{
+			if (Block* block = head_[size_class]) // the whole list as a single batch
+			{
+				functor_slab.shared_[size_class].Push(*block);
+				head_[size_class] = nullptr;
+			}
+			size_[size_class] = 0;
+		}
+	}
+
+	void* detail::AllocateSpilledFunctor(std::size_t size)
+	{
+		return functor_slab.Allocate(size);
+	}
+
+	void detail::FreeSpilledFunctor(void* ptr)
+	{
+		functor_slab.Free(ptr);
+	}
+
+	// Tasks unblocked together (Gate::Unblock). Tasks for the same ready stack are linked by NextRef, 
+	// so each stack gets a single PushChain.
+	struct ReadyTaskChains
+	{
+		struct Chain
+		{
+			BaseTask* head = nullptr;
+			BaseTask* tail = nullptr;
+		};
+		std::array<Chain, 6> chains_; // TaskSystemGlobals::ReadyStackIndex
+		uint32 wake_num_ = 0;
+
+		void Add(uint32 stack_index, BaseTask& task)
+		{
+			Chain& chain = chains_[stack_index];
+			task.NextRef() = chain.head ? GetPoolIndex(*chain.head) : BaseTask::IndexType{};
+			chain.head = &task;
+			chain.tail = chain.tail ? chain.tail : &task;
+		}
+	};
+
+	struct alignas(kCacheLineSize) WorkerInfo
+	{
+		CpuInfo cpu;
+		std::vector<uint16> steal_order; // the same numa node first, then the closest nodes
+		uint16 local_victims_num = 0; // steal_order prefix on the same numa node
+		std::atomic<uint64> local_steals = 0; // written only by the owner
+		std::atomic<uint64> remote_steals = 0;
+	};
+
 	struct TaskSystemGlobals
 	{
-		Pool<BaseTask, kTaskPoolSize
-#if THREAD_SMART_POOL
-			, kWorkeThreadsNum, InitPoolSizePerThread(kTaskPoolSize), MaxPoolSizePerThread(kTaskPoolSize)
-#endif
-		> task_pool_;
-		Pool<DependencyNode, kDepNodePoolSize
-#if THREAD_SMART_POOL
-			, kWorkeThreadsNum, InitPoolSizePerThread(kDepNodePoolSize), MaxPoolSizePerThread(kDepNodePoolSize)
-#endif
-		> dependency_pool_;
-		Pool<BaseFuture, kFuturePoolSize
-#if THREAD_SMART_POOL
-			, kWorkeThreadsNum, InitPoolSizePerThread(kFuturePoolSize), MaxPoolSizePerThread(kFuturePoolSize)
-#endif
-		> future_pool_;
-		lock_free::Stack<BaseTask> ready_to_execute_;
+		Pool<BaseTask, kTaskPoolSize, kTaskPoolMaxSize, TaskPayload> task_pool_; // the payloads are the cold part of the tasks
+		Pool<DependencyNode, kDepNodePoolSize, kDepNodePoolMaxSize> dependency_pool_;
+		Pool<BaseFuture, kFuturePoolSize, kFuturePoolMaxSize> future_pool_;
+		lock_free::Stack<BaseTask> ready_to_execute_; // injection queue - tasks pushed from non-worker threads
 		std::array<lock_free::Stack<BaseTask>, 5>  ready_to_execute_named;
+		std::unique_ptr<lock_free::WorkStealingDeque<BaseTask, kWorkerDequeSize>[]> ready_per_thread_; // threads_num_ deques
+		std::unique_ptr<WorkerInfo[]> workers_; // threads_num_
+		lock_free::BoundedQueue<BaseTask, kTaskPoolMaxSize> ready_fifo_;
+		lock_free::BoundedQueue<BaseTask, kTaskPoolMaxSize> ready_critical_;
+		lock_free::BoundedQueue<BaseTask, kTaskPoolMaxSize> ready_background_;
+
+		std::vector<std::thread> threads_;
+		uint16 threads_num_ = 0;
+		SchedulerSettings settings_;
+		std::atomic<bool> working_ = false;
+		std::atomic<uint16> used_threads_ = 0;
+		WorkerParking parking_;
+		TimerWheel timers_;
+		std::atomic<bool> timer_keeper_ = false; // a worker parked with a timeout, to service the timers
+		std::atomic<uint64> exhausted_acquires_ = 0;
+		std::atomic<uint64> inline_executions_ = 0;
+		std::atomic<uint32> external_threads_ = 0; // bit per pool cache slot, see RegisterExternalThread
+		static_assert(kMaxExternalThreadsNum <= 32);
+
+		// 0 - the global ready stack, 1..5 - named threads
+		static uint32 ReadyStackIndex(ETaskFlags flag)
+		{
+			uint32 counter = 1;
+			for (ETaskFlags thread_name : { ETaskFlags::NamedThread1, ETaskFlags::NamedThread2, ETaskFlags::NamedThread3, ETaskFlags::NamedThread4, ETaskFlags::NamedThread5})
+			{
+				if (enum_has_any(flag, thread_name))
+				{
+					return counter;
+				}
+				counter++;
+			}
+			return 0;
+		}
+
+		lock_free::Stack<BaseTask>& ReadyStackByIndex(uint32 index)
+		{
+			return index ? ready_to_execute_named[index - 1] : ready_to_execute_;
+		}
+
+		lock_free::Stack<BaseTask>& ReadyStack(ETaskFlags flag)
+		{
+			return ReadyStackByIndex(ReadyStackIndex(flag));
+		}
+
+		void PushReady(BaseTask& task)
+		{
+			if (RouteReady(task, nullptr))
+			{
+				parking_.Wake(1);
+			}
+		}
+
+		// With out_chains, tasks going to a ready stack are only linked into the chain, see PushReadyChains.
+		// Returns if a worker should be woken.
+		bool RouteReady(BaseTask& task, ReadyTaskChains* out_chains)
+		{
+			const ETaskFlags flags = task.GetFlags();
+			if (enum_has_any(flags, ETaskFlags::NameThreadMask))
+			{
+				if (out_chains)
+				{
+					out_chains->Add(ReadyStackIndex(flags), task);
+				}
+				else
+				{
+					ReadyStack(flags).Push(task);
+				}
+				return false;
+			}
+
+			const ETaskPriority priority = GetPriority(flags);
+			if (priority != ETaskPriority::Normal)
+			{
+				[[maybe_unused]] const bool enqueued = (priority == ETaskPriority::Critical)
+					? ready_critical_.Enqueue(task)
+					: ready_background_.Enqueue(task);
+				assert(enqueued); // The queue is as big as the max task pool
+			}
+			else if ((settings_.policy == ESchedulingPolicy::Fifo) || enum_has_any(flags, ETaskFlags::Fifo))
+			{
+				[[maybe_unused]] const bool enqueued = ready_fifo_.Enqueue(task);
+				assert(enqueued); // The queue is as big as the max task pool
+			}
+			else
+			{
+				const bool use_local_deque = settings_.work_stealing && (t_worker_thread_idx != kInvalidThreadIndex);
+				if (!use_local_deque || !ready_per_thread_[t_worker_thread_idx].Push(task))
+				{
+					if (out_chains)
+					{
+						out_chains->Add(0, task);
+					}
+					else
+					{
+						ready_to_execute_.Push(task);
+					}
+				}
+			}
+			return true;
+		}
+
+		void PushReadyChains(ReadyTaskChains& chains)
+		{
+			for (uint32 index = 0; index < chains.chains_.size(); index++)
+			{
+				ReadyTaskChains::Chain& chain = chains.chains_[index];
+				if (chain.head)
+				{
+					ReadyStackByIndex(index).PushChain(*chain.head, *chain.tail);
+					chain = {};
+				}
+			}
+			parking_.Wake(chains.wake_num_);
+			chains.wake_num_ = 0;
+		}
+
+		// All tasks in the chain have the same flags
+		void PushReadyChain(BaseTask& head, const uint16 num)
+		{
+			const ETaskFlags flags = head.GetFlags();
+			const bool single_push = (GetPriority(flags) == ETaskPriority::Normal)
+				&& (settings_.policy != ESchedulingPolicy::Fifo) && !enum_has_any(flags, ETaskFlags::Fifo);
+			if (!single_push)
+			{
+				BaseTask* task = &head;
+				while (task)
+				{
+					BaseTask* next = task->NextInChain();
+					task->NextRef().Reset();
+					PushReady(*task);
+					task = next;
+				}
+				return;
+			}
+
+			BaseTask* tail = &head;
+			while (BaseTask* next = tail->NextInChain())
+			{
+				tail = next;
+			}
+			// The global stack, even on a worker thread. Idle workers steal from it, the chain is not split between deques.
+			ReadyStack(flags).PushChain(head, *tail);
+			if (!enum_has_any(flags, ETaskFlags::NameThreadMask))
+			{
+				parking_.Wake(num);
+			}
+		}
+
+		// Is the queue, where PushReady would put a task with the flags, empty
+		bool IsReadyQueueEmpty(const ETaskFlags flags)
+		{
+			const ETaskPriority priority = GetPriority(flags);
+			if (priority != ETaskPriority::Normal)
+			{
+				return (priority == ETaskPriority::Critical) ? ready_critical_.IsEmpty() : ready_background_.IsEmpty();
+			}
+			if ((settings_.policy == ESchedulingPolicy::Fifo) || enum_has_any(flags, ETaskFlags::Fifo))
+			{
+				return ready_fifo_.IsEmpty();
+			}
+			const bool use_local_deque = settings_.work_stealing && (t_worker_thread_idx != kInvalidThreadIndex);
+			return use_local_deque 
+				? ready_per_thread_[t_worker_thread_idx].IsEmpty() 
+				: ReadyStack(flags).IsEmpty();
+		}
+
+		BaseTask* PopReady(const uint16 thread_idx)
+		{
+			if (BaseTask* task = ready_critical_.Dequeue())
+			{
+				return task;
+			}
+			if (BaseTask* task = PopNormalPriority(thread_idx))
+			{
+				return task;
+			}
+			return ready_background_.Dequeue();
+		}
+
+		// For a thread that is not a worker, see GenericFuture::Wait. No own deque, so the other deques are only stolen from.
+		BaseTask* PopReadyExternal()
+		{
+			if (BaseTask* task = ready_critical_.Dequeue())
+			{
+				return task;
+			}
+			if (BaseTask* task = ready_fifo_.Dequeue())
+			{
+				return task;
+			}
+			if (BaseTask* task = ready_to_execute_.Pop())
+			{
+				return task;
+			}
+			for (uint16 victim = 0; settings_.work_stealing && (victim < threads_num_); victim++)
+			{
+				if (BaseTask* task = ready_per_thread_[victim].Steal())
+				{
+					return task;
+				}
+			}
+			return ready_background_.Dequeue();
+		}
+
+		BaseTask* PopNormalPriority(const uint16 thread_idx)
+		{
+			thread_local uint32 pops_since_aging = 0;
+			if (settings_.aging_interval && (++pops_since_aging >= settings_.aging_interval))
+			{
+				pops_since_aging = 0;
+				if (BaseTask* task = PopOldest(thread_idx))
+				{
+					return task;
+				}
+			}
+
+			if (settings_.work_stealing)
+			{
+				if (BaseTask* task = ready_per_thread_[thread_idx].Pop())
+				{
+					return task;
+				}
+			}
+			if (BaseTask* task = ready_fifo_.Dequeue())
+			{
+				return task;
+			}
+			if (BaseTask* task = ready_to_execute_.Pop())
+			{
+				return task;
+			}
+			return settings_.work_stealing ? Steal(thread_idx) : nullptr;
+		}
+
+		BaseTask* PopOldest(const uint16 thread_idx)
+		{
+			FlushReadyStackToFifo();
+			if (BaseTask* task = ready_fifo_.Dequeue())
+			{
+				return task;
+			}
+			return settings_.work_stealing 
+				? ready_per_thread_[thread_idx].Steal() // the oldest task in own deque
+				: nullptr;
+		}
+
+		// Moves the global stack into the FIFO queue, the oldest task first.
+		void FlushReadyStackToFifo()
+		{
+			BaseTask::IndexType newest = ready_to_execute_.PopAll();
+			if (!newest.IsValid())
+			{
+				return;
+			}
+
+			BaseTask::IndexType oldest;
+			while (newest.IsValid())
+			{
+				BaseTask& task = FromPoolIndex<BaseTask>(newest);
+				newest = task.NextRef();
+				task.NextRef() = oldest;
+				oldest = GetPoolIndex(task);
+			}
+
+			while (oldest.IsValid())
+			{
+				BaseTask& task = FromPoolIndex<BaseTask>(oldest);
+				oldest = task.NextRef();
+				task.NextRef().Reset();
+				[[maybe_unused]] const bool enqueued = ready_fifo_.Enqueue(task);
+				assert(enqueued);
+			}
+		}
+
+		BaseTask* Steal(const uint16 thief_idx)
+		{
+			// xorshift, random first victim, so thieves do not gang up on the same deque
+			thread_local uint32 seed = 2654435761u * (thief_idx + 1u);
+			seed ^= seed << 13;
+			seed ^= seed >> 17;
+			seed ^= seed << 5;
+			WorkerInfo& thief = workers_[thief_idx];
+			const std::vector<uint16>& victims = thief.steal_order;
+			const uint16 victims_num = static_cast<uint16>(victims.size());
+			if (!victims_num)
+			{
+				return nullptr;
+			}
+			// The random rotation is limited to the local node, remote nodes are tried from the closest one.
+			const uint16 rotated_num = settings_.numa_aware_stealing ? thief.local_victims_num : victims_num;
+			const uint16 first_victim = rotated_num ? static_cast<uint16>(seed % rotated_num) : 0;
+			for (uint16 offset = 0; offset < victims_num; offset++)
+			{
+				const uint16 victim = (offset < rotated_num)
+					? victims[(first_victim + offset) % rotated_num]
+					: victims[offset];
+				if (BaseTask* task = ready_per_thread_[victim].Steal())
+				{
+					std::atomic<uint64>& counter = (workers_[victim].cpu.numa_node == thief.cpu.numa_node)
+						? thief.local_steals
+						: thief.remote_steals;
+					counter.store(counter.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+					return task;
+				}
+			}
+			return nullptr;
+		}
+
+		void InitializeWorkers(const uint16 num_threads)
+		{
+			const CpuTopology& topology = CpuTopology::Get();
+			const std::vector<CpuInfo> cpus = topology.SelectWorkerCpus(num_threads);
+			workers_ = std::make_unique<WorkerInfo[]>(num_threads);
+			for (uint16 idx = 0; idx < num_threads; idx++)
+			{
+				workers_[idx].cpu = cpus[idx];
+			}
+			for (uint16 thief = 0; thief < num_threads; thief++)
+			{
+				WorkerInfo& info = workers_[thief];
+				const uint16 node = info.cpu.numa_node;
+				for (uint16 victim = 0; victim < num_threads; victim++)
+				{
+					if (victim != thief)
+					{
+						info.steal_order.push_back(victim);
+					}
+				}
+				std::stable_sort(info.steal_order.begin(), info.steal_order.end(), [&](uint16 a, uint16 b)
+					{
+						return topology.GetNumaDistance(node, workers_[a].cpu.numa_node)
+							< topology.GetNumaDistance(node, workers_[b].cpu.numa_node);
+					});
+				info.local_victims_num = static_cast<uint16>(std::count_if(info.steal_order.begin(), info.steal_order.end(),
+					[&](uint16 victim) { return workers_[victim].cpu.numa_node == node; }));
+			}
+		}
 
-		std::array<std::thread, kWorkeThreadsNum> threads_;
-		bool working_ = false;
-		std::atomic<uint8> used_threads_ = 0;
+		// Expired timers go to the ready queues, a bucket with a single push. Returns the number of expired tasks.
+		uint32 PollTimers()
+		{
+			ReadyTaskChains chains;
+			const uint32 expired = timers_.Advance([&](BaseTask& task)
+				{
+					if (RouteReady(task, &chains))
+					{
+						chains.wake_num_++;
+					}
+				});
+			PushReadyChains(chains);
+			return expired;
+		}
 
-		lock_free::Stack<BaseTask>& ReadyStack(ETaskFlags flag)
+		bool HasQueuedTasks() const
 		{
-			int32 counter = 0;
-			for (ETaskFlags thread_name : { ETaskFlags::NamedThread1, ETaskFlags::NamedThread2, ETaskFlags::NamedThread3, ETaskFlags::NamedThread4, ETaskFlags::NamedThread5})
+			if (!ready_to_execute_.IsEmpty() || !ready_fifo_.IsEmpty() 
+				|| !ready_critical_.IsEmpty() || !ready_background_.IsEmpty())
 			{
-				if (enum_has_any(flag, thread_name))
+				return true;
+			}
+			for (uint16 idx = 0; idx < threads_num_; idx++)
+			{
+				if (!ready_per_thread_[idx].IsEmpty())
 				{
-					return ready_to_execute_named[counter];
+					return true;
 				}
-				counter++;
 			}
-			return ready_to_execute_;
+			return false;
 		}
 	};
 	static TaskSystemGlobals globals;
 	thread_local static BaseTask* current_task = nullptr;
+	thread_local static CancellationToken t_scope_cancellation;
+
+	static void ReportPoolPressure(EPoolKind kind, std::size_t capacity, std::size_t max_size, bool exhausted)
+	{
+		const SchedulerSettings& settings = globals.settings_;
+		if (settings.on_pool_high_water && (exhausted || (capacity * 100 >= max_size * settings.pool_high_water_percent)))
+		{
+			settings.on_pool_high_water(PoolPressure{ .pool = kind, .capacity = capacity, .max_size = max_size, .exhausted = exhausted });
+		}
+	}
+
+	template<EPoolKind kKind, typename P>
+	static void OnPoolGrowth(std::size_t capacity)
+	{
+		ReportPoolPressure(kKind, capacity, P::kMaxSize, false);
+	}
 
-	void BaseTask::OnUnblocked(TRefCountPtr<BaseTask> task, TRefCountPtr<BaseTask>* out_first_ready_dependency)
+	void BaseTask::OnUnblocked(TRefCountPtr<BaseTask> task, TRefCountPtr<BaseTask>* out_first_ready_dependency,
+		ReadyTaskChains* out_chains, bool prerequisite_cancelled)
 	{
 		assert(task);
 		assert(task->prerequires_);
+		if (prerequisite_cancelled)
+		{
+			task->prerequisite_cancelled_.store(true, std::memory_order_relaxed);
+		}
 		uint16 new_count = --task->prerequires_;
 		if (!new_count)
 		{
@@ -57,6 +895,15 @@ namespace ts
 			{
 				*out_first_ready_dependency = std::move(task);
 			}
+			else if (out_chains)
+			{
+				assert(task->gate_.GetState() == ETaskState::PendingOrExecuting);
+				if (globals.RouteReady(*task, out_chains))
+				{
+					out_chains->wake_num_++;
+				}
+				task.ResetNoRelease();
+			}
 			else
 			{
 				TaskSystem::OnReadyToExecute(std::move(task));
@@ -64,14 +911,14 @@ namespace ts
 		}
 	}
 
-	std::span<DependencyNode> DependencyNode::GetPoolSpan()
+	const PoolSegmentTable& DependencyNode::GetPoolSegments()
 	{
-		return globals.dependency_pool_.GetPoolSpan();
+		return globals.dependency_pool_.GetSegments();
 	}
 
-	std::span<BaseFuture> BaseFuture::GetPoolSpan()
+	const PoolSegmentTable& BaseFuture::GetPoolSegments()
 	{
-		return globals.future_pool_.GetPoolSpan();
+		return globals.future_pool_.GetSegments();
 	}
 
 	void GenericFuture::OnRefCountZero()
@@ -102,28 +949,64 @@ namespace ts
 		{
 			BaseTask& task = *static_cast<BaseTask*>(this);
 			assert(globals.task_pool_.BelonsTo(task));
-			assert(!task.function_);
+			assert(!task.Payload().function_);
 			assert(state != ETaskState::PendingOrExecuting);
 			globals.task_pool_.Return(task);
 		}
 	}
 
-	thread_local uint16 t_worker_thread_idx = kInvalidIndex;
-
-	void TaskSystem::StartWorkerThreads()
+	void TaskSystem::StartWorkerThreads(uint16 num_threads, SchedulerSettings settings)
 	{
+		assert(!globals.threads_num_);
+		if (!num_threads)
+		{
+			num_threads = GetDefaultWorkerThreadsNum();
+		}
+		assert(num_threads <= kMaxWorkerThreadsNum);
+		globals.threads_num_ = num_threads;
+		globals.ready_per_thread_ = std::make_unique<lock_free::WorkStealingDeque<BaseTask, kWorkerDequeSize>[]>(num_threads);
+		globals.InitializeWorkers(num_threads);
+#if THREAD_SMART_POOL
+		globals.task_pool_.ResizeThreadCaches(num_threads);
+		globals.dependency_pool_.ResizeThreadCaches(num_threads);
+		globals.future_pool_.ResizeThreadCaches(num_threads);
+		AccessSynchronizer::CollectionNode::ResizeThreadCaches(num_threads);
+#endif
+		globals.settings_ = settings;
+		globals.task_pool_.SetGrowthCallback(&OnPoolGrowth<EPoolKind::Task, decltype(globals.task_pool_)>);
+		globals.dependency_pool_.SetGrowthCallback(&OnPoolGrowth<EPoolKind::DependencyNode, decltype(globals.dependency_pool_)>);
+		globals.future_pool_.SetGrowthCallback(&OnPoolGrowth<EPoolKind::Future, decltype(globals.future_pool_)>);
+		globals.parking_.Reset();
 		globals.working_ = true;
 
 		auto loop_body = [](uint16 index)
 			{
 				t_worker_thread_idx = index;
+				t_pool_cache_idx = index;
+				if (globals.settings_.pin_workers)
+				{
+					const CpuInfo& cpu = globals.workers_[index].cpu;
+					CpuTopology::PinCurrentThread(cpu.cpu_id);
+#if THREAD_SMART_POOL
+					globals.task_pool_.BindThreadCacheToNumaNode(index, cpu.numa_node);
+					globals.dependency_pool_.BindThreadCacheToNumaNode(index, cpu.numa_node);
+					globals.future_pool_.BindThreadCacheToNumaNode(index, cpu.numa_node);
+#endif
+				}
 				bool marked_as_used = false;
+				uint32 idle_polls = 0;
+				uint32 executed = 0;
 				while (true)
 				{
-					BaseTask* pop_task = globals.ready_to_execute_.Pop();
+					if (!(++executed % kTimerPollInterval))
+					{
+						globals.PollTimers(); // busy workers service the timers too
+					}
+					BaseTask* pop_task = globals.PopReady(index);
 					TRefCountPtr<BaseTask> task(pop_task, false);
 					if (task)
 					{
+						idle_polls = 0;
 						if (!marked_as_used)
 						{
 							marked_as_used = true;
@@ -149,34 +1032,206 @@ namespace ts
 							);
 						}
 
-						if (globals.working_) [[likely]]
+						if (!globals.working_) [[unlikely]]
+						{
+							break;
+						}
+
+						if (globals.PollTimers())
+						{
+							continue;
+						}
+
+						const SchedulerSettings& settings = globals.settings_;
+						if (idle_polls < settings.spin_before_yield)
+						{
+							CpuPause();
+						}
+						else if (idle_polls < (settings.spin_before_yield + settings.yield_before_park))
 						{
 							std::this_thread::yield();
 						}
 						else
 						{
-							break;
+							auto has_work = []() -> bool
+								{
+									return globals.HasQueuedTasks() || !globals.working_;
+								};
+							if (globals.timers_.HasPending() && !globals.timer_keeper_.exchange(true, std::memory_order_acquire))
+							{
+								globals.parking_.ParkUntil(has_work, globals.timers_.NextTickTime());
+								globals.timer_keeper_.store(false, std::memory_order_release);
+							}
+							else
+							{
+								globals.parking_.Park(has_work);
+							}
+							idle_polls = 0;
+							continue;
 						}
+						idle_polls++;
 					}
 				}
 			};
 
-		uint16 index = 0;
-		for (std::thread& thread : globals.threads_)
+		globals.threads_.reserve(num_threads);
+		for (uint16 index = 0; index < num_threads; index++)
 		{
-			thread = std::thread(loop_body, index);
-			index++;
+			globals.threads_.emplace_back(loop_body, index);
 		}
 	}
 
 	void TaskSystem::StopWorkerThreadsNoWait()
 	{
 		globals.working_ = false;
+		globals.parking_.WakeAll(globals.threads_num_);
+	}
+
+	uint16 TaskSystem::GetDefaultWorkerThreadsNum()
+	{
+		uint32 num = std::max(std::thread::hardware_concurrency(), 1u);
+#if defined(__linux__)
+		// A container may be allowed to use only a part of the visible cores
+		auto quota_to_cpus = [](int64 quota, int64 period) -> uint32
+			{
+				return ((quota > 0) && (period > 0)) 
+					? static_cast<uint32>(std::max<int64>((quota + period - 1) / period, 1))
+					: 0;
+			};
+		uint32 quota_cpus = 0;
+		if (std::ifstream cpu_max("/sys/fs/cgroup/cpu.max"); cpu_max) // cgroup v2: "<quota|max> <period>"
+		{
+			std::string quota;
+			int64 period = 0;
+			if ((cpu_max >> quota >> period) && (quota != "max"))
+			{
+				quota_cpus = quota_to_cpus(std::stoll(quota), period);
+			}
+		}
+		else // cgroup v1
+		{
+			std::ifstream quota_file("/sys/fs/cgroup/cpu/cpu.cfs_quota_us");
+			std::ifstream period_file("/sys/fs/cgroup/cpu/cpu.cfs_period_us");
+			int64 quota = 0;
+			int64 period = 0;
+			if ((quota_file >> quota) && (period_file >> period))
+			{
+				quota_cpus = quota_to_cpus(quota, period);
+			}
+		}
+		if (quota_cpus)
+		{
+			num = std::min(num, quota_cpus);
+		}
+#endif
+		return static_cast<uint16>(std::min<uint32>(num, kMaxWorkerThreadsNum));
+	}
+
+	uint16 TaskSystem::GetWorkerThreadsNum()
+	{
+		return globals.threads_num_;
+	}
+
+	PoolCacheStats TaskSystem::GetTaskPoolCacheStats(bool reset)
+	{
+		return GetPoolCacheStats(EPoolKind::Task, reset);
+	}
+
+	PoolCacheStats TaskSystem::GetPoolCacheStats(EPoolKind pool, bool reset)
+	{
+#if THREAD_SMART_POOL
+		auto get_stats = [reset](auto& pool) -> PoolCacheStats
+			{
+				const PoolCacheStats stats = pool.GetCacheStats();
+				if (reset)
+				{
+					pool.ResetCacheStats();
+				}
+				return stats;
+			};
+		switch (pool)
+		{
+		case EPoolKind::Task:
+			return get_stats(globals.task_pool_);
+		case EPoolKind::Future:
+			return get_stats(globals.future_pool_);
+		case EPoolKind::DependencyNode:
+			return get_stats(globals.dependency_pool_);
+		}
+#endif
+		return PoolCacheStats{};
+	}
+
+	SchedulerStats TaskSystem::GetSchedulerStats()
+	{
+		SchedulerStats stats
+		{
+			.park_events = globals.parking_.park_events_.load(std::memory_order_relaxed),
+			.wake_events = globals.parking_.wake_events_.load(std::memory_order_relaxed),
+			.parked_workers = static_cast<uint16>(globals.parking_.parked_.load(std::memory_order_relaxed)),
+			.exhausted_acquires = globals.exhausted_acquires_.load(std::memory_order_relaxed),
+			.inline_executions = globals.inline_executions_.load(std::memory_order_relaxed)
+		};
+		for (uint16 idx = 0; idx < globals.threads_num_; idx++)
+		{
+			stats.local_steals += globals.workers_[idx].local_steals.load(std::memory_order_relaxed);
+			stats.remote_steals += globals.workers_[idx].remote_steals.load(std::memory_order_relaxed);
+		}
+		return stats;
+	}
+
+	void TaskSystem::RegisterExternalThread()
+	{
+		assert(t_worker_thread_idx == kInvalidThreadIndex);
+		assert(t_pool_cache_idx == kInvalidThreadIndex); // already registered
+#if THREAD_SMART_POOL
+		uint32 used = globals.external_threads_.load(std::memory_order_relaxed);
+		uint32 slot = 0;
+		do
+		{
+			slot = static_cast<uint32>(std::countr_one(used));
+			if (slot >= kMaxExternalThreadsNum)
+			{
+				assert(false); // too many registered threads, see kMaxExternalThreadsNum
+				return; // the thread keeps using the global stacks
+			}
+		} while (!globals.external_threads_.compare_exchange_weak(used, used | (1u << slot), std::memory_order_acquire, std::memory_order_relaxed));
+
+		const uint16 cache_idx = static_cast<uint16>(kMaxWorkerThreadsNum + slot);
+		const uint16 workers_num = globals.threads_num_;
+		globals.task_pool_.FillExternalThreadCache(cache_idx, workers_num);
+		globals.dependency_pool_.FillExternalThreadCache(cache_idx, workers_num);
+		globals.future_pool_.FillExternalThreadCache(cache_idx, workers_num);
+		t_pool_cache_idx = cache_idx;
+#endif
+	}
+
+	void TaskSystem::UnregisterExternalThread()
+	{
+		assert(t_worker_thread_idx == kInvalidThreadIndex);
+		const uint16 cache_idx = t_pool_cache_idx;
+		if (cache_idx == kInvalidThreadIndex)
+		{
+			return;
+		}
+#if THREAD_SMART_POOL
+		t_pool_cache_idx = kInvalidThreadIndex;
+		globals.task_pool_.FlushThreadCache(cache_idx);
+		globals.dependency_pool_.FlushThreadCache(cache_idx);
+		globals.future_pool_.FlushThreadCache(cache_idx);
+		detail::simple_allocator.FlushThreadCache(cache_idx);
+		globals.external_threads_.fetch_and(~(1u << (cache_idx - kMaxWorkerThreadsNum)), std::memory_order_release);
+#endif
+	}
+
+	std::size_t TaskSystem::GetTaskPoolCapacity()
+	{
+		return globals.task_pool_.GetCapacity();
 	}
 
 	void TaskSystem::WaitForAllTasks()
 	{
-		while (globals.used_threads_)
+		while (globals.used_threads_ || globals.HasQueuedTasks() || globals.timers_.HasPending())
 		{
 			std::this_thread::yield();
 		}
@@ -191,7 +1246,12 @@ namespace ts
 		{
 			thread.join();
 		}
-		assert(!globals.ready_to_execute_.Pop());
+		globals.threads_.clear();
+		assert(!globals.HasQueuedTasks());
+		assert(!globals.timers_.HasPending());
+		globals.threads_num_ = 0;
+		globals.ready_per_thread_.reset();
+		globals.workers_.reset();
 #if DO_POOL_STATS
 		globals.task_pool_.AssertEmpty();
 		std::cout << "Max used tasks: " << globals.task_pool_.GetMaxUsedNum() << std::endl;
@@ -216,9 +1276,11 @@ namespace ts
 	{
 		assert(GetState() == ETaskState::PendingOrExecuting);
 
+		const bool cancelled = (new_state == ETaskState::Cancelled);
 		DependencyNode* head = nullptr;
 		DependencyNode* tail = nullptr;
 		uint16 chain_len = 0;
+		ReadyTaskChains ready_chains;
 		auto handle_dependency = [&](DependencyNode& node)
 			{
 				if (!head)
@@ -226,13 +1288,19 @@ namespace ts
 					head = &node;
 				}
 				tail = &node;
-				BaseTask::OnUnblocked(std::move(node.task_).ToRefCountPtr(), out_first_ready_dependency);
+				BaseTask::OnUnblocked(std::move(node.task_).ToRefCountPtr(), out_first_ready_dependency, &ready_chains,
+					cancelled && node.propagate_cancellation_);
 				chain_len++;
 			};
 
-		const ETaskState old_state = depending_.ConsumeAll(new_state, handle_dependency, 
-			inc_tag ? lock_free::ETagAction::Increment : lock_free::ETagAction::None).gate;
-		assert(old_state == ETaskState::PendingOrExecuting);
+		const auto old_state = depending_.ConsumeAll(new_state, handle_dependency, 
+			inc_tag ? lock_free::ETagAction::Increment : lock_free::ETagAction::None);
+		assert(old_state.gate == ETaskState::PendingOrExecuting);
+		if (old_state.waiters) [[unlikely]] // set by WaitWhilePending, in the same atomic state
+		{
+			depending_.NotifyAll();
+		}
+		globals.PushReadyChains(ready_chains);
 
 		if (head)
 		{
@@ -243,12 +1311,159 @@ namespace ts
 		return chain_len;
 	}
 
+	void Gate::WaitWhilePending()
+	{
+		depending_.WaitWhile(ETaskState::PendingOrExecuting);
+	}
+
+	thread_local static uint32 t_wait_help_depth = 0;
+
+	// Executes a ready task (and the continuations it hands over) on a thread waiting for a gate or a pool node.
+	// Returns false, when no task was ready.
+	static bool HelpExecuteReady(const uint16 thread_idx)
+	{
+		const bool is_worker = (thread_idx != kInvalidThreadIndex);
+		BaseTask* pop_task = is_worker ? globals.PopReady(thread_idx) : globals.PopReadyExternal();
+		TRefCountPtr<BaseTask> task(pop_task, false);
+		if (!task)
+		{
+			return false;
+		}
+		if (!is_worker)
+		{
+			globals.used_threads_.fetch_add(1);
+		}
+		do
+		{
+			TRefCountPtr<BaseTask> next = nullptr;
+			task->Execute(&next);
+			task = std::move(next);
+		} while (task);
+		if (!is_worker)
+		{
+			globals.used_threads_.fetch_sub(1);
+		}
+		return true;
+	}
+
+	void GenericFuture::Wait(EWaitMode mode)
+	{
+		const uint16 thread_idx = t_worker_thread_idx;
+		const bool is_worker = (thread_idx != kInvalidThreadIndex);
+		if (IsPendingOrExecuting() && (is_worker || (mode == EWaitMode::Help)) && (t_wait_help_depth < kMaxWaitHelpDepth))
+		{
+			t_wait_help_depth++;
+			BaseTask* const waiting_task = current_task; // executed tasks are not nested in the waiting one
+			current_task = nullptr;
+			uint32 idle_polls = 0;
+			while (IsPendingOrExecuting())
+			{
+				if (HelpExecuteReady(thread_idx))
+				{
+					idle_polls = 0;
+				}
+				else if (idle_polls++ < globals.settings_.spin_before_yield)
+				{
+					CpuPause();
+				}
+				else if (!is_worker)
+				{
+					break; // nothing to help with, park
+				}
+				else
+				{
+					std::this_thread::yield();
+				}
+			}
+			current_task = waiting_task;
+			t_wait_help_depth--;
+		}
+
+		if (IsPendingOrExecuting())
+		{
+			if (is_worker)
+			{
+				// Too deep. A parked worker would not execute tasks, that may be needed to unblock the gate.
+				while (IsPendingOrExecuting())
+				{
+					std::this_thread::yield();
+				}
+			}
+			else
+			{
+				gate_.WaitWhilePending();
+			}
+		}
+		std::atomic_thread_fence(std::memory_order_acquire); // the result
+	}
+
+	// Slow path of an acquire, the pool reached its max size. See EPoolExhaustedPolicy.
+	// Returns nullptr only for may_execute_inline with EPoolExhaustedPolicy::ExecuteInline.
+	template<EPoolKind kKind, typename P>
+	static auto* AcquireFromExhaustedPool(P& pool, bool may_execute_inline)
+	{
+		globals.exhausted_acquires_.fetch_add(1, std::memory_order_relaxed);
+		ReportPoolPressure(kKind, pool.GetCapacity(), P::kMaxSize, true);
+		const EPoolExhaustedPolicy policy = globals.settings_.pool_exhausted_policy;
+		decltype(pool.TryAcquire()) node = nullptr;
+		if (may_execute_inline && (policy == EPoolExhaustedPolicy::ExecuteInline))
+		{
+			return node;
+		}
+		const uint16 thread_idx = t_worker_thread_idx;
+		// A blocked worker would not execute the tasks, that return the nodes
+		const bool help = (policy != EPoolExhaustedPolicy::Block) || (thread_idx != kInvalidThreadIndex);
+		uint32 idle_polls = 0;
+		while (!(node = pool.TryAcquire()))
+		{
+			if (!help)
+			{
+				pool.WaitForReturn(); // parks, a return to the global stack wakes the thread
+				continue;
+			}
+			bool executed = false;
+			if (t_wait_help_depth < kMaxWaitHelpDepth)
+			{
+				t_wait_help_depth++;
+				BaseTask* const waiting_task = current_task; // executed tasks are not nested in the acquiring one
+				current_task = nullptr;
+				executed = HelpExecuteReady(thread_idx);
+				current_task = waiting_task;
+				t_wait_help_depth--;
+			}
+			if (executed)
+			{
+				idle_polls = 0;
+			}
+			else if (idle_polls++ < globals.settings_.spin_before_yield)
+			{
+				CpuPause();
+			}
+			else
+			{
+				std::this_thread::yield();
+			}
+		}
+		return node;
+	}
+
+	template<EPoolKind kKind, typename P>
+	static auto& AcquireFromPool(P& pool)
+	{
+		auto* node = pool.TryAcquire();
+		if (!node) [[unlikely]]
+		{
+			node = AcquireFromExhaustedPool<kKind>(pool, false);
+		}
+		return *node;
+	}
+
 	bool Gate::UnblockSingle()
 	{
 		assert(GetState() == ETaskState::PendingOrExecuting);
 		auto handle_dependency = [&](DependencyNode& node)
 		{
-			BaseTask::OnUnblocked(std::move(node.task_).ToRefCountPtr(), nullptr);
+			BaseTask::OnUnblocked(std::move(node.task_).ToRefCountPtr(), nullptr, nullptr);
 			globals.dependency_pool_.Return(node);
 		};
 		return depending_.ConsumeSingle(handle_dependency);
@@ -258,66 +1473,199 @@ namespace ts
 	{
 		assert(gate_.GetState() == ETaskState::PendingOrExecuting);
 		assert(!prerequires_);
-		assert(function_);
+		TaskPayload& payload = Payload();
+		assert(payload.function_);
 		assert(!current_task);
 		assert(GetRefCount());
 
-		current_task = this;
-		function_(*this);
-		current_task = nullptr;
-		assert(GetRefCount());
+		const bool cancelled = !enum_has_any(flag_, ETaskFlags::NotCancellable)
+			&& (prerequisite_cancelled_.load(std::memory_order_relaxed) || payload.cancellation_.IsCancellationRequested());
+		prerequisite_cancelled_.store(false, std::memory_order_relaxed);
+		RecurringTask* const recurring = payload.recurring_;
+		// The final iteration of a stopped recurring task only completes the gate
+		if (!cancelled && !(recurring && recurring->IsStopping()))
+		{
+			current_task = this;
+			payload.function_(*this);
+			current_task = nullptr;
+			assert(GetRefCount());
 #if TASK_RETRIGGER
-		if (retrigger_)
+			if (payload.retrigger_)
+			{
+				payload.retrigger_ = false;
+				return;
+			}
+#endif
+		}
+		if (recurring && !cancelled && !recurring->IsStopping())
 		{
-			retrigger_ = false;
+			// Dependents of this iteration are unblocked, the tag is bumped. The gate stays pending for the next iteration.
+			assert(!result_.HasValue());
+			gate_.Unblock(ETaskState::PendingOrExecuting, out_first_ready_dependency, true);
+			recurring->Rearm(); // the task may be executed by another thread from now on
 			return;
 		}
-#endif
-		const ETaskState new_state = result_.HasValue() ? ETaskState::DoneUnconsumedResult : ETaskState::Done;
+		payload.recurring_ = nullptr;
+		payload.cancellation_ = CancellationToken{};
+		assert(!cancelled || !result_.HasValue());
+		const ETaskState new_state = cancelled 
+			? ETaskState::Cancelled 
+			: (result_.HasValue() ? ETaskState::DoneUnconsumedResult : ETaskState::Done);
 		gate_.Unblock(new_state, out_first_ready_dependency);
 
-		function_ = nullptr; //Moved to the end, because of InitializeTaskOn::LambdaObj
-		assert(!function_);
+		payload.function_ = nullptr; //Moved to the end, because of InitializeTaskOn::LambdaObj
+		assert(!payload.function_);
 		assert(GetRefCount());
 	}
 
 	void TaskSystem::OnReadyToExecute(TRefCountPtr<BaseTask> task)
 	{
 		assert(task->gate_.GetState() == ETaskState::PendingOrExecuting);
-		globals.ReadyStack(task->flag_).Push(*task);
+		globals.PushReady(*task);
 		task.ResetNoRelease();
 	}
 
-	std::span<BaseTask> BaseTask::GetPoolSpan()
+	const PoolSegmentTable& BaseTask::GetPoolSegments()
+	{
+		return globals.task_pool_.GetSegments();
+	}
+
+	static_assert(sizeof(BaseTask) == kCacheLineSize, "The hot part of a task should fill exactly one cache line");
+
+	TaskPayload& BaseTask::Payload()
+	{
+		return globals.task_pool_.GetCompanion(*this);
+	}
+
+	const TaskPayload& BaseTask::Payload() const
 	{
-		return globals.task_pool_.GetPoolSpan();
+		return globals.task_pool_.GetCompanion(*this);
 	}
 
 	TRefCountPtr<BaseFuture> TaskSystem::MakeBaseFuture()
 	{
-		TRefCountPtr<BaseFuture> future = globals.future_pool_.Acquire();
+		TRefCountPtr<BaseFuture> future = AcquireFromPool<EPoolKind::Future>(globals.future_pool_);
 		assert(future->gate_.IsEmpty());
 		const ETaskState old_state = future->gate_.ResetStateOnEmpty(ETaskState::PendingOrExecuting);
 		assert(old_state == ETaskState::Nonexistent_Pooled);
 		return future;
 	}
 
-	TRefCountPtr<BaseTask> TaskSystem::CreateTask(std::move_only_function<void(BaseTask&)> function, ETaskFlags flags
+	TRefCountPtr<BaseTask> TaskSystem::CreateTask(TaskFunction function, ETaskFlags flags
 		LOCATION_PARAM_IMPL)
 	{
-		TRefCountPtr<BaseTask> task = globals.task_pool_.Acquire();
-		assert(task);
-		assert(!task->function_);
-		DEBUG_CODE(task->source = location;)
-		task->flag_ = flags;
-		task->function_ = std::move(function);
-		assert(task->gate_.IsEmpty());
-		const ETaskState old_state = task->gate_.ResetStateOnEmpty(ETaskState::PendingOrExecuting);
-		assert(old_state == ETaskState::Nonexistent_Pooled);
-		assert(task->prerequires_ == 0);
+		TRefCountPtr<BaseTask> task = AcquireTask(false);
+		InitializeAcquiredTask(*task, std::move(function), flags LOCATION_PASS);
 		return task;
 	}
 
+	TRefCountPtr<BaseTask> TaskSystem::AcquireTask(bool may_execute_inline)
+	{
+		BaseTask* task = globals.task_pool_.TryAcquire();
+		if (!task) [[unlikely]]
+		{
+			task = AcquireFromExhaustedPool<EPoolKind::Task>(globals.task_pool_, may_execute_inline);
+		}
+		return TRefCountPtr<BaseTask>(task);
+	}
+
+	void TaskSystem::InitializeAcquiredTask(BaseTask& task, TaskFunction function, ETaskFlags flags
+		LOCATION_PARAM_IMPL)
+	{
+		TaskPayload& payload = task.Payload();
+		assert(!payload.function_);
+		DEBUG_CODE(payload.source = location;)
+		task.flag_ = flags;
+		payload.function_ = std::move(function);
+		assert(!payload.cancellation_.CanBeCancelled() && !task.prerequisite_cancelled_);
+		if (!enum_has_any(flags, ETaskFlags::NotCancellable))
+		{
+			payload.cancellation_ = CancellationToken::GetCurrent();
+		}
+		assert(task.gate_.IsEmpty());
+		[[maybe_unused]] const ETaskState old_state = task.gate_.ResetStateOnEmpty(ETaskState::PendingOrExecuting);
+		assert(old_state == ETaskState::Nonexistent_Pooled);
+		assert(task.prerequires_ == 0);
+	}
+
+	void TaskSystem::OnInlineExecution()
+	{
+		globals.inline_executions_.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	BaseTask& TaskSystem::CreateTaskChain(uint16 num, ETaskFlags flags LOCATION_PARAM_IMPL)
+	{
+		BaseTask& head = globals.task_pool_.AcquireChain(num, []() -> BaseTask& { return AcquireFromPool<EPoolKind::Task>(globals.task_pool_); });
+		for (BaseTask* task = &head; task; task = task->NextInChain())
+		{
+			task->AddRef(); // released by the worker after execution, like in OnReadyToExecute
+			assert(!task->Payload().function_);
+			DEBUG_CODE(task->Payload().source = location;)
+			task->flag_ = flags;
+			assert(task->gate_.IsEmpty());
+			[[maybe_unused]] const ETaskState old_state = task->gate_.ResetStateOnEmpty(ETaskState::PendingOrExecuting);
+			assert(old_state == ETaskState::Nonexistent_Pooled);
+			assert(task->prerequires_ == 0);
+		}
+		return head;
+	}
+
+	void TaskSystem::ScheduleAt(BaseTask& task, TimerClock::time_point deadline)
+	{
+		assert(task.gate_.GetState() == ETaskState::PendingOrExecuting);
+		assert(!task.prerequires_);
+		// The timer wheel holds the reference, like a ready queue
+		task.AddRef();
+		ReadyTaskChains chains;
+		auto on_expired = [&](BaseTask& expired_task)
+			{
+				if (globals.RouteReady(expired_task, &chains))
+				{
+					chains.wake_num_++;
+				}
+			};
+		if (!globals.timers_.Insert(task, globals.timers_.ToTick(deadline), on_expired))
+		{
+			on_expired(task);
+		}
+		globals.PushReadyChains(chains);
+		if (!globals.timer_keeper_.load(std::memory_order_relaxed))
+		{
+			globals.parking_.Wake(1); // a worker has to service the timers, while others are parked
+		}
+	}
+
+	void TaskSystem::SubmitTaskChain(BaseTask& head, uint16 num)
+	{
+		globals.PushReadyChain(head, num);
+	}
+
+	bool TaskSystem::ShouldSplitRange(ETaskFlags flags)
+	{
+		return globals.IsReadyQueueEmpty(flags);
+	}
+
+	void TaskSystem::AsyncResumeMany(std::span<DetachHandle> handles, ETaskFlags flags LOCATION_PARAM_IMPL)
+	{
+		flags = InheritPriority(enum_or(flags, ETaskFlags::NotCancellable));
+		std::size_t first = 0;
+		while (first < handles.size())
+		{
+			const uint16 chain_len = static_cast<uint16>(std::min(handles.size() - first, kMaxTaskChainLength));
+			BaseTask& head = CreateTaskChain(chain_len, flags LOCATION_PASS);
+			for (BaseTask* task = &head; task; task = task->NextInChain())
+			{
+				TaskPayload& payload = task->Payload();
+				payload.function_ = [handle = handles[first++].Detach()]([[maybe_unused]] BaseTask& task)
+					{
+						handle.resume();
+					};
+				assert(!payload.cancellation_.CanBeCancelled());
+			}
+			SubmitTaskChain(head, chain_len);
+		}
+	}
+
 	void TaskSystem::HandlePrerequires(BaseTask& task, std::span<Gate*> prerequiers, std::span<uint8> prerequiers_tags)
 	{
 		assert(!prerequiers_tags.size() || prerequiers.size() == prerequiers_tags.size());
@@ -341,6 +1689,16 @@ namespace ts
 			return;
 		}
 
+		// Tagged prerequisites only order the access to a resource, their cancellation is not propagated
+		const bool propagate_cancellation = prerequiers_tags.empty();
+		auto on_inactive_prereq = [&](const Gate* prereq)
+			{
+				if (propagate_cancellation && prereq && (prereq->GetState() == ETaskState::Cancelled))
+				{
+					task.prerequisite_cancelled_.store(true, std::memory_order_relaxed);
+				}
+			};
+
 		uint16 inactive_prereq = 0;
 		DependencyNode* node = nullptr;
 		for(int32 index = 0; index < prerequiers.size(); index++)
@@ -350,14 +1708,16 @@ namespace ts
 			if (!prereq || (prereq->GetState() != ETaskState::PendingOrExecuting))
 			{
 				inactive_prereq++;
+				on_inactive_prereq(prereq);
 				continue;
 			}
 
 			if (!node)
 			{
-				node = &globals.dependency_pool_.Acquire();
+				node = &AcquireFromPool<EPoolKind::DependencyNode>(globals.dependency_pool_);
 				assert(!node->task_);
 				node->task_ = task;
+				node->propagate_cancellation_ = propagate_cancellation;
 			}
 
 			const bool added = prerequiers_tags.size()
@@ -370,6 +1730,7 @@ namespace ts
 			else
 			{
 				inactive_prereq++;
+				on_inactive_prereq(prereq);
 			}
 		}
 		if (node)
@@ -390,16 +1751,47 @@ namespace ts
 
 	}
 
-	void TaskSystem::AsyncResume(DetachHandle handle LOCATION_PARAM_IMPL)
+	void TaskSystem::AsyncResume(DetachHandle handle, ETaskFlags flags LOCATION_PARAM_IMPL)
 	{
 		InitializeTask([handle = handle.Detach()]()
 			{
 				handle.resume();
-			}, {}, ETaskFlags::None LOCATION_PASS);
+			}, {}, InheritPriority(enum_or(flags, ETaskFlags::NotCancellable)) LOCATION_PASS);
+	}
+
+	ETaskFlags InheritPriority(ETaskFlags flags)
+	{
+		if (enum_has_any(flags, ETaskFlags::PriorityMask) || !current_task)
+		{
+			return flags;
+		}
+		const ETaskFlags current_priority = static_cast<ETaskFlags>(
+			static_cast<uint16>(current_task->GetFlags()) & static_cast<uint16>(ETaskFlags::PriorityMask));
+		return enum_or(flags, current_priority);
 	}
 
 	BaseTask* BaseTask::GetCurrentTask()
 	{
 		return current_task;
 	}
+
+	CancellationToken CancellationToken::GetCurrent()
+	{
+		if (t_scope_cancellation.CanBeCancelled() || !current_task)
+		{
+			return t_scope_cancellation;
+		}
+		return current_task->GetCancellationToken();
+	}
+
+	CancellationScope::CancellationScope(CancellationToken token)
+		: previous_(std::move(t_scope_cancellation))
+	{
+		t_scope_cancellation = std::move(token);
+	}
+
+	CancellationScope::~CancellationScope()
+	{
+		t_scope_cancellation = std::move(previous_);
+	}
 }
\ No newline at end of file
@@ -9,6 +9,9 @@
 #include <span>
 #include <concepts>
 #include <thread>
+#include <ranges>
+#include <chrono>
+#include <functional>
 
 namespace ts
 {
@@ -28,20 +31,124 @@ namespace ts
 		using ReturnType = void;
 	};
 
+	enum class ESchedulingPolicy : uint8
+	{
+		Lifo, // the most recently readied task first, best locality
+		Fifo, // all tasks go through a single global FIFO queue, bounded latency
+	};
+
+	enum class EPoolKind : uint8
+	{
+		Task,
+		Future,
+		DependencyNode,
+	};
+
+	// What an acquire does, when a pool reached its max size (see kTaskPoolMaxSize) and has no free node
+	enum class EPoolExhaustedPolicy : uint8
+	{
+		HelpExecute, // the acquiring thread executes ready tasks, until a node is returned to the pool
+		ExecuteInline, // InitializeTask without prerequisites executes the functor on the submitting thread, otherwise HelpExecute
+		Block, // a thread, that is not a worker, parks until a node is returned to the global free stack. Worker threads help, as with HelpExecute.
+	};
+
+	struct PoolPressure
+	{
+		EPoolKind pool = EPoolKind::Task;
+		std::size_t capacity = 0; // allocated nodes
+		std::size_t max_size = 0;
+		bool exhausted = false; // an acquire found no free node at the max size
+	};
+
+	struct SchedulerSettings
+	{
+		ESchedulingPolicy policy = FIFO_SCHEDULING ? ESchedulingPolicy::Fifo : ESchedulingPolicy::Lifo;
+
+		// Each worker owns a deque (local LIFO push/pop, FIFO stealing by idle workers). 
+		// The global stack is used only for tasks submitted from non-worker threads (or on deque overflow).
+		// When false, all workers share the single global stack.
+		bool work_stealing = true;
+
+		// An idle worker polls the ready queues spin_before_yield times (with cpu pause), 
+		// then yield_before_park times (with yield), then it parks until a task is submitted.
+		uint32 spin_before_yield = 64;
+		uint32 yield_before_park = 16;
+
+		// Starvation protection in Lifo policy. Every aging_interval-th task a worker takes the oldest available task:
+		// from the FIFO queue (where the global stack is flushed in submission order) or the oldest one in its own deque.
+		// 0 disables aging.
+		uint32 aging_interval = 32;
+
+		// Each worker is pinned to a cpu from CpuTopology::SelectWorkerCpus. Its pool caches are moved to the numa node of the cpu.
+		bool pin_workers = true;
+
+		// A thief tries the workers of its own numa node first (in random order), then the other nodes from the closest one.
+		// When false, victims are tried in random order.
+		bool numa_aware_stealing = true;
+
+		// An acquire from an exhausted pool never fails, it waits for a free node according to the policy.
+		// Nodes are returned only by executed tasks: a thread flooding the system with tasks, that wait for a future
+		// completed later by the same thread, would wait forever.
+		EPoolExhaustedPolicy pool_exhausted_policy = EPoolExhaustedPolicy::HelpExecute;
+
+		// Load shedding. Called when a pool grows over pool_high_water_percent of its max size (on each growth)
+		// and when an acquire finds it exhausted. Called on the acquiring thread, it must not wait for tasks.
+		std::function<void(const PoolPressure&)> on_pool_high_water;
+		uint8 pool_high_water_percent = 75;
+	};
+
+	using TimerClock = std::chrono::steady_clock;
+	// Later deadlines of delayed tasks are clamped, so the tick math never overflows. The task can still be cancelled.
+	constexpr TimerClock::duration kMaxTimerDelay = std::chrono::hours(24 * 365 * 100);
+
+	struct SchedulerStats
+	{
+		uint64 park_events = 0; // how many times a worker went to sleep
+		uint64 wake_events = 0; // how many parked workers were woken by submitters or shutdown
+		uint16 parked_workers = 0; // currently parked
+		uint64 local_steals = 0; // tasks stolen from a worker on the same numa node
+		uint64 remote_steals = 0; // tasks stolen across numa nodes
+		uint64 exhausted_acquires = 0; // acquires that found a pool exhausted, see EPoolExhaustedPolicy
+		uint64 inline_executions = 0; // InitializeTask functors executed by the submitter, because the task pool was exhausted
+	};
+
 	class TaskSystem
 	{
 	public:
 		static void WaitForAllTasks();
 
-		static void StartWorkerThreads();
+		// num_threads == 0 means GetDefaultWorkerThreadsNum()
+		static void StartWorkerThreads(uint16 num_threads = 0, SchedulerSettings settings = {});
 
 		static void StopWorkerThreadsNoWait();
 
 		static void WaitForWorkerThreadsToJoin();
 
+		static SchedulerStats GetSchedulerStats();
+
+		// Hardware concurrency, limited by the cgroup CPU quota (Linux containers) and kMaxWorkerThreadsNum
+		static uint16 GetDefaultWorkerThreadsNum();
+
+		// Zero, when worker threads are not running
+		static uint16 GetWorkerThreadsNum();
+
+		// Acquires by worker threads served by their own cache vs the global free stack
+		static PoolCacheStats GetTaskPoolCacheStats(bool reset = false);
+		static PoolCacheStats GetPoolCacheStats(EPoolKind pool, bool reset = false);
+
+		// Gives the calling thread (not a worker) its own task, future and dependency node pool caches, sized like the caches
+		// of the workers. Otherwise such threads (main, render, named thread pumps) use the global free stacks for each node.
+		// At most kMaxExternalThreadsNum threads. Call UnregisterExternalThread before the thread exits, it flushes the caches.
+		static void RegisterExternalThread();
+		static void UnregisterExternalThread();
+
+		// Allocated task slots. Starts at kTaskPoolSize, grows on demand up to kTaskPoolMaxSize.
+		static std::size_t GetTaskPoolCapacity();
+
 		static bool ExecuteATask(ETaskFlags flag, std::atomic<bool>& out_active);
 
-		static void AsyncResume(DetachHandle handle LOCATION_PARAM);
+		// Without a priority in flags, the coroutine inherits the priority of the current task
+		static void AsyncResume(DetachHandle handle, ETaskFlags flags = ETaskFlags::None LOCATION_PARAM);
 
 		template<class F>
 		static auto InitializeTask(F&& functor, std::span<Gate*> prerequiers = {}, ETaskFlags flags = ETaskFlags::None
@@ -50,7 +157,13 @@ namespace ts
 			using ResultType = decltype(std::invoke(functor));
 			static_assert(sizeof(Task<ResultType>) == sizeof(BaseTask));
 			static_assert(sizeof(Future<ResultType>) == sizeof(GenericFuture));
-			TRefCountPtr<BaseTask> task = CreateTask([function = std::forward<F>(functor)]([[maybe_unused]] BaseTask& task) mutable
+			const bool may_execute_inline = prerequiers.empty() && !enum_has_any(flags, ETaskFlags::NameThreadMask);
+			TRefCountPtr<BaseTask> task = AcquireTask(may_execute_inline);
+			if (!task) [[unlikely]]
+			{
+				return ExecuteInline<ResultType>(std::forward<F>(functor), flags);
+			}
+			InitializeAcquiredTask(*task, [function = std::forward<F>(functor)]([[maybe_unused]] BaseTask& task) mutable
 				{
 					if constexpr (std::is_void_v<ResultType>)
 					{
@@ -65,6 +178,103 @@ namespace ts
 			return task.Cast<GenericFuture>().Cast<Future<ResultType>>();
 		}
 
+		// The task gets ready at the deadline (rounded up to the timer tick, see kTimerTickMicroseconds).
+		// Delayed tasks wait in a timer wheel serviced by the workers.
+		template<class F>
+		static auto InitializeTaskAt(TimerClock::time_point deadline, F&& functor, ETaskFlags flags = ETaskFlags::None
+			LOCATION_PARAM)
+		{
+			using ResultType = decltype(std::invoke(functor));
+			TRefCountPtr<BaseTask> task = CreateTask([function = std::forward<F>(functor)]([[maybe_unused]] BaseTask& task) mutable
+				{
+					if constexpr (std::is_void_v<ResultType>)
+					{
+						std::invoke(function);
+					}
+					else
+					{
+						task.result_.Store(std::invoke(function));
+					}
+				}, flags LOCATION_PASS);
+			ScheduleAt(*task, deadline);
+			return task.Cast<GenericFuture>().Cast<Future<ResultType>>();
+		}
+
+		template<class F>
+		static auto InitializeTaskAfter(TimerClock::duration delay, F&& functor, ETaskFlags flags = ETaskFlags::None
+			LOCATION_PARAM)
+		{
+			return InitializeTaskAt(TimerClock::now() + std::min(delay, kMaxTimerDelay), std::forward<F>(functor), flags LOCATION_PASS);
+		}
+
+		// One fire-and-forget task per element, functor(element). Tasks are acquired from the pool as a chain
+		// and submitted with a single push (per kMaxTaskChainLength tasks).
+		template<std::ranges::sized_range R, class F>
+		static void InitializeTasks(R&& range, const F& functor, ETaskFlags flags = ETaskFlags::None
+			LOCATION_PARAM)
+		{
+			auto iter = std::ranges::begin(range);
+			std::size_t remaining = std::ranges::size(range);
+			const CancellationToken cancellation = enum_has_any(flags, ETaskFlags::NotCancellable)
+				? CancellationToken{} : CancellationToken::GetCurrent();
+			while (remaining)
+			{
+				const uint16 chain_len = static_cast<uint16>(std::min(remaining, kMaxTaskChainLength));
+				BaseTask& head = CreateTaskChain(chain_len, flags LOCATION_PASS);
+				for (BaseTask* task = &head; task; task = task->NextInChain())
+				{
+					TaskPayload& payload = task->Payload();
+					payload.function_ = [functor, element = *iter]([[maybe_unused]] BaseTask& task) mutable
+						{
+							std::invoke(functor, element);
+						};
+					payload.cancellation_ = cancellation;
+					++iter;
+				}
+				SubmitTaskChain(head, chain_len);
+				remaining -= chain_len;
+			}
+		}
+
+		// AsyncResume for many coroutines, with a single push per kMaxTaskChainLength coroutines.
+		static void AsyncResumeMany(std::span<DetachHandle> handles, ETaskFlags flags = ETaskFlags::None LOCATION_PARAM);
+
+		// body(index) for each index in [begin, end). The calling thread executes a part of the range. 
+		// Ranges are split in half lazily, only when the local ready queue is empty (so an idle worker can steal the other half),
+		// never below grain indices. The returned future is done after the last index was processed.
+		// When the current cancellation token is cancelled, remaining indices are skipped and the future is cancelled.
+		template<std::integral I, class F>
+		static TRefCountPtr<Future<>> ParallelFor(I begin, I end, F body, I grain = 1, ETaskFlags flags = ETaskFlags::None)
+		{
+			assert(grain > 0);
+			TRefCountPtr<Future<>> done = MakeFuture<>();
+			if (end <= begin)
+			{
+				done->Done();
+				return done;
+			}
+			const std::size_t num = static_cast<std::size_t>(end - begin);
+			auto index_body = [begin, body = std::move(body)](std::size_t offset) mutable
+				{
+					std::invoke(body, static_cast<I>(begin + static_cast<I>(offset)));
+				};
+			TRefCountPtr<ParallelForState<decltype(index_body)>> state = 
+				new ParallelForState<decltype(index_body)>(std::move(index_body), num, static_cast<std::size_t>(grain), 
+					InheritPriority(enum_or(flags, ETaskFlags::NotCancellable)), done);
+			ParallelForRange(std::move(state), 0, num);
+			return done;
+		}
+
+		// body(element) for each element of the span, see ParallelFor
+		template<typename T, class F>
+		static TRefCountPtr<Future<>> ParallelForEach(std::span<T> elements, F body, std::size_t grain = 1, ETaskFlags flags = ETaskFlags::None)
+		{
+			return ParallelFor(std::size_t{ 0 }, elements.size(), [elements, body = std::move(body)](std::size_t index) mutable
+				{
+					std::invoke(body, elements[index]);
+				}, grain, flags);
+		}
+
 		template<class F, SyncT TValue>
 		static auto InitializeTaskOn(F&& functor, SyncHolder<TValue> resource, ETaskFlags flags = ETaskFlags::None
 			LOCATION_PARAM)
@@ -77,14 +287,14 @@ namespace ts
 			{
 				F function_;
 				TValue* ptr_;
-				BaseTask* task_ = nullptr;
+				BaseTask* task_; // known in advance, a cancelled task releases the access without calling the function
 
-				LambdaObj(F&& function, TValue* ptr) :
-					function_(std::forward<F>(function)), ptr_(std::move(ptr))
+				LambdaObj(F&& function, TValue* ptr, BaseTask& task) :
+					function_(std::forward<F>(function)), ptr_(std::move(ptr)), task_(&task)
 				{}
 
 				LambdaObj(LambdaObj&& moved) :
-					function_(std::move(moved.function_)), ptr_(std::move(moved.ptr_))
+					function_(std::move(moved.function_)), ptr_(std::move(moved.ptr_)), task_(moved.task_)
 				{
 					moved.ptr_ = nullptr;
 				}
@@ -92,6 +302,7 @@ namespace ts
 				void operator()([[maybe_unused]] BaseTask& task)
 				{
 					assert(ptr_);
+					assert(task_ == &task);
 					assert(!AccessSynchronizer::is_any_asset_locked_); //If any other asset is locked it means there is a risk of deadlock
 					DEBUG_CODE(AccessSynchronizer::is_any_asset_locked_ = true;)
 						if constexpr (std::is_void_v<ResultType>)
@@ -104,8 +315,6 @@ namespace ts
 						}
 					assert(AccessSynchronizer::is_any_asset_locked_);
 					DEBUG_CODE(AccessSynchronizer::is_any_asset_locked_ = false;)
-						assert(!task_);
-					task_ = &task;
 				}
 
 				~LambdaObj()
@@ -115,16 +324,13 @@ namespace ts
 						assert(task_);
 						ptr_->synchronizer_.ReleaseExclusive(*task_); //This works because Task::Execute cleans functor at the end
 					}
-					else
-					{
-						assert(!task_);
-					}
 				}
 			};
 
 			assert(resource.Get());
 			AccessSynchronizer& synchronizer = resource.Get()->synchronizer_;
-			TRefCountPtr<BaseTask> task = CreateTask(LambdaObj{ std::forward<F>(functor), std::move(resource.Get()) }, flags LOCATION_PASS);
+			TRefCountPtr<BaseTask> task = CreateTask(nullptr, flags LOCATION_PASS);
+			task->Payload().function_ = LambdaObj{ std::forward<F>(functor), std::move(resource.Get()), *task };
 			{
 				AccessSynchronizer::SyncMultiResult sync_result = synchronizer.SyncExclusive(*task, task->GetTag());
 				AccessSynchronizer::SyncMultiResult::HandleOnTask(std::move(sync_result), *task);
@@ -140,22 +346,155 @@ namespace ts
 			return MakeBaseFuture().Cast<Future<T>>();
 		}
 
+		// A cancelled prerequisite cancels the task. Not for tagged prerequisites - they only order the access to a resource.
 		static void HandlePrerequires(BaseTask& task, std::span<Gate*> prerequiers = {}, std::span<uint8> prerequiers_tags = {});
 
 #pragma region private
 	private:
-		static TRefCountPtr<BaseTask> CreateTask(std::move_only_function<void(BaseTask&)> function,
+		static TRefCountPtr<BaseTask> CreateTask(TaskFunction function,
 			ETaskFlags flags = ETaskFlags::None LOCATION_PARAM);
 
+		// Returns nullptr only when may_execute_inline, the task pool is exhausted and the policy is EPoolExhaustedPolicy::ExecuteInline
+		static TRefCountPtr<BaseTask> AcquireTask(bool may_execute_inline);
+
+		static void InitializeAcquiredTask(BaseTask& task, TaskFunction function, ETaskFlags flags LOCATION_PARAM);
+
+		// The task pool is exhausted. The functor is executed nested in the current task (if any), the returned future is done.
+		template<typename ResultType, class F>
+		static TRefCountPtr<Future<ResultType>> ExecuteInline(F&& functor, ETaskFlags flags)
+		{
+			OnInlineExecution();
+			TRefCountPtr<Future<ResultType>> future = MakeFuture<ResultType>();
+			if (!enum_has_any(flags, ETaskFlags::NotCancellable) && CancellationToken::GetCurrent().IsCancellationRequested())
+			{
+				future->Cancel();
+			}
+			else if constexpr (std::is_void_v<ResultType>)
+			{
+				std::invoke(functor);
+				future->Done();
+			}
+			else
+			{
+				future->Done(std::invoke(functor));
+			}
+			return future;
+		}
+
+		static void OnInlineExecution();
+
+		template<class F>
+		struct ParallelForState : public TRefCounted<ParallelForState<F>>
+		{
+			ParallelForState(F&& in_body, std::size_t num, std::size_t in_grain, ETaskFlags in_flags, TRefCountPtr<Future<>> in_done)
+				: body(std::move(in_body)), remaining(num), grain(in_grain), flags(in_flags), done(std::move(in_done))
+				, cancellation(CancellationToken::GetCurrent())
+			{}
+
+			F body;
+			std::atomic<std::size_t> remaining; // indices not yet processed
+			std::atomic<bool> skipped = false; // some indices were not processed, because of the cancellation
+			const std::size_t grain;
+			const ETaskFlags flags; // NotCancellable, the split tasks check the cancellation, so remaining reaches zero
+			TRefCountPtr<Future<>> done;
+			const CancellationToken cancellation;
+		};
+
+		template<class F>
+		static void ParallelForRange(TRefCountPtr<ParallelForState<F>> state, std::size_t first, std::size_t last)
+		{
+			const std::size_t grain = state->grain;
+			while (first < last)
+			{
+				if (((last - first) > grain) && ShouldSplitRange(state->flags))
+				{
+					const std::size_t middle = first + (last - first) / 2;
+					InitializeTask([state, middle, last]() mutable
+						{
+							ParallelForRange(std::move(state), middle, last);
+						}, {}, state->flags);
+					last = middle;
+					continue;
+				}
+
+				const bool cancelled = state->cancellation.IsCancellationRequested();
+				const std::size_t chunk_end = cancelled ? last : std::min(first + grain, last);
+				if (cancelled)
+				{
+					state->skipped.store(true, std::memory_order_relaxed);
+				}
+				else
+				{
+					for (std::size_t index = first; index < chunk_end; index++)
+					{
+						state->body(index);
+					}
+				}
+				const std::size_t processed = chunk_end - first;
+				if (state->remaining.fetch_sub(processed, std::memory_order_acq_rel) == processed)
+				{
+					if (state->skipped.load(std::memory_order_relaxed))
+					{
+						state->done->Cancel();
+					}
+					else
+					{
+						state->done->Done();
+					}
+				}
+				first = chunk_end;
+			}
+		}
+
+		// Lazy binary splitting: true when the ready queue, where a split task would go, is empty.
+		static bool ShouldSplitRange(ETaskFlags flags);
+
+		// Either inserts the task into the timer wheel, or (when the deadline passed) makes it ready
+		static void ScheduleAt(BaseTask& task, TimerClock::time_point deadline);
+
+		// Tasks are linked by NextRef. Each one is ready to get its function_.
+		static BaseTask& CreateTaskChain(uint16 num, ETaskFlags flags = ETaskFlags::None LOCATION_PARAM);
+
+		static void SubmitTaskChain(BaseTask& head, uint16 num);
+
 		static TRefCountPtr<BaseFuture> MakeBaseFuture();
 
 		static void OnReadyToExecute(TRefCountPtr<BaseTask> task);
 
 		friend class BaseTask;
+		friend class TaskGraph;
+		friend class RecurringTask;
 		template<typename T> friend class GuardedResource;
 		template<SyncT TValue> friend struct AccessSynchronizerExclusiveTaskAwaiter;
 		template<SyncT TValue> friend struct AccessSynchronizerSharedTaskAwaiter;
 #pragma endregion
 	};
 
+
+	// co_await Delay(duration) resumes the coroutine after the duration, see TaskSystem::InitializeTaskAt
+	struct Delay
+	{
+		TimerClock::duration duration;
+	};
+
+	struct DelayAwaiter
+	{
+		TimerClock::time_point deadline_;
+
+		bool await_ready() const
+		{
+			return deadline_ <= TimerClock::now();
+		}
+
+		void await_suspend(std::coroutine_handle<> handle)
+		{
+			assert(handle);
+			TaskSystem::InitializeTaskAt(deadline_, [handle]()
+				{
+					handle.resume();
+				}, InheritPriority(ETaskFlags::NotCancellable));
+		}
+
+		void await_resume() {}
+	};
 }
\ No newline at end of file
@@ -0,0 +1,216 @@
+#pragma once
+
+#include "Task.h"
+#include <memory>
+#include <vector>
+
+namespace ts
+{
+	// A DAG of functors recorded once and replayed (e.g. every frame).
+	// Compile acquires one task per node and precomputes prerequisite counts and successor arrays.
+	// Run only resets counters and re-arms the same tasks: no pool allocations, no DependencyNodes.
+	class TaskGraph
+	{
+	public:
+		using NodeId = uint16;
+
+		TaskGraph() = default;
+		TaskGraph(TaskGraph&&) = delete;
+		TaskGraph(const TaskGraph&) = delete;
+		TaskGraph& operator=(TaskGraph&&) = delete;
+		TaskGraph& operator=(const TaskGraph&) = delete;
+
+		~TaskGraph()
+		{
+			WaitForPreviousRun();
+			for (Node& node : nodes_)
+			{
+				node.task = nullptr;
+			}
+		}
+
+		template<class F>
+		NodeId AddNode(F&& functor, ETaskFlags flags = ETaskFlags::None)
+		{
+			assert(!IsCompiled());
+			assert(!enum_has_any(flags, ETaskFlags::NameThreadMask) && !enum_has_any(flags, ETaskFlags::TryExecuteImmediate));
+			assert(nodes_.size() < std::numeric_limits<NodeId>::max());
+			nodes_.push_back(Node{ .functor = std::forward<F>(functor), .flags = flags });
+			return static_cast<NodeId>(nodes_.size() - 1);
+		}
+
+		// "to" is executed after "from" is done
+		void AddEdge(NodeId from, NodeId to)
+		{
+			assert(!IsCompiled());
+			assert((from < nodes_.size()) && (to < nodes_.size()) && (from != to));
+			edges_.push_back({ from, to });
+			nodes_[to].prerequires_num++;
+		}
+
+		void Compile()
+		{
+			assert(!IsCompiled());
+			const NodeId nodes_num = static_cast<NodeId>(nodes_.size());
+			for (const auto& [from, to] : edges_)
+			{
+				nodes_[from].successors_num++;
+			}
+			uint32 first_successor = 0;
+			for (Node& node : nodes_)
+			{
+				node.first_successor = first_successor;
+				first_successor += node.successors_num;
+			}
+			successors_.resize(edges_.size());
+			std::vector<uint32> filled(nodes_num, 0);
+			for (const auto& [from, to] : edges_)
+			{
+				successors_[nodes_[from].first_successor + filled[from]++] = to;
+			}
+			edges_.clear();
+			edges_.shrink_to_fit();
+
+			for (NodeId idx = 0; idx < nodes_num; idx++)
+			{
+				Node& node = nodes_[idx];
+				if (!node.prerequires_num)
+				{
+					roots_.push_back(idx);
+				}
+				BaseTask& task = TaskSystem::CreateTaskChain(1, node.flags);
+				assert(!task.NextInChain());
+				node.task = TRefCountPtr<BaseTask>(&task, false); // CreateTaskChain added the reference
+				task.GetGate().ResetStateOnEmpty(ETaskState::Done);
+			}
+			assert(nodes_num == 0 || !roots_.empty()); // a cycle otherwise
+			DEBUG_CODE(AssertAcyclic();)
+
+			pending_ = std::make_unique<std::atomic<uint16>[]>(nodes_num);
+			done_ = TaskSystem::MakeFuture<>();
+			done_->Done();
+		}
+
+		bool IsCompiled() const { return !!done_; }
+
+		// Executes all nodes. The returned future is done, when all nodes are done. It can be awaited.
+		// The same future is re-armed by the next Run.
+		TRefCountPtr<Future<>> Run()
+		{
+			assert(IsCompiled());
+			WaitForPreviousRun();
+			const NodeId nodes_num = static_cast<NodeId>(nodes_.size());
+			if (!nodes_num)
+			{
+				return done_;
+			}
+
+			[[maybe_unused]] const ETaskState done_state = done_->GetGate().ResetStateOnEmpty(ETaskState::PendingOrExecuting, true);
+			assert(done_state == ETaskState::Done);
+			remaining_.store(nodes_num, std::memory_order_relaxed);
+			for (NodeId idx = 0; idx < nodes_num; idx++)
+			{
+				Node& node = nodes_[idx];
+				pending_[idx].store(node.prerequires_num, std::memory_order_relaxed);
+				BaseTask& task = *node.task;
+				[[maybe_unused]] const ETaskState old_state = task.GetGate().ResetStateOnEmpty(ETaskState::PendingOrExecuting);
+				assert(old_state == ETaskState::Done);
+				task.Payload().function_ = [this, idx](BaseTask&)
+					{
+						ExecuteNode(idx);
+					};
+			}
+			for (const NodeId root : roots_)
+			{
+				Submit(root);
+			}
+			return done_;
+		}
+
+	private:
+		struct Node
+		{
+			std::move_only_function<void()> functor;
+			ETaskFlags flags = ETaskFlags::None;
+			uint16 prerequires_num = 0;
+			uint32 first_successor = 0; // in successors_
+			uint32 successors_num = 0;
+			TRefCountPtr<BaseTask> task;
+		};
+
+		void Submit(NodeId idx)
+		{
+			// The reference is released by the worker after the execution
+			TaskSystem::OnReadyToExecute(TRefCountPtr<BaseTask>(nodes_[idx].task.Get()));
+		}
+
+		void ExecuteNode(NodeId idx)
+		{
+			Node& node = nodes_[idx];
+			node.functor();
+			for (uint32 successor_idx = node.first_successor; successor_idx < node.first_successor + node.successors_num; successor_idx++)
+			{
+				const NodeId successor = successors_[successor_idx];
+				if (pending_[successor].fetch_sub(1, std::memory_order_acq_rel) == 1)
+				{
+					Submit(successor);
+				}
+			}
+			if (remaining_.fetch_sub(1, std::memory_order_acq_rel) == 1)
+			{
+				done_->Done();
+			}
+		}
+
+		// Done future is unblocked from the last node's function, before the workers release the tasks.
+		void WaitForPreviousRun()
+		{
+			if (done_)
+			{
+				while (done_->IsPendingOrExecuting())
+				{
+					std::this_thread::yield();
+				}
+			}
+			for (Node& node : nodes_)
+			{
+				while (node.task && (node.task->GetRefCount() > 1))
+				{
+					std::this_thread::yield();
+				}
+			}
+		}
+
+#if !defined(NDEBUG)
+		void AssertAcyclic() const
+		{
+			std::vector<uint16> prerequires(nodes_.size());
+			std::vector<NodeId> ready(roots_.begin(), roots_.end());
+			std::size_t visited = 0;
+			while (!ready.empty())
+			{
+				const Node& node = nodes_[ready.back()];
+				ready.pop_back();
+				visited++;
+				for (uint32 successor_idx = node.first_successor; successor_idx < node.first_successor + node.successors_num; successor_idx++)
+				{
+					const NodeId successor = successors_[successor_idx];
+					if (++prerequires[successor] == nodes_[successor].prerequires_num)
+					{
+						ready.push_back(successor);
+					}
+				}
+			}
+			assert(visited == nodes_.size());
+		}
+#endif
+
+		std::vector<Node> nodes_;
+		std::vector<std::pair<NodeId, NodeId>> edges_; // only before Compile
+		std::vector<NodeId> successors_;
+		std::vector<NodeId> roots_;
+		std::unique_ptr<std::atomic<uint16>[]> pending_; // prerequisites not done yet, per node
+		std::atomic<uint32> remaining_ = 0; // nodes not done yet
+		TRefCountPtr<Future<>> done_;
+	};
+}
@@ -0,0 +1,159 @@
+#pragma once
+
+#include "Task.h"
+#include <mutex>
+
+namespace ts
+{
+	// Waits for a subset of tasks and coroutines, unlike TaskSystem::WaitForAllTasks.
+	// The group is done, when its in-flight counter drops to zero. It can be reused: the next Add starts a new generation.
+	// Only the transitions from and to zero take the lock, other changes are a single CAS.
+	// A std::mutex (not SpinMutex), so the group can be destroyed right after the last Done unlocks it.
+	// co_await group, group.Then(...) and group.Wait() wait for the current generation.
+	class TaskGroup
+	{
+	public:
+		// Group member, while it exists. Can be passed by value to a coroutine, so the group waits for the frame.
+		class Membership
+		{
+		public:
+			Membership() = default;
+			Membership(Membership&& moved)
+				: group_(moved.group_)
+			{
+				moved.group_ = nullptr;
+			}
+			Membership(const Membership&) = delete;
+			Membership& operator=(const Membership&) = delete;
+			Membership& operator=(Membership&&) = delete;
+
+			~Membership()
+			{
+				if (group_)
+				{
+					group_->Done();
+				}
+			}
+
+		private:
+			friend class TaskGroup;
+			explicit Membership(TaskGroup& group)
+				: group_(&group)
+			{}
+
+			TaskGroup* group_ = nullptr;
+		};
+
+		TaskGroup()
+			: done_(TaskSystem::MakeFuture<>())
+		{
+			done_->Done();
+		}
+
+		TaskGroup(TaskGroup&&) = delete;
+		TaskGroup(const TaskGroup&) = delete;
+		TaskGroup& operator=(TaskGroup&&) = delete;
+		TaskGroup& operator=(const TaskGroup&) = delete;
+
+		// Waits until the last Done leaves the lock
+		~TaskGroup()
+		{
+			std::lock_guard lock(mutex_);
+			assert(!in_flight_.load(std::memory_order_relaxed));
+		}
+
+		// The task is a member until its functor is destroyed - after its gate is done, also when it was cancelled.
+		template<class F>
+		auto Run(F&& functor, std::span<Gate*> prerequiers = {}, ETaskFlags flags = ETaskFlags::None LOCATION_PARAM)
+		{
+			using ResultType = decltype(std::invoke(functor));
+			return TaskSystem::InitializeTask([function = std::forward<F>(functor), membership = Join()]() mutable -> ResultType
+				{
+					return std::invoke(function);
+				}, prerequiers, flags LOCATION_PASS);
+		}
+
+		Membership Join()
+		{
+			Add(1);
+			return Membership(*this);
+		}
+
+		void Add(uint32 num)
+		{
+			assert(num);
+			uint32 in_flight = in_flight_.load(std::memory_order_relaxed);
+			while (in_flight)
+			{
+				if (in_flight_.compare_exchange_weak(in_flight, in_flight + num, std::memory_order_relaxed))
+				{
+					return;
+				}
+			}
+			std::lock_guard lock(mutex_);
+			if (!in_flight_.fetch_add(num, std::memory_order_relaxed))
+			{
+				assert(!done_->IsPendingOrExecuting());
+				done_ = TaskSystem::MakeFuture<>(); // a new generation
+			}
+		}
+
+		void Done()
+		{
+			uint32 in_flight = in_flight_.load(std::memory_order_relaxed);
+			while (in_flight > 1)
+			{
+				if (in_flight_.compare_exchange_weak(in_flight, in_flight - 1, std::memory_order_release, std::memory_order_relaxed))
+				{
+					return;
+				}
+			}
+			std::lock_guard lock(mutex_);
+			const uint32 before = in_flight_.fetch_sub(1, std::memory_order_acq_rel);
+			assert(before);
+			if (before == 1)
+			{
+				// Under the lock, so the next generation does not start before the future is done
+				done_->Done();
+				generation_.fetch_add(1, std::memory_order_release);
+				generation_.notify_all();
+			}
+		}
+
+		bool IsDone() const
+		{
+			return !in_flight_.load(std::memory_order_acquire);
+		}
+
+		// Done when the current generation is done
+		TRefCountPtr<Future<>> GetFuture()
+		{
+			std::lock_guard lock(mutex_);
+			return done_;
+		}
+
+		template<typename F>
+		auto Then(F&& function, ETaskFlags flags = ETaskFlags::None LOCATION_PARAM)
+		{
+			assert(!enum_has_any(flags, ETaskFlags::TryExecuteImmediate));
+			return GetFuture()->Then(std::forward<F>(function), flags LOCATION_PASS);
+		}
+
+		// For threads that are not workers. The thread is parked (std::atomic::wait), it does not spin.
+		void Wait()
+		{
+			assert(!BaseTask::GetCurrentTask());
+			const uint32 generation = generation_.load(std::memory_order_acquire);
+			if (!IsDone())
+			{
+				generation_.wait(generation, std::memory_order_acquire);
+			}
+		}
+
+	private:
+		std::atomic<uint32> in_flight_ = 0;
+		std::atomic<uint32> generation_ = 0; // bumped, when in_flight_ drops to zero
+		std::mutex mutex_;
+		TRefCountPtr<Future<>> done_; // of the current generation
+	};
+}
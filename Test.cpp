@@ -3,10 +3,15 @@
 #include "Test.h"
 #include "AccessSynchronizer.h"
 #include "TickSync.h"
+#include "Topology.h"
+#include "TaskGraph.h"
+#include "RecurringTask.h"
 #include <array>
 #include <chrono>
+#include <optional>
 #include <iostream>
 #include <vector>
+#include <string>
 #include "InplaceString.h"
 
 #if TEST_MAIN
@@ -17,6 +22,29 @@
 #define SYNCH_TEST 1
 #define TICK_TEST 1
 #define GENERATOR_TEST 0
+#define WORK_STEALING_TEST 1
+#define LATENCY_TEST 1
+#define PRIORITY_TEST 1
+#define THREAD_SCALING_TEST 1
+#define NUMA_TEST 1
+#define BULK_TEST 1
+#define PARALLEL_FOR_TEST 1
+#define TASK_GRAPH_TEST 1
+#define FAN_OUT_TEST 1
+#define TIMER_TEST 1
+#define CANCELLATION_TEST 1
+#define RECURRING_TEST 1
+#define TASK_GROUP_TEST 1
+#define BLOCKING_WAIT_TEST 1
+#define FUNCTOR_STORAGE_TEST 1
+#define FALSE_SHARING_TEST 1
+#define POOL_GROWTH_TEST 1
+#define POOL_EXHAUSTION_TEST 1
+#define EXTERNAL_THREAD_TEST 1
+#define POOL_MAGAZINE_TEST 1
+#define STACK_CONTENTION_TEST 1
+#define SHARED_OVERFLOW_TEST 1
+#define FRAME_ALLOCATOR_TEST 1
 
 using namespace std::chrono_literals;
 
@@ -24,7 +52,7 @@ std::atomic_int32_t counter = 0;
 
 using namespace ts;
 
-TDetachCoroutine CoroutineTest(int32 in_val)
+TDetachCoroutine CoroutineTest(int32 in_val, [[maybe_unused]] TaskGroup::Membership membership = {})
 {
 	TRefCountPtr<Future<int32>> async_task = TaskSystem::InitializeTask([]() -> int32
 		{
@@ -86,13 +114,33 @@ public:
 	{
 		debug_data_.push_back(DebugData{ 
 			t_worker_thread_idx, 
-			static_cast<int32>(std::distance(BaseTask::GetPoolSpan().data(), BaseTask::GetCurrentTask()))
+			static_cast<int32>(GetPoolIndex(*BaseTask::GetCurrentTask()).RawValue())
 		});
 	}
 };
 
 std::atomic<uint64> global_counter = 0;
 
+#if STACK_CONTENTION_TEST
+struct SweepNode
+{
+	static const PoolSegmentTable& GetPoolSegments();
+	BaseIndex<SweepNode> next_;
+	BaseIndex<SweepNode>& NextRef() { return next_; }
+};
+constexpr std::size_t kSweepNodesNum = 1024;
+Pool<SweepNode, kSweepNodesNum> sweep_pool;
+const PoolSegmentTable& SweepNode::GetPoolSegments()
+{
+	return sweep_pool.GetSegments();
+}
+
+struct SweepPointerNode
+{
+	SweepPointerNode* next_ = nullptr;
+};
+#endif
+
 int main()
 {
 	std::cout << "sizeof(AccessSynchronizer::State) : " << sizeof(AccessSynchronizer::State) << " is_lock_free " << std::atomic<AccessSynchronizer::State>{}.is_lock_free() << std::endl;
@@ -107,6 +155,13 @@ int main()
 			TaskSystem::WaitForAllTasks();
 		};
 
+	auto RestartWorkerThreads = [](uint16 num_threads, SchedulerSettings settings)
+		{
+			TaskSystem::StopWorkerThreadsNoWait();
+			TaskSystem::WaitForWorkerThreadsToJoin();
+			TaskSystem::StartWorkerThreads(num_threads, settings);
+		};
+
 	auto LambdaProduce = []() -> std::string
 		{
 			counter.fetch_add(1, std::memory_order_relaxed);
@@ -369,6 +424,1371 @@ int main()
 			});
 	}
 #endif
+#if WORK_STEALING_TEST
+	{
+		// Tasks spawned from worker threads, so the local deques are exercised.
+		auto LambdaSpawn = [&]()
+			{
+				for (int32 idx = 0; idx < 8; idx++)
+				{
+					TaskSystem::InitializeTask(LambdaEmpty);
+				}
+			};
+		for (const bool work_stealing : { false, true })
+		{
+			for (const uint16 num_threads : { 4, 8, 16, 32 })
+			{
+				RestartWorkerThreads(num_threads, SchedulerSettings{ .work_stealing = work_stealing });
+				const std::string name = std::string(work_stealing ? "Work stealing " : "Global stack ") 
+					+ std::to_string(num_threads) + " workers";
+				PerformTest([&](uint32)
+					{
+						TaskSystem::InitializeTask(LambdaSpawn);
+					}, TestDetails
+					{
+						.num_per_body = 9,
+						.name = name.c_str(),
+						.included_cleanup = WaitForTasks
+					});
+			}
+		}
+	}
+#endif
+#if THREAD_SCALING_TEST
+	{
+		// The per-thread pool caches are sized at start. Their hit ratio should not depend on the number of workers.
+		auto LambdaSpawn = [&]()
+			{
+				for (int32 idx = 0; idx < 8; idx++)
+				{
+					TaskSystem::InitializeTask(LambdaEmpty);
+				}
+			};
+		for (const uint16 num_threads : { 4, 8, 16, 32, 0 })
+		{
+			RestartWorkerThreads(num_threads, SchedulerSettings{});
+			TaskSystem::GetTaskPoolCacheStats(true);
+			const std::string name = std::to_string(TaskSystem::GetWorkerThreadsNum()) 
+				+ (num_threads ? " workers" : " workers (default)");
+			PerformTest([&](uint32)
+				{
+					TaskSystem::InitializeTask(LambdaSpawn);
+				}, TestDetails
+				{
+					.num_per_body = 9,
+					.name = name.c_str(),
+					.included_cleanup = WaitForTasks
+				});
+			const PoolCacheStats stats = TaskSystem::GetTaskPoolCacheStats();
+			const uint64 acquires = stats.thread_cache_acquires + stats.global_acquires;
+			const uint64 returns = stats.thread_cache_returns + stats.global_returns;
+			std::cout << "\t thread cache acquires: " << (acquires ? (100.0 * stats.thread_cache_acquires / acquires) : 0.0)
+				<< "% returns: " << (returns ? (100.0 * stats.thread_cache_returns / returns) : 0.0) << "%"
+				<< " global stack operations: " << stats.GetGlobalStackOperations() << std::endl;
+		}
+		RestartWorkerThreads(0, SchedulerSettings{});
+	}
+#endif
+#if NUMA_TEST
+	{
+		const CpuTopology& topology = CpuTopology::Get();
+		std::cout << "Topology: " << topology.GetCpus().size() << " cpus, " << topology.GetNumaNodesNum() << " numa nodes" << std::endl;
+		auto LambdaSpawn = [&]()
+			{
+				for (int32 idx = 0; idx < 8; idx++)
+				{
+					TaskSystem::InitializeTask(LambdaEmpty);
+				}
+			};
+		for (const bool numa_aware : { false, true })
+		{
+			RestartWorkerThreads(0, SchedulerSettings{ .pin_workers = numa_aware, .numa_aware_stealing = numa_aware });
+			const char* name = numa_aware ? "Pinned, numa aware stealing" : "Not pinned, random stealing";
+			PerformTest([&](uint32)
+				{
+					TaskSystem::InitializeTask(LambdaSpawn);
+				}, TestDetails
+				{
+					.num_per_body = 9,
+					.name = name,
+					.included_cleanup = WaitForTasks
+				});
+			const SchedulerStats stats = TaskSystem::GetSchedulerStats();
+			std::cout << "\t steals local: " << stats.local_steals << " remote (cross node): " << stats.remote_steals << std::endl;
+		}
+		RestartWorkerThreads(0, SchedulerSettings{});
+	}
+#endif
+#if BULK_TEST
+	{
+		// Like AntHill startup: many tasks or coroutines submitted at once. Submission time only.
+		constexpr uint32 kBulkNum = 1024;
+		std::array<uint32, kBulkNum> elements{};
+		auto LambdaElement = [](uint32)
+			{
+				counter.fetch_add(1, std::memory_order_relaxed);
+			};
+		auto Coroutine = []() -> TDetachCoroutine
+			{
+				counter.fetch_add(1, std::memory_order_relaxed);
+				co_return;
+			};
+		std::vector<DetachHandle> handles;
+		handles.reserve(kBulkNum);
+		auto CreateCoroutines = [&]()
+			{
+				handles.clear();
+				for (uint32 idx = 0; idx < kBulkNum; idx++)
+				{
+					handles.emplace_back(Coroutine());
+				}
+			};
+
+		PerformTest([&](uint32)
+			{
+				for (uint32 element : elements)
+				{
+					TaskSystem::InitializeTask([&LambdaElement, element]() { LambdaElement(element); });
+				}
+			}, TestDetails
+			{
+				.inner_num = 1,
+				.num_per_body = kBulkNum,
+				.name = "InitializeTask loop",
+				.excluded_cleanup = WaitForTasks
+			});
+
+		PerformTest([&](uint32)
+			{
+				TaskSystem::InitializeTasks(elements, LambdaElement);
+			}, TestDetails
+			{
+				.inner_num = 1,
+				.num_per_body = kBulkNum,
+				.name = "InitializeTasks",
+				.excluded_cleanup = WaitForTasks
+			});
+
+		PerformTest([&](uint32)
+			{
+				for (DetachHandle& handle : handles)
+				{
+					TaskSystem::AsyncResume(std::move(handle));
+				}
+			}, TestDetails
+			{
+				.inner_num = 1,
+				.num_per_body = kBulkNum,
+				.name = "AsyncResume loop",
+				.excluded_initialization = CreateCoroutines,
+				.excluded_cleanup = WaitForTasks
+			});
+
+		PerformTest([&](uint32)
+			{
+				TaskSystem::AsyncResumeMany(handles);
+			}, TestDetails
+			{
+				.inner_num = 1,
+				.num_per_body = kBulkNum,
+				.name = "AsyncResumeMany",
+				.excluded_initialization = CreateCoroutines,
+				.excluded_cleanup = WaitForTasks
+			});
+	}
+#endif
+#if PARALLEL_FOR_TEST
+	{
+		constexpr uint32 kTinyNum = 64 * 1024;
+		constexpr uint32 kChunk = 1024;
+		std::atomic<uint32> processed = 0;
+		auto TinyBody = [&](uint32)
+			{
+				processed.fetch_add(1, std::memory_order_relaxed);
+			};
+		auto CheckProcessed = [&](uint32 expected)
+			{
+				return [&, expected]()
+					{
+						TaskSystem::WaitForAllTasks();
+						assert(processed == expected);
+						processed = 0;
+					};
+			};
+
+		PerformTest([&](uint32)
+			{
+				for (uint32 chunk_begin = 0; chunk_begin < kTinyNum; chunk_begin += kChunk)
+				{
+					TaskSystem::InitializeTask([&, chunk_begin]()
+						{
+							for (uint32 idx = chunk_begin; idx < chunk_begin + kChunk; idx++)
+							{
+								TinyBody(idx);
+							}
+						});
+				}
+			}, TestDetails
+			{
+				.inner_num = 1,
+				.outer_num = 64,
+				.num_per_body = kTinyNum,
+				.name = "Tiny body, fixed chunks",
+				.included_cleanup = CheckProcessed(kTinyNum)
+			});
+
+		for (const uint32 grain : { 64u, 1024u })
+		{
+			const std::string name = "Tiny body, ParallelFor grain " + std::to_string(grain);
+			PerformTest([&](uint32)
+				{
+					TaskSystem::ParallelFor(0u, kTinyNum, TinyBody, grain);
+				}, TestDetails
+				{
+					.inner_num = 1,
+					.outer_num = 64,
+					.num_per_body = kTinyNum,
+					.name = name.c_str(),
+					.included_cleanup = CheckProcessed(kTinyNum)
+				});
+		}
+
+		constexpr uint32 kLargeNum = 512;
+		auto LargeBody = [&](uint32 index)
+			{
+				volatile float value = static_cast<float>(index);
+				for (int32 iter = 0; iter < 2048; iter++)
+				{
+					value = value * 0.999f + 1.0f;
+				}
+				processed.fetch_add(1, std::memory_order_relaxed);
+			};
+		PerformTest([&](uint32)
+			{
+				TaskSystem::ParallelFor(0u, kLargeNum, LargeBody);
+			}, TestDetails
+			{
+				.inner_num = 1,
+				.outer_num = 64,
+				.num_per_body = kLargeNum,
+				.name = "Large body, ParallelFor",
+				.included_cleanup = CheckProcessed(kLargeNum)
+			});
+
+		std::vector<uint32> elements(kTinyNum, 1);
+		PerformTest([&](uint32)
+			{
+				TaskSystem::AsyncResume([](std::span<uint32> elements) -> TDetachCoroutine
+					{
+						co_await TaskSystem::ParallelForEach(elements, [](uint32& element) { element++; }, 256);
+						co_await TaskSystem::ParallelForEach(elements, [](uint32& element) { element--; }, 256)->Then([]() {});
+					}(elements));
+			}, TestDetails
+			{
+				.inner_num = 1,
+				.outer_num = 64,
+				.num_per_body = 2 * kTinyNum,
+				.name = "ParallelForEach awaited",
+				.included_cleanup = WaitForTasks
+			});
+		assert(std::ranges::all_of(elements, [](uint32 element) { return element == 1; }));
+	}
+#endif
+#if TASK_GRAPH_TEST
+	{
+		// A frame: kLayers x kWidth nodes, each node depends on two nodes of the previous layer
+		constexpr uint16 kLayers = 8;
+		constexpr uint16 kWidth = 32;
+		TaskGraph graph;
+		std::vector<TaskGraph::NodeId> node_ids;
+		for (uint16 layer = 0; layer < kLayers; layer++)
+		{
+			for (uint16 column = 0; column < kWidth; column++)
+			{
+				const TaskGraph::NodeId node = graph.AddNode(LambdaEmpty);
+				if (layer)
+				{
+					graph.AddEdge(node_ids[(layer - 1) * kWidth + column], node);
+					graph.AddEdge(node_ids[(layer - 1) * kWidth + (column + 1) % kWidth], node);
+				}
+				node_ids.push_back(node);
+			}
+		}
+		graph.Compile();
+
+		PerformTest([&](uint32)
+			{
+				std::array<TRefCountPtr<Future<>>, kWidth> previous;
+				std::array<TRefCountPtr<Future<>>, kWidth> current;
+				for (uint16 layer = 0; layer < kLayers; layer++)
+				{
+					for (uint16 column = 0; column < kWidth; column++)
+					{
+						if (layer)
+						{
+							Gate* prerequires[] = { &previous[column]->GetGate(), &previous[(column + 1) % kWidth]->GetGate() };
+							current[column] = TaskSystem::InitializeTask(LambdaEmpty, prerequires);
+						}
+						else
+						{
+							current[column] = TaskSystem::InitializeTask(LambdaEmpty);
+						}
+					}
+					std::swap(previous, current);
+				}
+			}, TestDetails
+			{
+				.inner_num = 1,
+				.outer_num = 1024,
+				.num_per_body = kLayers * kWidth,
+				.name = "Frame as task dependencies",
+				.included_cleanup = WaitForTasks
+			});
+
+		PerformTest([&](uint32)
+			{
+				graph.Run();
+			}, TestDetails
+			{
+				.inner_num = 1,
+				.outer_num = 1024,
+				.num_per_body = kLayers * kWidth,
+				.name = "Frame as TaskGraph replay",
+				.included_cleanup = WaitForTasks
+			});
+
+		PerformTest([&](uint32)
+			{
+				TaskSystem::AsyncResume([](TaskGraph& graph) -> TDetachCoroutine
+					{
+						co_await graph.Run();
+					}(graph));
+			}, TestDetails
+			{
+				.inner_num = 1,
+				.outer_num = 1024,
+				.num_per_body = kLayers * kWidth,
+				.name = "TaskGraph awaited",
+				.included_cleanup = WaitForTasks
+			});
+	}
+#endif
+#if FAN_OUT_TEST
+	{
+		// One gate unblocks many dependents. A single worker, so 8000 dependents fit in the pools 
+		// (other workers' pool caches would hold a part of the task pool).
+		RestartWorkerThreads(1, SchedulerSettings{});
+		for (const uint32 dependents_num : { 10u, 1000u, 8000u })
+		{
+			TimeSpan unblock_time{};
+			const uint32 outer_num = (dependents_num > 1000) ? 32 : 128;
+			const std::string name = "Fan-out " + std::to_string(dependents_num);
+			PerformTest([&](uint32)
+				{
+					TaskSystem::InitializeTask([&]()
+						{
+							TRefCountPtr<Future<>> source = TaskSystem::MakeFuture<>();
+							Gate* prerequires[] = { &source->GetGate() };
+							for (uint32 idx = 0; idx < dependents_num; idx++)
+							{
+								TaskSystem::InitializeTask(LambdaEmpty, prerequires);
+							}
+							const TimeType unblock_start = GetTime();
+							source->Done();
+							unblock_time += GetTime() - unblock_start;
+						});
+				}, TestDetails
+				{
+					.inner_num = 1,
+					.outer_num = outer_num,
+					.num_per_body = dependents_num,
+					.name = name.c_str(),
+					.included_cleanup = WaitForTasks
+				});
+			std::cout << "\t unblock per dependent: " << (static_cast<double>(unblock_time.count()) / (outer_num * dependents_num)) << " ns" << std::endl;
+		}
+		RestartWorkerThreads(0, SchedulerSettings{});
+	}
+#endif
+#if TIMER_TEST
+	{
+		// 100K timers outstanding at once. Delays spread over 16 ms, after 100 ms - longer than the insertion takes.
+		constexpr uint32 kTimersNum = 100'000;
+		constexpr uint32 kRounds = 4;
+		static_assert(kTimersNum < kTaskPoolMaxSize);
+		LatencyReporter lateness("Timer lateness", kTimersNum * kRounds);
+		std::atomic<uint32> fired = 0;
+		uint32 min_outstanding = kTimersNum;
+		uint32 seed = 12345;
+		PerformTest([&](uint32)
+			{
+				seed = seed * 1664525u + 1013904223u;
+				const TimerClock::time_point deadline = TimerClock::now() + 100ms + std::chrono::microseconds(seed % 16000);
+				TaskSystem::InitializeTaskAt(deadline, [&lateness, &fired, deadline]()
+					{
+						lateness.add(TimerClock::now() - deadline);
+						fired.fetch_add(1, std::memory_order_relaxed);
+					});
+			}, TestDetails
+			{
+				.inner_num = kTimersNum,
+				.outer_num = kRounds,
+				.name = "Timers insertion, 100K outstanding",
+				.excluded_cleanup = [&]()
+					{
+						min_outstanding = std::min(min_outstanding, kTimersNum - fired.load(std::memory_order_relaxed));
+						WaitForTasks();
+						fired = 0;
+					}
+			});
+		lateness.display();
+		std::cout << "Outstanding timers after the insertion, min: " << min_outstanding << " of " << kTimersNum << std::endl;
+
+		{
+			// Deadlines far in the future: past 32-bit millisecond ticks, and time_point::max (clamped, see kMaxTimerDelay).
+			// They must not fire early. Cancelled, they are dropped from the wheel within its turn.
+			CancellationSource source;
+			std::atomic<uint32> executed = 0;
+			TRefCountPtr<Future<>> far_tasks[3];
+			{
+				CancellationScope scope(source.GetToken());
+				far_tasks[0] = TaskSystem::InitializeTaskAfter(std::chrono::hours(24 * 60), [&executed]() { executed++; });
+				far_tasks[1] = TaskSystem::InitializeTaskAt(TimerClock::time_point::max(), [&executed]() { executed++; });
+				far_tasks[2] = TaskSystem::InitializeTaskAfter(TimerClock::duration::max(), [&executed]() { executed++; });
+			}
+			TRefCountPtr<Future<>> near_task = TaskSystem::InitializeTaskAfter(2ms, LambdaEmpty);
+			near_task->Wait(EWaitMode::Park);
+			std::this_thread::sleep_for(2ms);
+			for (TRefCountPtr<Future<>>& task : far_tasks)
+			{
+				assert(task->IsPendingOrExecuting());
+			}
+			source.Cancel();
+			const TimerClock::time_point cancel_time = TimerClock::now();
+			WaitForTasks();
+			for (TRefCountPtr<Future<>>& task : far_tasks)
+			{
+				assert(task->IsCancelled());
+			}
+			assert(!executed);
+			std::cout << "Far deadlines cancelled, drained in: "
+				<< std::chrono::duration_cast<std::chrono::milliseconds>(TimerClock::now() - cancel_time).count() << " ms" << std::endl;
+		}
+
+		PerformTest([&](uint32)
+			{
+				TaskSystem::AsyncResume([]() -> TDetachCoroutine
+					{
+						for (int32 idx = 0; idx < 4; idx++)
+						{
+							co_await Delay{ std::chrono::microseconds(500) };
+							global_counter++;
+						}
+					}());
+			}, TestDetails
+			{
+				.inner_num = 1024,
+				.outer_num = 8,
+				.num_per_body = 4,
+				.name = "Coroutine Delay",
+				.included_cleanup = WaitForTasks
+			});
+	}
+#endif
+#if CANCELLATION_TEST
+	{
+		// A layered graph of 100K tasks blocked by a root future, all pending at once.
+		// Measured from releasing the root, until all tasks are drained.
+		constexpr uint16 kWidth = 32;
+		constexpr uint16 kLayers = 3125;
+		constexpr uint32 kRounds = 4;
+		static_assert(kWidth * kLayers < kTaskPoolMaxSize);
+		auto LambdaWork = []()
+			{
+				uint64 value = 0;
+				for (uint32 idx = 0; idx < 256; idx++)
+				{
+					value += idx * idx;
+				}
+				global_counter.fetch_add(value & 1, std::memory_order_relaxed);
+			};
+		TRefCountPtr<Future<>> root;
+		std::optional<CancellationSource> source;
+		auto BuildGraph = [&]()
+			{
+				root = TaskSystem::MakeFuture<>();
+				source.emplace();
+				CancellationScope scope(source->GetToken());
+				std::array<TRefCountPtr<Future<>>, kWidth> previous;
+				std::array<TRefCountPtr<Future<>>, kWidth> current;
+				for (uint16 layer = 0; layer < kLayers; layer++)
+				{
+					for (uint16 column = 0; column < kWidth; column++)
+					{
+						if (layer)
+						{
+							Gate* prerequires[] = { &previous[column]->GetGate(), &previous[(column + 1) % kWidth]->GetGate() };
+							current[column] = TaskSystem::InitializeTask(LambdaWork, prerequires);
+						}
+						else
+						{
+							Gate* prerequires[] = { &root->GetGate() };
+							current[column] = TaskSystem::InitializeTask(LambdaWork, prerequires);
+						}
+					}
+					std::swap(previous, current);
+				}
+			};
+
+		enum class EDrain { Execute, CancelToken, CancelRoot };
+		for (const EDrain drain : { EDrain::Execute, EDrain::CancelToken, EDrain::CancelRoot })
+		{
+			const char* name = (drain == EDrain::Execute) ? "Graph 100K executed"
+				: ((drain == EDrain::CancelToken) ? "Graph 100K cancelled by token" : "Graph 100K cancelled root");
+			PerformTest([&](uint32)
+				{
+					switch (drain)
+					{
+					case EDrain::Execute: root->Done(); break;
+					case EDrain::CancelToken: source->Cancel(); root->Done(); break;
+					case EDrain::CancelRoot: root->Cancel(); break;
+					}
+					root = nullptr;
+				}, TestDetails
+				{
+					.inner_num = 1,
+					.outer_num = kRounds,
+					.num_per_body = kLayers * kWidth,
+					.name = name,
+					.excluded_initialization = BuildGraph,
+					.included_cleanup = WaitForTasks
+				});
+		}
+
+		std::atomic<uint32> cancelled_results = 0;
+		PerformTest([&](uint32)
+			{
+				TRefCountPtr<Future<int32>> future = TaskSystem::MakeFuture<int32>();
+				TaskSystem::AsyncResume([](TRefCountPtr<Future<int32>> future, std::atomic<uint32>& cancelled_results) -> TDetachCoroutine
+					{
+						const std::optional<int32> result = co_await AwaitCancellable(std::move(future));
+						if (!result)
+						{
+							cancelled_results++;
+						}
+					}(future, cancelled_results));
+				future->Cancel();
+			}, TestDetails
+			{
+				.inner_num = 1024,
+				.outer_num = 8,
+				.name = "Coroutine awaiting cancelled future",
+				.included_cleanup = WaitForTasks
+			});
+		assert(cancelled_results == 1024 * 8);
+
+		// A future without a result: AwaitCancellable returns false, a plain co_await resumes as well
+		cancelled_results = 0;
+		PerformTest([&](uint32)
+			{
+				TRefCountPtr<Future<>> future = TaskSystem::MakeFuture<>();
+				TaskSystem::AsyncResume([](TRefCountPtr<Future<>> future, std::atomic<uint32>& cancelled_results) -> TDetachCoroutine
+					{
+						TRefCountPtr<Future<>> same_future = future;
+						const bool done = co_await AwaitCancellable(std::move(future));
+						co_await std::move(same_future);
+						if (!done)
+						{
+							cancelled_results++;
+						}
+					}(future, cancelled_results));
+				future->Cancel();
+			}, TestDetails
+			{
+				.inner_num = 1024,
+				.outer_num = 8,
+				.name = "Coroutine awaiting cancelled void future",
+				.included_cleanup = WaitForTasks
+			});
+		assert(cancelled_results == 1024 * 8);
+
+		TRefCountPtr<Future<int32>> cancelled = TaskSystem::MakeFuture<int32>();
+		cancelled->Cancel();
+		const std::optional<int32> blocking_result = cancelled->GetBlocking();
+		assert(!blocking_result);
+		TRefCountPtr<Future<>> cancelled_void = TaskSystem::MakeFuture<>();
+		cancelled_void->Cancel();
+		const bool blocking_done = cancelled_void->GetBlocking();
+		assert(!blocking_done);
+	}
+#endif
+#if RECURRING_TEST
+	{
+		auto LambdaCount = []()
+			{
+				global_counter.fetch_add(1, std::memory_order_relaxed);
+			};
+		PerformTest([&](uint32)
+			{
+				TaskSystem::InitializeTask(LambdaCount);
+			}, TestDetails
+			{
+				.inner_num = 4096,
+				.outer_num = 32,
+				.name = "Task per trigger",
+				.included_cleanup = WaitForTasks
+			});
+
+		{
+			RecurringTask recurring(LambdaCount);
+			PerformTest([&](uint32)
+				{
+					recurring.Trigger();
+				}, TestDetails
+				{
+					.inner_num = 4096,
+					.outer_num = 32,
+					.name = "Recurring task Trigger (coalesced)",
+					.included_cleanup = WaitForTasks
+				});
+
+			// A dependent of each iteration, the trigger waits for it
+			PerformTest([&](uint32)
+				{
+					std::atomic<bool> done = false;
+					recurring.Then([&done]() { done.store(true, std::memory_order_release); }, recurring.GetTag());
+					recurring.Trigger();
+					while (!done.load(std::memory_order_acquire))
+					{
+						std::this_thread::yield();
+					}
+				}, TestDetails
+				{
+					.inner_num = 256,
+					.outer_num = 32,
+					.name = "Recurring task iteration with dependent"
+				});
+		}
+
+		{
+			std::atomic<uint32> iterations = 0;
+			const TimeType start = GetTime();
+			{
+				RecurringTask periodic([&iterations]() { iterations++; });
+				periodic.StartPeriodic(std::chrono::milliseconds(1));
+				std::this_thread::sleep_for(std::chrono::milliseconds(64));
+			}
+			const auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(GetTime() - start);
+			std::cout << "Periodic 1 ms task: " << iterations << " iterations in " << elapsed.count() << " ms" << std::endl;
+		}
+
+		{
+			TickSync tick_sync;
+			tick_sync.Initialize({});
+			std::atomic<uint32> iterations = 0;
+			RecurringTask on_frame([&iterations]() { iterations++; });
+			on_frame.StartOnFrames(tick_sync);
+			TaskSystem::AsyncResume([](TickSync& tick_sync, RecurringTask& on_frame) -> TDetachCoroutine
+				{
+					TickScope tick_scope(tick_sync);
+					for (int32 i = 0; i < 64; i++)
+					{
+						if (i == 32)
+						{
+							on_frame.Stop(); // completes on a next frame
+						}
+						co_await Delay{ std::chrono::microseconds(100) }; // the frame work
+						co_await tick_scope.WaitForNextFrame();
+					}
+				}(tick_sync, on_frame));
+			WaitForTasks();
+			std::cout << "Frame task: " << iterations << " iterations in 32 frames" << std::endl;
+		}
+	}
+#endif
+#if TASK_GROUP_TEST
+	{
+		// The same work as "Execute empty test" and "Coroutines complex async", waited by a group instead of WaitForAllTasks
+		TaskGroup group;
+		auto WaitForGroup = [&group]
+			{
+				group.Wait();
+			};
+		PerformTest([&](uint32)
+			{
+				TRefCountPtr<Future<>> A = group.Run(LambdaEmpty);
+				TRefCountPtr<Future<>> B = group.Run(LambdaEmpty);
+				TRefCountPtr<Future<>> C = group.Run(LambdaEmpty);
+
+				Gate* Arr[]{ &A->GetGate(), &B->GetGate(), &C->GetGate() };
+				group.Run(LambdaEmpty, Arr);
+			}, TestDetails
+			{
+				.num_per_body = 4,
+				.name = "Execute empty test, TaskGroup::Wait",
+				.included_cleanup = WaitForGroup
+			});
+
+		PerformTest([&](uint32)
+			{
+				TaskSystem::AsyncResume(CoroutineTest(1, group.Join()));
+			}, TestDetails
+			{
+				.name = "Coroutines complex async, TaskGroup::Wait",
+				.included_cleanup = WaitForGroup,
+			});
+		WaitForTasks();
+		detail::ensure_allocator_free();
+
+		// A task and a coroutine depending on the whole group
+		PerformTest([&](uint32)
+			{
+				TaskGroup inner;
+				for (uint32 idx = 0; idx < 64; idx++)
+				{
+					inner.Run(LambdaEmpty);
+				}
+				group.Run(LambdaEmpty, {}, ETaskFlags::None);
+				std::atomic<bool> then_done = false;
+				inner.Then([&then_done]() { then_done.store(true, std::memory_order_release); });
+				TaskSystem::AsyncResume([](TaskGroup& inner, TaskGroup::Membership) -> TDetachCoroutine
+					{
+						co_await inner;
+						assert(inner.IsDone());
+					}(inner, group.Join()));
+				group.Wait();
+				while (!then_done.load(std::memory_order_acquire))
+				{
+					std::this_thread::yield();
+				}
+			}, TestDetails
+			{
+				.inner_num = 1,
+				.outer_num = 256,
+				.num_per_body = 66,
+				.name = "TaskGroup Then and co_await"
+			});
+		WaitForTasks();
+	}
+#endif
+#if BLOCKING_WAIT_TEST
+	{
+		// Wait-to-wake latency: from Done, called by a worker, until the waiting (main) thread returns from Wait
+		auto LambdaWork = []()
+			{
+				uint64 value = 0;
+				for (uint32 idx = 0; idx < 4096; idx++)
+				{
+					value += idx * idx;
+				}
+				global_counter.fetch_add(value & 1, std::memory_order_relaxed);
+			};
+		for (const EWaitMode mode : { EWaitMode::Help, EWaitMode::Park })
+		{
+			const char* name = (mode == EWaitMode::Help) ? "Future::Wait help" : "Future::Wait park";
+			LatencyReporter wake_latency(name, 256 * 16);
+			PerformTest([&](uint32)
+				{
+					TRefCountPtr<Future<>> future = TaskSystem::MakeFuture<>();
+					TimeType done_time{};
+					TaskSystem::InitializeTask([&done_time, future, &LambdaWork]()
+						{
+							LambdaWork();
+							done_time = GetTime();
+							future->Done();
+						});
+					future->Wait(mode);
+					wake_latency.add(GetTime() - done_time);
+				}, TestDetails
+				{
+					.inner_num = 256,
+					.outer_num = 16,
+					.name = name,
+					.included_cleanup = WaitForTasks
+				});
+			wake_latency.display();
+		}
+
+		// A worker waiting for its children executes them
+		PerformTest([&](uint32)
+			{
+				TaskSystem::InitializeTask([]()
+					{
+						TRefCountPtr<Future<int32>> children[] = {
+							TaskSystem::InitializeTask([]() { return 1; }),
+							TaskSystem::InitializeTask([]() { return 2; }),
+							TaskSystem::InitializeTask([]() { return 3; }) };
+						int32 sum = 0;
+						for (TRefCountPtr<Future<int32>>& child : children)
+						{
+							sum += child->GetBlocking().value();
+						}
+						assert(sum == 6);
+						global_counter.fetch_add(sum, std::memory_order_relaxed);
+					});
+			}, TestDetails
+			{
+				.inner_num = 256,
+				.outer_num = 32,
+				.num_per_body = 4,
+				.name = "GetBlocking in a worker",
+				.included_cleanup = WaitForTasks
+			});
+	}
+#endif
+#if FUNCTOR_STORAGE_TEST
+	{
+		// Task functors up to kTaskFunctorInlineSize are stored in the task, bigger ones spill to the functor slab
+		std::array<uint64, 4> small_capture{ 1, 2, 3, 4 };
+		std::array<uint64, 24> big_capture{};
+		big_capture[0] = 1;
+		static_assert((sizeof(small_capture) <= kTaskFunctorInlineSize) && (sizeof(big_capture) > kTaskFunctorInlineSize));
+		std::cout << "sizeof(BaseTask): " << sizeof(BaseTask) << " sizeof(TaskFunction): " << sizeof(TaskFunction) << std::endl;
+
+		PerformTest([&](uint32)
+			{
+				for (uint32 idx = 0; idx < 8; idx++)
+				{
+					TaskSystem::InitializeTask([small_capture]()
+						{
+							global_counter.fetch_add(small_capture[0], std::memory_order_relaxed);
+						});
+				}
+			}, TestDetails
+			{
+				.num_per_body = 8,
+				.name = "Inline functor",
+				.included_cleanup = WaitForTasks
+			});
+
+		PerformTest([&](uint32)
+			{
+				for (uint32 idx = 0; idx < 8; idx++)
+				{
+					TaskSystem::InitializeTask([big_capture]()
+						{
+							global_counter.fetch_add(big_capture[0], std::memory_order_relaxed);
+						});
+				}
+			}, TestDetails
+			{
+				.num_per_body = 8,
+				.name = "Spilled functor",
+				.included_cleanup = WaitForTasks
+			});
+	}
+#endif
+#if FALSE_SHARING_TEST
+	{
+		// Each of 32 workers updates the refcount and reads the gate of its own task. The tasks are in neighbouring pool slots.
+		// Compared with the slot layout before the hot/cold split: 152 bytes, not aligned to a cache line.
+		constexpr uint32 kSlotsNum = 32;
+		constexpr uint32 kUpdatesNum = 1024;
+		struct PackedSlot
+		{
+			std::atomic<int32> ref_count = 0;
+			std::atomic<uint32> gate = 0;
+			std::byte cold[144];
+		};
+		static_assert(sizeof(PackedSlot) == 152);
+		std::cout << "sizeof(BaseTask): " << sizeof(BaseTask) << " sizeof(TaskPayload): " << sizeof(TaskPayload) << std::endl;
+
+		RestartWorkerThreads(kSlotsNum, SchedulerSettings{});
+		std::vector<PackedSlot> packed(kSlotsNum);
+		TRefCountPtr<Future<>> blocker = TaskSystem::MakeFuture<>();
+		std::vector<TRefCountPtr<Future<>>> tasks;
+		for (uint32 idx = 0; idx < kSlotsNum; idx++)
+		{
+			tasks.push_back(blocker->Then(LambdaEmpty)); // pending, so the slots are not reused
+		}
+
+		TaskGroup group;
+		auto RunOnWorkers = [&](auto update)
+			{
+				for (uint32 slot = 0; slot < kSlotsNum; slot++)
+				{
+					group.Run([slot, &update]()
+						{
+							for (uint32 idx = 0; idx < kUpdatesNum; idx++)
+							{
+								update(slot);
+							}
+						});
+				}
+				group.Wait();
+			};
+
+		PerformTest([&](uint32)
+			{
+				RunOnWorkers([&](uint32 slot)
+					{
+						PackedSlot& packed_slot = packed[slot];
+						packed_slot.ref_count.fetch_add(1, std::memory_order_relaxed);
+						global_counter.fetch_add(packed_slot.gate.load(std::memory_order_relaxed), std::memory_order_relaxed);
+						packed_slot.ref_count.fetch_sub(1, std::memory_order_relaxed);
+					});
+			}, TestDetails
+			{
+				.inner_num = 16,
+				.outer_num = 32,
+				.num_per_body = kSlotsNum * kUpdatesNum,
+				.name = "Neighbour slots, packed 152B",
+			});
+
+		PerformTest([&](uint32)
+			{
+				RunOnWorkers([&](uint32 slot)
+					{
+						Future<>& task = *tasks[slot];
+						task.AddRef();
+						global_counter.fetch_add(task.IsPendingOrExecuting() ? 0 : 1, std::memory_order_relaxed);
+						task.Release();
+					});
+			}, TestDetails
+			{
+				.inner_num = 16,
+				.outer_num = 32,
+				.num_per_body = kSlotsNum * kUpdatesNum,
+				.name = "Neighbour slots, BaseTask",
+			});
+
+		blocker->Done();
+		blocker = nullptr;
+		tasks.clear();
+		TaskSystem::WaitForAllTasks();
+		RestartWorkerThreads(0, SchedulerSettings{});
+	}
+#endif
+#if POOL_GROWTH_TEST
+	{
+		// More pending tasks than kTaskPoolSize. The first run grows the pool by segments, the following ones reuse them.
+		constexpr uint32 kPendingNum = kTaskPoolSize * 4;
+		static_assert(kPendingNum <= kTaskPoolMaxSize);
+		std::cout << "Task pool capacity: " << TaskSystem::GetTaskPoolCapacity() << std::endl;
+		std::vector<TRefCountPtr<Future<>>> pending;
+		pending.reserve(kPendingNum);
+
+		PerformTest([&](uint32)
+			{
+				TRefCountPtr<Future<>> blocker = TaskSystem::MakeFuture<>();
+				for (uint32 idx = 0; idx < kPendingNum; idx++)
+				{
+					pending.push_back(blocker->Then(LambdaEmpty));
+				}
+				blocker->Done();
+				pending.clear();
+			}, TestDetails
+			{
+				.inner_num = 1,
+				.outer_num = 16,
+				.num_per_body = kPendingNum,
+				.name = "Pending tasks over the initial pool",
+				.included_cleanup = WaitForTasks
+			});
+		std::cout << "Task pool capacity: " << TaskSystem::GetTaskPoolCapacity() << std::endl;
+	}
+#endif
+#if POOL_EXHAUSTION_TEST
+	{
+		// Pending tasks hold most of the task pool at its max size, then InitializeTask is flooded beyond kTaskPoolSize
+		constexpr uint32 kFloodNum = kTaskPoolSize * 4;
+		constexpr std::size_t kHeldNum = kTaskPoolMaxSize - kTaskPoolSize;
+		std::atomic<uint32> high_water_calls = 0;
+		std::atomic<uint32> exhausted_calls = 0;
+		TaskGroup group;
+		auto WaitForGroup = [&group]
+			{
+				group.Wait();
+			};
+
+		for (const EPoolExhaustedPolicy policy : { EPoolExhaustedPolicy::HelpExecute, EPoolExhaustedPolicy::ExecuteInline, EPoolExhaustedPolicy::Block })
+		{
+			const char* name = (policy == EPoolExhaustedPolicy::HelpExecute) ? "Flood exhausted pool, help execute"
+				: (policy == EPoolExhaustedPolicy::ExecuteInline) ? "Flood exhausted pool, execute inline"
+				: "Flood exhausted pool, block";
+			RestartWorkerThreads(0, SchedulerSettings
+				{
+					.pool_exhausted_policy = policy,
+					.on_pool_high_water = [&](const PoolPressure& pressure)
+						{
+							(pressure.exhausted ? exhausted_calls : high_water_calls).fetch_add(1, std::memory_order_relaxed);
+						}
+				});
+			high_water_calls = 0;
+			exhausted_calls = 0;
+			const SchedulerStats stats_before = TaskSystem::GetSchedulerStats();
+
+			TRefCountPtr<Future<>> blocker = TaskSystem::MakeFuture<>();
+			std::vector<TRefCountPtr<Future<>>> held;
+			held.reserve(kHeldNum);
+			for (std::size_t idx = 0; idx < kHeldNum; idx++)
+			{
+				held.push_back(blocker->Then(LambdaEmpty));
+			}
+
+			global_counter = 0;
+			PerformTest([&](uint32)
+				{
+					for (uint32 idx = 0; idx < kFloodNum; idx++)
+					{
+						group.Run([]()
+							{
+								global_counter.fetch_add(1, std::memory_order_relaxed);
+							});
+					}
+				}, TestDetails
+				{
+					.inner_num = 1,
+					.outer_num = 8,
+					.num_per_body = kFloodNum,
+					.name = name,
+					.included_cleanup = WaitForGroup
+				});
+			assert(global_counter == kFloodNum * 8);
+			blocker->Done();
+			held.clear();
+			WaitForTasks();
+
+			const SchedulerStats stats = TaskSystem::GetSchedulerStats();
+			std::cout << "Task pool capacity: " << TaskSystem::GetTaskPoolCapacity()
+				<< ", exhausted acquires: " << (stats.exhausted_acquires - stats_before.exhausted_acquires)
+				<< ", inline executions: " << (stats.inline_executions - stats_before.inline_executions)
+				<< ", high water calls: " << high_water_calls << ", exhausted calls: " << exhausted_calls << std::endl;
+		}
+		RestartWorkerThreads(0, SchedulerSettings{});
+	}
+#endif
+#if EXTERNAL_THREAD_TEST
+	{
+		// Submission from the main thread. The dependency nodes are returned by the main thread (it completes the future),
+		// so a registered main thread serves them from its own cache.
+		for (const bool registered : { false, true })
+		{
+			if (registered)
+			{
+				TaskSystem::RegisterExternalThread();
+			}
+			TaskSystem::GetTaskPoolCacheStats(true);
+			PerformTest([&](uint32)
+				{
+					TRefCountPtr<Future<>> future = TaskSystem::MakeFuture<>();
+					for (uint32 idx = 0; idx < 8; idx++)
+					{
+						future->Then(LambdaEmpty);
+					}
+					future->Done();
+				}, TestDetails
+				{
+					.num_per_body = 8,
+					.name = registered ? "Main thread submission, registered" : "Main thread submission, not registered",
+					.included_cleanup = WaitForTasks
+				});
+			const PoolCacheStats stats = TaskSystem::GetTaskPoolCacheStats();
+			std::cout << "Task pool acquires, thread cache: " << stats.thread_cache_acquires << " global: " << stats.global_acquires << std::endl;
+			if (registered)
+			{
+				TaskSystem::UnregisterExternalThread();
+			}
+		}
+	}
+#endif
+#if POOL_MAGAZINE_TEST
+	{
+		// Producer/consumer: a producer task creates tasks executed (and returned to the pool) by other workers.
+		// The producer's cache drains and the consumers' caches overflow, the magazines move them via the global stack.
+		// Build with kPoolMagazineSize = 1 to compare with node by node transfers.
+		constexpr uint32 kProducedNum = 256;
+		RestartWorkerThreads(4, SchedulerSettings{});
+		for (const EPoolKind pool : { EPoolKind::Task, EPoolKind::Future, EPoolKind::DependencyNode })
+		{
+			TaskSystem::GetPoolCacheStats(pool, true);
+		}
+		PerformTest([&](uint32)
+			{
+				TaskSystem::InitializeTask([&]()
+					{
+						TRefCountPtr<Future<>> start = TaskSystem::MakeFuture<>();
+						for (uint32 idx = 0; idx < kProducedNum; idx++)
+						{
+							start->Then(LambdaEmpty, ETaskFlags::Fifo);
+						}
+						start->Done();
+					});
+			}, TestDetails
+			{
+				.inner_num = 16,
+				.outer_num = 64,
+				.num_per_body = kProducedNum + 1,
+				.name = "Producer/consumer pool traffic",
+				.included_cleanup = WaitForTasks
+			});
+		for (const EPoolKind pool : { EPoolKind::Task, EPoolKind::Future, EPoolKind::DependencyNode })
+		{
+			const PoolCacheStats stats = TaskSystem::GetPoolCacheStats(pool);
+			const char* name = (pool == EPoolKind::Task) ? "Task" : (pool == EPoolKind::Future) ? "Future" : "Dependency node";
+			std::cout << name << " pool, global stack operations: " << stats.GetGlobalStackOperations()
+				<< " (refills: " << stats.refills << " of " << stats.refilled_nodes << " nodes, spills: " << stats.spills
+				<< " of " << stats.spilled_nodes << " nodes, single acquires: " << stats.global_acquires
+				<< ", single returns: " << stats.global_returns << ")" << std::endl;
+		}
+		RestartWorkerThreads(0, SchedulerSettings{});
+	}
+#endif
+#if STACK_CONTENTION_TEST
+	{
+		// Threads (not workers) pop a node and push it back. The total number of operations is the same for each thread count.
+		constexpr uint32 kOpsNum = 1024 * 1024;
+		std::vector<SweepNode*> sweep_nodes;
+		for (std::size_t idx = 0; idx < kSweepNodesNum; idx++)
+		{
+			sweep_nodes.push_back(&sweep_pool.Acquire());
+		}
+		std::vector<SweepPointerNode> sweep_pointer_nodes(kSweepNodesNum);
+
+		auto Sweep = [&](auto& stack, auto& nodes, const char* name)
+			{
+				for (auto& node : nodes)
+				{
+					if constexpr (std::is_pointer_v<std::remove_cvref_t<decltype(node)>>)
+					{
+						stack.Push(*node);
+					}
+					else
+					{
+						stack.Push(node);
+					}
+				}
+				for (const uint32 threads_num : { 1, 2, 4, 8, 16, 32 })
+				{
+					std::atomic<bool> start = false;
+					std::vector<std::thread> threads;
+					for (uint32 thread_idx = 0; thread_idx < threads_num; thread_idx++)
+					{
+						threads.emplace_back([&]()
+							{
+								while (!start.load(std::memory_order_acquire))
+								{
+									std::this_thread::yield();
+								}
+								for (uint32 counter = 0; counter < kOpsNum / threads_num; counter++)
+								{
+									if (auto* node = stack.Pop())
+									{
+										stack.Push(*node);
+									}
+								}
+							});
+					}
+					const auto begin = std::chrono::high_resolution_clock::now();
+					start.store(true, std::memory_order_release);
+					for (std::thread& thread : threads)
+					{
+						thread.join();
+					}
+					const std::chrono::duration<double, std::milli> duration = std::chrono::high_resolution_clock::now() - begin;
+					std::cout << name << ", " << threads_num << " threads: " << duration.count() << "ms" << std::endl;
+				}
+				while (stack.Pop())
+				{}
+			};
+
+		{
+			lock_free::Stack<SweepNode> stack;
+			Sweep(stack, sweep_nodes, "Stack, no contention management");
+		}
+		{
+			lock_free::Stack<SweepNode, lock_free::ExponentialBackoff<>> stack;
+			Sweep(stack, sweep_nodes, "Stack, exponential backoff");
+		}
+		{
+			lock_free::Stack<SweepNode, lock_free::EliminationBackoff<>> stack;
+			Sweep(stack, sweep_nodes, "Stack, elimination");
+		}
+		{
+			lock_free::PointerBasedStack<SweepPointerNode> stack(sweep_pointer_nodes.data());
+			Sweep(stack, sweep_pointer_nodes, "PointerBasedStack, no contention management");
+		}
+		{
+			lock_free::PointerBasedStack<SweepPointerNode, lock_free::ExponentialBackoff<>> stack(sweep_pointer_nodes.data());
+			Sweep(stack, sweep_pointer_nodes, "PointerBasedStack, exponential backoff");
+		}
+		{
+			lock_free::PointerBasedStack<SweepPointerNode, lock_free::EliminationBackoff<>> stack(sweep_pointer_nodes.data());
+			Sweep(stack, sweep_pointer_nodes, "PointerBasedStack, elimination");
+		}
+		for (SweepNode* node : sweep_nodes)
+		{
+			sweep_pool.Return(*node);
+		}
+	}
+#endif
+#if SHARED_OVERFLOW_TEST
+	{
+		// More pending shared accesses than AccessSynchronizer::State counts, the extra ones are synced as exclusive
+		constexpr uint32 kReadersNum = 4 * AccessSynchronizer::State::kMaxSharedTasks;
+		TRefCountPtr<SampleAsset> asset_ptr(new SampleAsset{});
+		SyncHolder<SampleAsset> asset(asset_ptr.Get());
+		std::atomic<bool> release_writer = false;
+		TaskSystem::InitializeTaskOn([&](AccessScope<SampleAsset> sample)
+			{
+				sample->locked_ = true;
+				while (!release_writer.load(std::memory_order_acquire))
+				{
+					std::this_thread::yield();
+				}
+				sample->locked_ = false;
+			}, asset);
+		for (uint32 idx = 0; idx < kReadersNum; idx++)
+		{
+			TaskSystem::AsyncResume([](SyncHolder<SampleAsset> in_asset) -> TDetachCoroutine
+				{
+					SharedAccessScopeCo<SampleAsset> guard = co_await in_asset.Shared();
+					assert(!guard->locked_);
+					guard->ConstFunction();
+				}(asset));
+		}
+		release_writer.store(true, std::memory_order_release);
+		WaitForTasks();
+		assert(asset_ptr->counter_ == kReadersNum);
+		std::cout << "Shared accesses over the counted limit, executed: " << asset_ptr->counter_ << " of " << kReadersNum << std::endl;
+	}
+#endif
+#if FRAME_ALLOCATOR_TEST
+	{
+		// Frame allocation only: the coroutine completes inside the call, the frame is freed by the handle.
+		// A registered thread serves the frames from its own cache.
+		for (const bool registered : { false, true })
+		{
+			if (registered)
+			{
+				TaskSystem::RegisterExternalThread();
+			}
+			PerformTest([](uint32 idx)
+				{
+					TUniqueCoroutine<int32> coroutine = [](int32 value) -> TUniqueCoroutine<int32>
+						{
+							co_return value;
+						}(static_cast<int32>(idx));
+				}, TestDetails
+				{
+					.name = registered ? "Coroutine frame, registered" : "Coroutine frame, not registered",
+				});
+			if (registered)
+			{
+				TaskSystem::UnregisterExternalThread();
+			}
+		}
+		detail::ensure_allocator_free();
+
+		// The main thread creates the frames and the workers free them: the main thread refills, the workers spill.
+		// Threads without a cache are not counted, so the main thread is registered.
+		TaskSystem::RegisterExternalThread();
+		GetFrameAllocatorStats(true);
+		PerformTest([](uint32)
+			{
+				TaskSystem::AsyncResume(CoroutineTest(1));
+			}, TestDetails
+			{
+				.name = "Coroutine frames",
+				.included_cleanup = WaitForTasks,
+			});
+		TaskSystem::UnregisterExternalThread();
+		detail::ensure_allocator_free();
+		const FrameAllocatorStats stats = GetFrameAllocatorStats();
+		assert(stats.allocations && (stats.block_bytes >= stats.requested_bytes));
+		const uint64 average_frame = stats.requested_bytes / stats.allocations;
+		// The previous allocator: a 32-byte header and 1K, 4K or 16K blocks
+		const uint64 old_block = (average_frame + 32 <= 1024) ? 1024 : ((average_frame + 32 <= 4096) ? 4096 : 16384);
+		std::cout << "Coroutine frames: " << stats.allocations << " thread cache: " << (100.0 * stats.cache_allocations / stats.allocations)
+			<< "% external: " << stats.external_allocations << " refills: " << stats.refills << " spills: " << stats.spills << std::endl;
+		std::cout << "\t average frame: " << average_frame << " B, block: " << (stats.block_bytes / stats.allocations)
+			<< " B (previously " << old_block << " B), committed: " << (stats.committed_bytes / 1024) << " KB" << std::endl;
+	}
+#endif
+#if LATENCY_TEST
+	{
+		// Sustained load: every task spawns 3 more. Latency = time from submission to execution.
+		struct PolicyCase
+		{
+			const char* name;
+			SchedulerSettings settings;
+		};
+		const PolicyCase cases[] = {
+			{ "LIFO", SchedulerSettings{ .policy = ESchedulingPolicy::Lifo, .aging_interval = 0 } },
+			{ "LIFO with aging", SchedulerSettings{ .policy = ESchedulingPolicy::Lifo } },
+			{ "FIFO", SchedulerSettings{ .policy = ESchedulingPolicy::Fifo } },
+		};
+		for (const PolicyCase& policy_case : cases)
+		{
+			RestartWorkerThreads(0, policy_case.settings);
+			const TestDetails details
+			{
+				.num_per_body = 4,
+				.name = policy_case.name,
+				.included_cleanup = WaitForTasks
+			};
+			LatencyReporter latency(policy_case.name, details.inner_num * details.outer_num * details.num_per_body);
+			PerformTest([&](uint32)
+				{
+					const TimeType submitted = GetTime();
+					TaskSystem::InitializeTask([&latency, submitted]()
+						{
+							latency.add(GetTime() - submitted);
+							for (int32 idx = 0; idx < 3; idx++)
+							{
+								const TimeType spawned = GetTime();
+								TaskSystem::InitializeTask([&latency, spawned]()
+									{
+										latency.add(GetTime() - spawned);
+									});
+							}
+						});
+				}, details);
+			latency.display();
+		}
+		RestartWorkerThreads(0, SchedulerSettings{});
+	}
+#endif
+#if PRIORITY_TEST
+	{
+		const TestDetails details
+		{
+			.num_per_body = 8,
+			.name = "Priorities",
+			.included_cleanup = WaitForTasks
+		};
+		LatencyReporter critical_latency("Critical", details.inner_num * details.outer_num);
+		LatencyReporter background_latency("Background", details.inner_num * details.outer_num * 4);
+		PerformTest([&](uint32)
+			{
+				auto submit = [&](ETaskFlags flags, LatencyReporter& latency)
+					{
+						const TimeType submitted = GetTime();
+						TaskSystem::InitializeTask([&latency, submitted]()
+							{
+								latency.add(GetTime() - submitted);
+							}, {}, flags);
+					};
+				for (int32 idx = 0; idx < 4; idx++)
+				{
+					submit(ETaskFlags::Background, background_latency);
+				}
+				TaskSystem::InitializeTask(LambdaEmpty);
+				TaskSystem::InitializeTask(LambdaEmpty);
+				TaskSystem::InitializeTask(LambdaEmpty);
+				submit(ETaskFlags::Critical, critical_latency);
+			}, details);
+		critical_latency.display();
+		background_latency.display();
+	}
+#endif
+	{
+		std::this_thread::sleep_for(10ms); // let idle workers park
+		const SchedulerStats stats = TaskSystem::GetSchedulerStats();
+		std::cout << std::endl << "Parked workers: " << stats.parked_workers 
+			<< ", park events: " << stats.park_events 
+			<< ", wake events: " << stats.wake_events << std::endl;
+	}
 	TaskSystem::StopWorkerThreadsNoWait();
 	TaskSystem::WaitForWorkerThreadsToJoin();
 
@@ -55,6 +55,15 @@ namespace ts
 			return alt_result ? alt_result : futures_[future_idx];
 		}
 
+		// For observers, that do not take part in frames (see RegisterNeededTick).
+		// The future is done, when the current frame is.
+		TRefCountPtr<Future<uint32>> GetCurrentFrame(uint32& out_frame_id) const
+		{
+			const State state = state_.load(std::memory_order_acquire);
+			out_frame_id = state.frame_id_;
+			return futures_[state.frame_id_ % kNumberOfFutures];
+		}
+
 	private:
 		struct State
 		{
@@ -62,6 +71,7 @@ namespace ts
 			uint16 waiting_ = 0;
 			uint32 frame_id_ = 0;
 		};
+		static_assert(std::atomic<State>::is_always_lock_free);
 
 		// returns future index
 		auto InnerUpdate(auto functor)
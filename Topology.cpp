@@ -0,0 +1,225 @@
+#include "Topology.h"
+#include <algorithm>
+#include <cctype>
+#include <fstream>
+#include <iterator>
+#include <sstream>
+#include <string>
+#include <thread>
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#elif defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#endif
+
+namespace ts
+{
+#if defined(__linux__)
+	namespace
+	{
+		// "0-3,8,10-11"
+		std::vector<uint16> ParseCpuList(const std::string& list)
+		{
+			std::vector<uint16> result;
+			std::stringstream stream(list);
+			std::string range;
+			while (std::getline(stream, range, ','))
+			{
+				if (range.empty() || !std::isdigit(static_cast<unsigned char>(range[0])))
+				{
+					continue;
+				}
+				const std::size_t dash = range.find('-');
+				const uint32 first = std::stoul(range.substr(0, dash));
+				const uint32 last = (dash == std::string::npos) ? first : std::stoul(range.substr(dash + 1));
+				for (uint32 cpu = first; cpu <= last; cpu++)
+				{
+					result.push_back(static_cast<uint16>(cpu));
+				}
+			}
+			return result;
+		}
+
+		bool ReadLine(const std::string& path, std::string& out_line)
+		{
+			std::ifstream file(path);
+			return file && std::getline(file, out_line);
+		}
+
+		uint16 ReadNumber(const std::string& path, uint16 default_value)
+		{
+			std::string line;
+			return (ReadLine(path, line) && !line.empty() && std::isdigit(static_cast<unsigned char>(line[0])))
+				? static_cast<uint16>(std::stoul(line))
+				: default_value;
+		}
+	}
+#endif
+
+	CpuTopology::CpuTopology()
+	{
+#if defined(__linux__)
+		std::string line;
+		if (ReadLine("/sys/devices/system/cpu/online", line))
+		{
+			cpu_set_t allowed;
+			CPU_ZERO(&allowed);
+			const bool has_affinity = !sched_getaffinity(0, sizeof(allowed), &allowed);
+			for (const uint16 cpu : ParseCpuList(line))
+			{
+				if (has_affinity && (cpu < CPU_SETSIZE) && !CPU_ISSET(cpu, &allowed))
+				{
+					continue; // e.g. a container limited by cpuset
+				}
+				const std::string topology = "/sys/devices/system/cpu/cpu" + std::to_string(cpu) + "/topology/";
+				cpus_.push_back(CpuInfo
+					{
+						.cpu_id = cpu,
+						.core_id = ReadNumber(topology + "core_id", cpu),
+						.package_id = ReadNumber(topology + "physical_package_id", 0),
+					});
+			}
+		}
+
+		if (ReadLine("/sys/devices/system/node/online", line))
+		{
+			const std::vector<uint16> nodes = ParseCpuList(line);
+			numa_nodes_num_ = nodes.empty() ? 1 : static_cast<uint16>(nodes.back() + 1);
+			distances_.assign(numa_nodes_num_ * numa_nodes_num_, 10);
+			for (const uint16 node : nodes)
+			{
+				const std::string node_path = "/sys/devices/system/node/node" + std::to_string(node) + "/";
+				if (ReadLine(node_path + "cpulist", line))
+				{
+					for (const uint16 cpu : ParseCpuList(line))
+					{
+						for (CpuInfo& info : cpus_)
+						{
+							if (info.cpu_id == cpu)
+							{
+								info.numa_node = node;
+							}
+						}
+					}
+				}
+				if (ReadLine(node_path + "distance", line))
+				{
+					std::stringstream stream(line);
+					uint32 distance = 0;
+					for (uint16 to_node = 0; (to_node < numa_nodes_num_) && (stream >> distance); to_node++)
+					{
+						distances_[node * numa_nodes_num_ + to_node] = distance;
+					}
+				}
+			}
+		}
+#endif
+		if (cpus_.empty())
+		{
+			const uint16 cpus_num = static_cast<uint16>(std::max(std::thread::hardware_concurrency(), 1u));
+			for (uint16 cpu = 0; cpu < cpus_num; cpu++)
+			{
+				cpus_.push_back(CpuInfo{ .cpu_id = cpu, .core_id = cpu });
+			}
+		}
+		if (distances_.empty())
+		{
+			numa_nodes_num_ = 1;
+			distances_.assign(1, 10);
+		}
+	}
+
+	const CpuTopology& CpuTopology::Get()
+	{
+		static const CpuTopology topology;
+		return topology;
+	}
+
+	uint32 CpuTopology::GetNumaDistance(uint16 from_node, uint16 to_node) const
+	{
+		assert((from_node < numa_nodes_num_) && (to_node < numa_nodes_num_));
+		return distances_[from_node * numa_nodes_num_ + to_node];
+	}
+
+	std::vector<CpuInfo> CpuTopology::SelectWorkerCpus(uint16 num_workers) const
+	{
+		// Sibling rank - the number of hyper-threads of the same core listed before
+		std::vector<std::pair<uint16, CpuInfo>> ranked;
+		ranked.reserve(cpus_.size());
+		for (const CpuInfo& cpu : cpus_)
+		{
+			const uint16 rank = static_cast<uint16>(std::count_if(ranked.begin(), ranked.end(), [&](const auto& other)
+				{
+					return (other.second.core_id == cpu.core_id) && (other.second.package_id == cpu.package_id);
+				}));
+			ranked.emplace_back(rank, cpu);
+		}
+		std::stable_sort(ranked.begin(), ranked.end(), [](const auto& a, const auto& b)
+			{
+				return a.first < b.first;
+			});
+
+		std::vector<CpuInfo> result;
+		result.reserve(num_workers);
+		for (uint16 idx = 0; idx < num_workers; idx++)
+		{
+			result.push_back(ranked[idx % ranked.size()].second);
+		}
+		std::stable_sort(result.begin(), result.end(), [](const CpuInfo& a, const CpuInfo& b)
+			{
+				return a.numa_node < b.numa_node;
+			});
+		return result;
+	}
+
+	bool CpuTopology::PinCurrentThread(uint16 cpu_id)
+	{
+#if defined(__linux__)
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(cpu_id, &set);
+		return !pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#elif defined(_WIN32)
+		return (cpu_id < 64) && SetThreadAffinityMask(GetCurrentThread(), DWORD_PTR(1) << cpu_id);
+#else
+		return false;
+#endif
+	}
+
+	void CpuTopology::BindMemoryToNode(const void* begin, const void* end, uint16 numa_node) const
+	{
+#if defined(__linux__) && defined(SYS_mbind)
+		if (numa_nodes_num_ < 2)
+		{
+			return;
+		}
+		const uintptr_t page_size = static_cast<uintptr_t>(sysconf(_SC_PAGESIZE));
+		const uintptr_t first_page = (reinterpret_cast<uintptr_t>(begin) + page_size - 1) & ~(page_size - 1);
+		const uintptr_t end_page = reinterpret_cast<uintptr_t>(end) & ~(page_size - 1);
+		if (end_page <= first_page)
+		{
+			return; // the slab does not cover a whole page
+		}
+		constexpr int kMpolPreferred = 1; // MPOL_PREFERRED from numaif.h, libnuma is not required
+		constexpr unsigned kMpolMfMove = 1u << 1; // MPOL_MF_MOVE
+		constexpr uint32 kMaskBits = 8 * sizeof(unsigned long);
+		unsigned long node_mask[1024 / kMaskBits] = {}; // MAX_NUMNODES of common kernel configs
+		if (numa_node >= std::size(node_mask) * kMaskBits)
+		{
+			return;
+		}
+		node_mask[numa_node / kMaskBits] = 1ul << (numa_node % kMaskBits);
+		syscall(SYS_mbind, first_page, end_page - first_page, kMpolPreferred, node_mask, std::size(node_mask) * kMaskBits + 1, kMpolMfMove);
+#else
+		(void)begin;
+		(void)end;
+		(void)numa_node;
+#endif
+	}
+}
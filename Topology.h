@@ -0,0 +1,49 @@
+#pragma once
+
+#include "Common.h"
+#include <span>
+#include <vector>
+
+namespace ts
+{
+	struct CpuInfo
+	{
+		uint16 cpu_id = 0; // logical cpu, as used by the OS affinity API
+		uint16 core_id = 0; // physical core, hyper-threads of the same core share it
+		uint16 package_id = 0; // socket
+		uint16 numa_node = 0;
+	};
+
+	// Read once from /sys/devices/system/cpu and /sys/devices/system/node (Linux).
+	// Elsewhere, or when sysfs is not available, all cpus are reported as separate cores on a single node.
+	class CpuTopology
+	{
+	public:
+		static const CpuTopology& Get();
+
+		// Only cpus the process is allowed to run on
+		std::span<const CpuInfo> GetCpus() const { return cpus_; }
+
+		uint16 GetNumaNodesNum() const { return numa_nodes_num_; }
+
+		// Relative access cost (10 means local), from /sys/devices/system/node/node*/distance
+		uint32 GetNumaDistance(uint16 from_node, uint16 to_node) const;
+
+		// Cpus for worker threads: first a single hyper-thread of each physical core, then the siblings.
+		// The result is ordered by numa node, so workers with close indices share a node.
+		// When there are more workers than cpus, the cpus are reused.
+		std::vector<CpuInfo> SelectWorkerCpus(uint16 num_workers) const;
+
+		static bool PinCurrentThread(uint16 cpu_id);
+
+		// Migrates the memory pages fully contained in [begin, end) to the numa node. No-op on a single node.
+		void BindMemoryToNode(const void* begin, const void* end, uint16 numa_node) const;
+
+	private:
+		CpuTopology();
+
+		std::vector<CpuInfo> cpus_;
+		std::vector<uint32> distances_; // numa_nodes_num_ x numa_nodes_num_
+		uint16 numa_nodes_num_ = 1;
+	};
+}